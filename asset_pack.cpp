@@ -0,0 +1,246 @@
+#include "asset_pack.hpp"
+#include "utils.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <mutex>
+
+using namespace std;
+
+namespace Blit
+{
+   // Packs start with magic, version, a byte order mark, the file count and the name of the .game
+   // file (length, bytes), all little endian. Then comes an entry per file (name offset, name length,
+   // kind, width, height, data offset, data size) sorted by name, then the names, then the files
+   // themselves, each aligned to blob_align. Pre-decoded files are stored in native byte order,
+   // which the byte order mark is for.
+   namespace
+   {
+      enum { pack_magic = 0x4b415044, pack_version = 2, byte_order = 0x01020304 }; // "DPAK"
+      enum { header_words = 5, entry_words = 7, blob_align = 64 };
+
+      struct Mount
+      {
+         mutex lock;
+         shared_ptr<const AssetPack> pack;
+         string root;
+      };
+
+      Mount& mount_point()
+      {
+         static Mount mount;
+         return mount;
+      }
+
+      void put_le32(vector<uint8_t>& out, uint32_t value)
+      {
+         for (unsigned i = 0; i < 4; i++)
+            out.push_back(value >> (8 * i));
+      }
+
+      bool name_less(const char *a, size_t a_size, const char *b, size_t b_size)
+      {
+         int cmp = memcmp(a, b, min(a_size, b_size));
+         return cmp ? cmp < 0 : a_size < b_size;
+      }
+   }
+
+   AssetPack::AssetPack(const string& path)
+   {
+      if (!file.open(path))
+         throw runtime_error(Utils::join("Failed to open asset pack: ", path, "."));
+
+      const uint8_t *data = file.data();
+      size_t size = file.size();
+
+      uint32_t native_order = byte_order;
+      if (size < header_words * 4 || Utils::read_le32(data) != pack_magic)
+         throw logic_error(Utils::join("Not an asset pack: ", path, "."));
+      if (Utils::read_le32(data + 4) != pack_version)
+         throw logic_error(Utils::join("Asset pack has unsupported version: ", path, "."));
+      if (memcmp(data + 8, &native_order, 4))
+         throw logic_error(Utils::join("Asset pack was built for another byte order: ", path, "."));
+
+      size_t count     = Utils::read_le32(data + 12);
+      size_t main_size = Utils::read_le32(data + 16);
+      size_t table     = header_words * 4 + main_size;
+
+      if (main_size > size - header_words * 4 || count > (size - table) / (entry_words * 4))
+         throw logic_error(Utils::join("Asset pack is malformed: ", path, "."));
+
+      m_main.assign(reinterpret_cast<const char*>(data + header_words * 4), main_size);
+
+      entries.resize(count);
+      for (size_t i = 0; i < count; i++)
+      {
+         const uint8_t *ptr = data + table + i * entry_words * 4;
+         Entry& entry = entries[i];
+
+         uint32_t name_offset = Utils::read_le32(ptr);
+         entry.name_size      = Utils::read_le32(ptr + 4);
+         uint32_t kind        = Utils::read_le32(ptr + 8);
+         entry.format.width   = Utils::read_le32(ptr + 12);
+         entry.format.height  = Utils::read_le32(ptr + 16);
+         entry.offset         = Utils::read_le32(ptr + 20);
+         entry.size           = Utils::read_le32(ptr + 24);
+
+         if (name_offset > size || entry.name_size > size - name_offset ||
+               entry.offset > size || entry.size > size - entry.offset || kind > PCM)
+            throw logic_error(Utils::join("Asset pack is malformed: ", path, "."));
+
+         entry.name        = reinterpret_cast<const char*>(data + name_offset);
+         entry.format.kind = static_cast<Kind>(kind);
+
+         if (i && !name_less(entries[i - 1].name, entries[i - 1].name_size, entry.name, entry.name_size))
+            throw logic_error(Utils::join("Asset pack is not sorted: ", path, "."));
+      }
+   }
+
+   void AssetPack::write(const string& path, const string& main, vector<File> files)
+   {
+      sort(begin(files), end(files), [](const File& a, const File& b) { return a.name < b.name; });
+
+      vector<uint8_t> out;
+      put_le32(out, pack_magic);
+      put_le32(out, pack_version);
+      uint32_t native_order = byte_order;
+      out.insert(out.end(), reinterpret_cast<const uint8_t*>(&native_order),
+            reinterpret_cast<const uint8_t*>(&native_order) + 4);
+      put_le32(out, files.size());
+      put_le32(out, main.size());
+      out.insert(out.end(), main.begin(), main.end());
+
+      size_t name_offset = out.size() + files.size() * entry_words * 4;
+      size_t data_offset = name_offset;
+      for (auto& file : files)
+         data_offset += file.name.size();
+
+      for (auto& file : files)
+      {
+         data_offset = (data_offset + blob_align - 1) & ~size_t(blob_align - 1);
+         if (data_offset + file.data.size() > 0xffffffffu)
+            throw logic_error("Asset pack would be larger than 4 GiB.");
+
+         put_le32(out, name_offset);
+         put_le32(out, file.name.size());
+         put_le32(out, file.format.kind);
+         put_le32(out, file.format.width);
+         put_le32(out, file.format.height);
+         put_le32(out, data_offset);
+         put_le32(out, file.data.size());
+
+         name_offset += file.name.size();
+         data_offset += file.data.size();
+      }
+
+      for (auto& file : files)
+         out.insert(out.end(), file.name.begin(), file.name.end());
+
+      for (auto& file : files)
+      {
+         out.resize((out.size() + blob_align - 1) & ~size_t(blob_align - 1));
+         out.insert(out.end(), file.data.begin(), file.data.end());
+      }
+
+      FILE *file = fopen(path.c_str(), "wb");
+      if (!file)
+         throw runtime_error(Utils::join("Failed to open asset pack for writing: ", path, "."));
+
+      bool ok = fwrite(out.data(), 1, out.size(), file) == out.size();
+      ok = fclose(file) == 0 && ok;
+      if (!ok)
+         throw runtime_error(Utils::join("Failed to write asset pack: ", path, "."));
+   }
+
+   bool AssetPack::find(const string& name, const uint8_t*& data, size_t& size, Format& format) const
+   {
+      auto itr = lower_bound(begin(entries), end(entries), name, [](const Entry& entry, const string& name) {
+               return name_less(entry.name, entry.name_size, name.data(), name.size());
+            });
+
+      if (itr == end(entries) || itr->name_size != name.size() || memcmp(itr->name, name.data(), name.size()))
+         return false;
+
+      data   = file.data() + itr->offset;
+      size   = itr->size;
+      format = itr->format;
+      return true;
+   }
+
+   void AssetPack::mount(shared_ptr<const AssetPack> pack, const string& root)
+   {
+      Mount& mount = mount_point();
+      lock_guard<mutex> hold(mount.lock);
+      mount.pack = move(pack);
+      mount.root = Utils::canonical_path(root);
+   }
+
+   shared_ptr<const AssetPack> AssetPack::mounted()
+   {
+      Mount& mount = mount_point();
+      lock_guard<mutex> hold(mount.lock);
+      return mount.pack;
+   }
+
+   string AssetPack::mount_content(const string& path)
+   {
+      string ext = Utils::tolower(path.substr(path.size() - min<size_t>(path.size(), 5)));
+      if (ext != ".pack")
+      {
+         mount(nullptr, "");
+         return path;
+      }
+
+      auto pack = make_shared<AssetPack>(path);
+      string game = Utils::join(Utils::basedir(path), "/", pack->main());
+      mount(move(pack), Utils::basedir(path));
+      return game;
+   }
+
+   bool AssetPack::open(const string& path, MappedFile& file, Format *format)
+   {
+      shared_ptr<const AssetPack> pack;
+      string root;
+      {
+         Mount& mount = mount_point();
+         lock_guard<mutex> hold(mount.lock);
+         pack = mount.pack;
+         root = mount.root;
+      }
+
+      if (pack)
+      {
+         string name = Utils::canonical_path(path);
+         bool inside = false;
+         if (root == ".")
+            inside = name.compare(0, 3, "../") && name != ".." && name[0] != '/';
+         else if (name.size() > root.size() && !name.compare(0, root.size(), root) && name[root.size()] == '/')
+         {
+            name.erase(0, root.size() + 1);
+            inside = true;
+         }
+
+         const uint8_t *data;
+         size_t size;
+         Format packed;
+         if (inside && pack->find(name, data, size, packed))
+         {
+            if (format)
+               *format = packed;
+            file.view(move(pack), data, size);
+            return true;
+         }
+      }
+
+      if (format)
+         *format = Format();
+      return file.open(path);
+   }
+
+   bool AssetPack::load_xml(pugi::xml_document& doc, const string& path)
+   {
+      MappedFile file;
+      return open(path, file) && doc.load_buffer(file.data(), file.size());
+   }
+}
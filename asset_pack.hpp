@@ -0,0 +1,87 @@
+#ifndef ASSET_PACK_HPP__
+#define ASSET_PACK_HPP__
+
+#include "mapped_file.hpp"
+#include "pugixml/pugixml.hpp"
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Blit
+{
+   // All files of a game in a single file, which is mapped once and read in place.
+   // While a pack is mounted, files under the directory it was built from are read from the pack,
+   // and everything else from disk. Files can be packed as they are, or pre-decoded so loading
+   // them is a copy: images as pixels and sound effects as PCM.
+   // Safe to use from several threads.
+   class AssetPack
+   {
+      public:
+         enum Kind
+         {
+            Raw    = 0,
+            Pixels = 1, // Pixel values, width * height of them.
+            PCM    = 2  // 16-bit samples, width frames of height (1 or 2) interleaved channels.
+         };
+
+         struct Format
+         {
+            Format() : kind(Raw), width(0), height(0) {}
+
+            Kind kind;
+            unsigned width, height;
+         };
+
+         struct File
+         {
+            std::string name; // Relative to the root of the pack.
+            Format format;
+            std::vector<uint8_t> data;
+         };
+
+         // Throws if path isn't a valid pack.
+         explicit AssetPack(const std::string& path);
+
+         // Writes a pack. main names the .game file, which is what gets loaded when the pack is.
+         static void write(const std::string& path, const std::string& main, std::vector<File> files);
+
+         // The .game file, relative to the root.
+         const std::string& main() const { return m_main; }
+         std::size_t size() const { return entries.size(); }
+         std::size_t bytes() const { return file.size(); }
+
+         // Looks up a path relative to the root. Returns false if it's not in the pack.
+         bool find(const std::string& name, const uint8_t*& data, std::size_t& size, Format& format) const;
+
+         // Makes the files of pack available under root, replacing the previous pack if any.
+         // Passing NULL unmounts.
+         static void mount(std::shared_ptr<const AssetPack> pack, const std::string& root);
+         static std::shared_ptr<const AssetPack> mounted();
+
+         // If path is a pack, mounts it next to itself and returns the path of its .game file.
+         // Otherwise unmounts any pack and returns path as is.
+         static std::string mount_content(const std::string& path);
+
+         // Opens a file from the mounted pack if it's in there, and from disk otherwise.
+         // Files on disk are always Raw.
+         static bool open(const std::string& path, MappedFile& file, Format *format = NULL);
+         static bool load_xml(pugi::xml_document& doc, const std::string& path);
+
+      private:
+         struct Entry
+         {
+            const char *name;
+            uint32_t name_size;
+            Format format;
+            uint32_t offset, size;
+         };
+
+         MappedFile file;
+         std::vector<Entry> entries; // Sorted by name.
+         std::string m_main;
+   };
+}
+
+#endif
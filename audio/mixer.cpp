@@ -1,182 +1,448 @@
 #include "mixer.hpp"
 #ifndef USE_CXX03
 #include "../utils.hpp"
+#include "../asset_pack.hpp"
 #include <algorithm>
 #include <stdexcept>
 #include <iostream>
-#include <fstream>
 
-#include <audio/audio_mix.h>
-#include <audio/conversion/float_to_s16.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 using namespace Blit::Utils;
 using namespace std;
 
-typedef lock_guard<recursive_mutex> LockGuard;
-
 namespace Audio
 {
-   Mixer::Mixer() : master_vol(1.0f)
+   // Plenty for a frame's worth of sound effects. Changes are dropped rather than waited on when
+   // the audio thread falls this far behind.
+   static const size_t command_queue_size = 1024;
+
+   // Adds in * gain to bus.
+   static void accumulate(float *bus, const float *in, float gain, size_t samples)
    {
-      m_enabled = Blit::Utils::make_unique<std::atomic<unsigned>>();
-      m_lock = Blit::Utils::make_unique<recursive_mutex>();
+      size_t i = 0;
+#if defined(__AVX2__)
+      __m256 gain8 = _mm256_set1_ps(gain);
+      for (; i + 8 <= samples; i += 8)
+         _mm256_storeu_ps(bus + i, _mm256_add_ps(_mm256_loadu_ps(bus + i),
+                  _mm256_mul_ps(_mm256_loadu_ps(in + i), gain8)));
+#elif defined(__SSE2__)
+      __m128 gain4 = _mm_set1_ps(gain);
+      for (; i + 4 <= samples; i += 4)
+         _mm_storeu_ps(bus + i, _mm_add_ps(_mm_loadu_ps(bus + i), _mm_mul_ps(_mm_loadu_ps(in + i), gain4)));
+#endif
+      for (; i < samples; i++)
+         bus[i] += in[i] * gain;
    }
 
-   void Mixer::add_stream(shared_ptr<Stream> str)
+   // Adds interleaved stereo s16 samples times gain to bus.
+   static void accumulate(float *bus, const int16_t *in, float gain, size_t samples)
    {
-      LockGuard guard(*m_lock);
-      streams.push_back(move(str));
+      size_t i = 0;
+      gain /= 0x8000;
+#if defined(__AVX2__)
+      __m256 gain8 = _mm256_set1_ps(gain);
+      for (; i + 8 <= samples; i += 8)
+      {
+         __m256i ints = _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)));
+         _mm256_storeu_ps(bus + i, _mm256_add_ps(_mm256_loadu_ps(bus + i),
+                  _mm256_mul_ps(_mm256_cvtepi32_ps(ints), gain8)));
+      }
+#elif defined(__SSE2__)
+      __m128 gain4 = _mm_set1_ps(gain);
+      for (; i + 8 <= samples; i += 8)
+      {
+         __m128i in8 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+         // Sign extends by moving each sample to the top half of a 32-bit lane and back down.
+         __m128 lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(in8, in8), 16));
+         __m128 hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(in8, in8), 16));
+         _mm_storeu_ps(bus + i + 0, _mm_add_ps(_mm_loadu_ps(bus + i + 0), _mm_mul_ps(lo, gain4)));
+         _mm_storeu_ps(bus + i + 4, _mm_add_ps(_mm_loadu_ps(bus + i + 4), _mm_mul_ps(hi, gain4)));
+      }
+#endif
+      for (; i < samples; i++)
+         bus[i] += in[i] * gain;
    }
 
-   static bool erase_mixer_stream(const shared_ptr<Stream> &str)
+   // Adds mono s16 samples times gain to both channels of bus.
+   static void accumulate_mono(float *bus, const int16_t *in, float gain, size_t frames)
    {
-      return !str->valid();
+      size_t i = 0;
+      gain /= 0x8000;
+#if defined(__AVX2__)
+      __m256 gain8 = _mm256_set1_ps(gain);
+      for (; i + 8 <= frames; i += 8)
+      {
+         __m256i ints = _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)));
+         __m256 mono  = _mm256_mul_ps(_mm256_cvtepi32_ps(ints), gain8);
+         // Doubles up within each 128-bit lane, then puts the lanes back in order.
+         __m256 lo = _mm256_unpacklo_ps(mono, mono);
+         __m256 hi = _mm256_unpackhi_ps(mono, mono);
+         float *out = bus + 2 * i;
+         _mm256_storeu_ps(out + 0, _mm256_add_ps(_mm256_loadu_ps(out + 0), _mm256_permute2f128_ps(lo, hi, 0x20)));
+         _mm256_storeu_ps(out + 8, _mm256_add_ps(_mm256_loadu_ps(out + 8), _mm256_permute2f128_ps(lo, hi, 0x31)));
+      }
+#elif defined(__SSE2__)
+      __m128 gain4 = _mm_set1_ps(gain);
+      for (; i + 4 <= frames; i += 4)
+      {
+         __m128i in4 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(in + i));
+         __m128 mono = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(in4, in4), 16)), gain4);
+         float *out  = bus + 2 * i;
+         _mm_storeu_ps(out + 0, _mm_add_ps(_mm_loadu_ps(out + 0), _mm_unpacklo_ps(mono, mono)));
+         _mm_storeu_ps(out + 4, _mm_add_ps(_mm_loadu_ps(out + 4), _mm_unpackhi_ps(mono, mono)));
+      }
+#endif
+      for (; i < frames; i++)
+      {
+         float sample   = in[i] * gain;
+         bus[2 * i + 0] += sample;
+         bus[2 * i + 1] += sample;
+      }
    }
 
-   void Mixer::purge_dead_streams()
+   static void output(float *out, const float *bus, float gain, size_t samples)
    {
-      LockGuard guard(*m_lock);
-      streams.erase(remove_if(streams.begin(), streams.end(), erase_mixer_stream), streams.end());
+      size_t i = 0;
+#if defined(__AVX2__)
+      __m256 gain8 = _mm256_set1_ps(gain);
+      for (; i + 8 <= samples; i += 8)
+         _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_loadu_ps(bus + i), gain8));
+#elif defined(__SSE2__)
+      __m128 gain4 = _mm_set1_ps(gain);
+      for (; i + 4 <= samples; i += 4)
+         _mm_storeu_ps(out + i, _mm_mul_ps(_mm_loadu_ps(bus + i), gain4));
+#endif
+      for (; i < samples; i++)
+         out[i] = bus[i] * gain;
    }
 
-   void Mixer::render(float* out_buffer, size_t frames)
+   // Applies gain, clamps and converts to s16 in one go. Rounds to nearest.
+   static void output(int16_t *out, const float *bus, float gain, size_t samples)
    {
-      LockGuard guard(*m_lock);
-      purge_dead_streams();
-
-      fill(out_buffer, out_buffer + frames * channels, 0.0f);
-
-      buffer.reserve(frames * channels);
-      for (auto& stream : streams)
+      size_t i = 0;
+      gain *= 0x8000;
+#if defined(__AVX2__)
+      __m256 gain8 = _mm256_set1_ps(gain);
+      __m256 lo8   = _mm256_set1_ps(-0x8000);
+      __m256 hi8   = _mm256_set1_ps(0x7fff);
+      for (; i + 16 <= samples; i += 16)
+      {
+         __m256 a = _mm256_mul_ps(_mm256_loadu_ps(bus + i + 0), gain8);
+         __m256 b = _mm256_mul_ps(_mm256_loadu_ps(bus + i + 8), gain8);
+         __m256i ints_a = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(a, lo8), hi8));
+         __m256i ints_b = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(b, lo8), hi8));
+         // Packs within each 128-bit lane, so the middle quarters come out swapped.
+         __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(ints_a, ints_b), 0xd8);
+         _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), packed);
+      }
+#elif defined(__SSE2__)
+      __m128 gain4 = _mm_set1_ps(gain);
+      __m128 lo4   = _mm_set1_ps(-0x8000);
+      __m128 hi4   = _mm_set1_ps(0x7fff);
+      for (; i + 8 <= samples; i += 8)
       {
-         long unsigned int rendered = stream->render(buffer.data(), frames);
-         audio_mix_volume(out_buffer, buffer.data(), master_vol * stream->volume(), rendered * channels);
+         __m128 a = _mm_mul_ps(_mm_loadu_ps(bus + i + 0), gain4);
+         __m128 b = _mm_mul_ps(_mm_loadu_ps(bus + i + 4), gain4);
+         __m128i ints_a = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(a, lo4), hi4));
+         __m128i ints_b = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(b, lo4), hi4));
+         _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_packs_epi32(ints_a, ints_b));
       }
+#endif
+      for (; i < samples; i++)
+         out[i] = static_cast<int16_t>(lrintf(min(max(bus[i] * gain, -32768.0f), 32767.0f)));
    }
 
-   void Mixer::render(int16_t* out_buffer, size_t frames)
+   Mixer::Mixer()
+      : commands(command_queue_size),
+      // Every stream the game has handed over fits, so the audio thread never has to hold one back.
+      retired(command_queue_size + max_streams),
+      master_vol(1.0f), bus(max_frames * channels), scratch(max_frames * channels), mix_vol(1.0f),
+      m_enabled(0), peak_voices(0), dropped(0)
+   {
+      voices.reserve(max_streams);
+   }
+
+   bool Mixer::send(Command command)
+   {
+      if (commands.write(&command, 1))
+         return true;
+
+      dropped.fetch_add(1, memory_order_relaxed);
+      return false;
+   }
+
+   void Mixer::add_stream(shared_ptr<Stream> str)
+   {
+      collect();
+
+      // Owned here until the audio thread gives it back, so it's never freed over there.
+      if (send({Command::Add, str.get(), str->volume()}))
+         owned.push_back(move(str));
+   }
+
+   void Mixer::stop(const shared_ptr<Stream>& str)
    {
-      LockGuard guard(*m_lock);
-      conv_buffer.reserve(frames * channels);
-      render(conv_buffer.data(), frames);
+      collect();
+      send({Command::Stop, str.get(), 0.0f});
+   }
 
-      convert_float_to_s16(out_buffer, conv_buffer.data(), frames * channels);
+   void Mixer::volume(const shared_ptr<Stream>& str, float vol)
+   {
+      str->volume(vol);
+      send({Command::Volume, str.get(), vol});
+   }
+
+   void Mixer::master_volume(float vol)
+   {
+      master_vol = vol;
+      send({Command::MasterVolume, nullptr, vol});
    }
 
    void Mixer::clear()
    {
-      LockGuard guard(*m_lock);
-      streams.clear();
+      collect();
+      send({Command::Clear, nullptr, 0.0f});
    }
 
-   PCMStream::PCMStream(shared_ptr<vector<float>> data)
-      : data(data), ptr(0)
-   {}
+   void Mixer::collect()
+   {
+      Stream *done[64];
+      while (size_t count = retired.read(done, 64))
+      {
+         for (size_t i = 0; i < count; i++)
+         {
+            auto itr = find_if(owned.begin(), owned.end(),
+                  [&](const shared_ptr<Stream>& str) { return str.get() == done[i]; });
+            *itr = move(owned.back());
+            owned.pop_back();
+         }
+      }
+   }
 
-   size_t PCMStream::render(float* buffer, size_t frames)
+   Mixer::Stats Mixer::stats() const
    {
-      size_t to_write = min(frames * Mixer::channels, data->size() - ptr);
+      return {owned.size(), peak_voices.load(memory_order_relaxed), dropped.load(memory_order_relaxed)};
+   }
+
+   // Audio thread from here on.
 
-      copy(begin(*data) + ptr,
-            begin(*data) + ptr + to_write,
-            buffer);
+   void Mixer::retire(unsigned voice)
+   {
+      // Can't fill up, see the constructor.
+      retired.write(&voices[voice].stream, 1);
+      voices.erase(voices.begin() + voice);
+   }
 
-      if (to_write < frames && loop())
+   void Mixer::run_commands()
+   {
+      Command command;
+      while (commands.read(&command, 1))
       {
-         size_t to_write_loop;
+         auto itr = find_if(voices.begin(), voices.end(),
+               [&](const Voice& voice) { return voice.stream == command.stream; });
 
-         rewind();
+         switch (command.type)
+         {
+            case Command::Add:
+               if (voices.size() < max_streams)
+               {
+                  voices.push_back({command.stream, command.value});
+                  if (voices.size() > peak_voices.load(memory_order_relaxed))
+                     peak_voices.store(voices.size(), memory_order_relaxed);
+               }
+               else
+               {
+                  retired.write(&command.stream, 1);
+                  dropped.fetch_add(1, memory_order_relaxed);
+               }
+               break;
+
+            case Command::Stop:
+               if (itr != voices.end())
+                  retire(itr - voices.begin());
+               break;
 
-         to_write_loop = min(frames * Mixer::channels - to_write, data->size() - (ptr + to_write));
+            case Command::Volume:
+               if (itr != voices.end())
+                  itr->volume = command.value;
+               break;
 
-         copy(begin(*data) + ptr + to_write,
-               begin(*data) + ptr + to_write + to_write_loop,
-               buffer + to_write);
+            case Command::MasterVolume:
+               mix_vol = command.value;
+               break;
 
-         to_write += to_write_loop;
+            case Command::Clear:
+               while (!voices.empty())
+                  retire(voices.size() - 1);
+               break;
+         }
       }
+   }
+
+   // Sums every voice into the bus, at most max_frames.
+   void Mixer::mix(size_t frames)
+   {
+      fill(bus.begin(), bus.begin() + frames * channels, 0.0f);
+
+      for (unsigned i = 0; i < voices.size(); )
+      {
+         Stream *stream = voices[i].stream;
+         stream->mix(bus.data(), scratch.data(), frames, voices[i].volume);
 
-      ptr += to_write;
-      return to_write / Mixer::channels;
+         if (stream->valid())
+            i++;
+         else
+            retire(i);
+      }
    }
 
-   vector<float> WAVFile::load_wave(const string& path)
+   template <typename T>
+   void Mixer::render_output(T *out_buffer, size_t frames)
    {
-      using namespace Blit::Utils;
-      ifstream file;
+      run_commands();
 
-      file.exceptions(ifstream::badbit | ifstream::failbit | ifstream::eofbit);
-      try
+      for (size_t done = 0; done < frames; )
+      {
+         size_t chunk = min<size_t>(frames - done, max_frames);
+         mix(chunk);
+         output(out_buffer + done * channels, bus.data(), mix_vol, chunk * channels);
+         done += chunk;
+      }
+   }
+
+   void Mixer::render(float* out_buffer, size_t frames)
+   {
+      render_output(out_buffer, frames);
+   }
+
+   void Mixer::render(int16_t* out_buffer, size_t frames)
+   {
+      render_output(out_buffer, frames);
+   }
+
+   PCMStream::PCMStream(shared_ptr<const PCM> data)
+      : data(data), ptr(0)
+   {}
+
+   size_t Stream::mix(float *bus, float *scratch, size_t frames, float gain)
+   {
+      size_t rendered = render(scratch, frames);
+      accumulate(bus, scratch, gain, rendered * Mixer::channels);
+      return rendered;
+   }
+
+   // Hands func the next frames in one or, when looping around, more runs.
+   template <typename F>
+   size_t PCMStream::play(size_t frames, F func)
+   {
+      size_t written = 0;
+      for (;;)
       {
-         char header[44];
-         vector<int16_t> wave;
-         vector<float> pcm_data;
+         size_t pos      = ptr;
+         size_t to_write = min(frames - written, data->frames() - pos);
+         func(data->samples.data() + pos * data->channels, written, to_write);
+         written += to_write;
+         ptr      = pos + to_write;
+
+         if (written == frames || !loop() || !data->frames())
+            break;
+         rewind();
+      }
 
-         file.open(path, ifstream::in | ifstream::binary);
-         file.read(header, sizeof(header));
+      return written;
+   }
 
-         if (!equal(header + 0, header + 4, "RIFF"))
-            throw logic_error("Invalid WAV file.");
+   size_t PCMStream::render(float* buffer, size_t frames)
+   {
+      fill(buffer, buffer + frames * Mixer::channels, 0.0f);
+      return mix(buffer, nullptr, frames, 1.0f);
+   }
 
-         if (!equal(header + 8, header + 12, "WAVE"))
-            throw logic_error("Invalid WAV file.");
+   size_t PCMStream::mix(float *bus, float *, size_t frames, float gain)
+   {
+      // Converted from the stored samples as they're mixed in.
+      bool mono = data->channels == 1;
+      return play(frames, [bus, gain, mono](const int16_t *in, size_t offset, size_t count) {
+         if (mono)
+            accumulate_mono(bus + offset * Mixer::channels, in, gain, count);
+         else
+            accumulate(bus + offset * Mixer::channels, in, gain, count * Mixer::channels);
+      });
+   }
 
-         if (!equal(header + 12, header + 16, "fmt "))
-            throw logic_error("Invalid WAV file.");
+   PCM WAVFile::load_wave(const string& path)
+   {
+      Blit::MappedFile file;
+      Blit::AssetPack::Format format;
+      if (!Blit::AssetPack::open(path, file, &format))
+         throw runtime_error("Failed to open wave.");
 
-         if (read_le16(header + 20) != 1)
-            throw logic_error("WAV file not uncompressed.");
+      PCM pcm;
+      if (format.kind == Blit::AssetPack::PCM)
+      {
+         if ((format.height != 1 && format.height != 2) ||
+               file.size() != format.width * format.height * sizeof(int16_t))
+            throw logic_error("Packed wave has the wrong size.");
+
+         pcm.channels = format.height;
+         pcm.samples.resize(format.width * format.height);
+         memcpy(pcm.samples.data(), file.data(), file.size());
+         return pcm;
+      }
 
-         unsigned channels    = read_le16(header + 22);
-         unsigned sample_rate = read_le32(header + 24);
-         unsigned bits        = read_le16(header + 34);
+      const uint8_t *header = file.data();
+      const size_t header_size = 44;
 
-         if (channels < 1 || channels > 2)
-            throw logic_error("Invalid number of channels.");
+      if (file.size() < header_size)
+         throw runtime_error("Failed to open wave.");
 
-         if (sample_rate != 44100)
-            throw logic_error("Invalid sample rate.");
+      if (!equal(header + 0, header + 4, "RIFF"))
+         throw logic_error("Invalid WAV file.");
 
-         if (bits != 16)
-            throw logic_error("Invalid bit depth.");
+      if (!equal(header + 8, header + 12, "WAVE"))
+         throw logic_error("Invalid WAV file.");
 
-         unsigned wave_size = read_le32(header + 4);
-         wave_size += 8;
-         wave_size -= sizeof(header);
-         wave.resize(wave_size / sizeof(int16_t));
+      if (!equal(header + 12, header + 16, "fmt "))
+         throw logic_error("Invalid WAV file.");
 
-         file.read(reinterpret_cast<char*>(wave.data()), wave_size);
+      if (read_le16(header + 20) != 1)
+         throw logic_error("WAV file not uncompressed.");
 
-         if (channels == 1)
-         {
-            pcm_data.resize(2 * wave_size / sizeof(int16_t));
-            std::vector<float>::iterator ptr = pcm_data.begin();
-            for (auto val : wave)
-            {
-               float fval = static_cast<float>(val) / 0x8000;
-               *ptr++ = fval;
-               *ptr++ = fval;
-            }
+      unsigned channels    = read_le16(header + 22);
+      unsigned sample_rate = read_le32(header + 24);
+      unsigned bits        = read_le16(header + 34);
 
-         }
-         else
-         {
-            pcm_data.resize(wave_size / sizeof(int16_t));
-            std::vector<float>::iterator ptr = pcm_data.begin();
-            for (auto val : wave)
-            {
-               float fval = static_cast<float>(val) / 0x8000;
-               *ptr++ = fval;
-            }
-         }
+      if (channels < 1 || channels > 2)
+         throw logic_error("Invalid number of channels.");
 
-         return pcm_data;
-      }
-      catch (const ifstream::failure e)
-      {
-         cerr << "iostream error: " << e.what() << endl;
+      if (sample_rate != 44100)
+         throw logic_error("Invalid sample rate.");
+
+      if (bits != 16)
+         throw logic_error("Invalid bit depth.");
+
+      unsigned wave_size = read_le32(header + 4);
+      wave_size += 8;
+      wave_size -= header_size;
+
+      if (file.size() - header_size < wave_size)
          throw runtime_error("Failed to open wave.");
-      }
+
+      const uint8_t *wave = header + header_size;
+      unsigned samples = wave_size / sizeof(int16_t);
+
+      // Kept as they are, whole frames of them.
+      pcm.channels = channels;
+      pcm.samples.resize(samples - samples % channels);
+      for (unsigned i = 0; i < pcm.samples.size(); i++)
+         pcm.samples[i] = int16_t(read_le16(wave + 2 * i));
+
+      return pcm;
    }
 
    vector<float> VorbisFile::decode()
@@ -195,11 +461,16 @@ namespace Audio
    }
 
    VorbisFile::VorbisFile(const string& path)
-      : path(path), is_eof(false), is_mono(false)
+      : path(path), offset(0), is_eof(false), is_mono(false)
    {
       vorbis_info *info = NULL;
 
-      if (ov_fopen(path.c_str(), &vf) < 0)
+      if (!Blit::AssetPack::open(path, file))
+         throw runtime_error(join("Failed to open vorbis file: ", path));
+
+      // Decoded straight from the mapped file, which may be inside an asset pack.
+      ov_callbacks callbacks = { read_cb, seek_cb, NULL, tell_cb };
+      if (ov_open_callbacks(this, &vf, NULL, 0, callbacks) < 0)
          throw runtime_error(join("Failed to open vorbis file: ", path));
 
       cerr << "Vorbis info:" << endl;
@@ -232,6 +503,31 @@ namespace Audio
          throw logic_error("Couldn't find info for vorbis file.");
    }
 
+   size_t VorbisFile::read_cb(void *ptr, size_t size, size_t nmemb, void *data)
+   {
+      VorbisFile& self = *static_cast<VorbisFile*>(data);
+      size_t count = size ? min(nmemb, (self.file.size() - self.offset) / size) : 0;
+      memcpy(ptr, self.file.data() + self.offset, count * size);
+      self.offset += count * size;
+      return count;
+   }
+
+   int VorbisFile::seek_cb(void *data, ogg_int64_t offset, int whence)
+   {
+      VorbisFile& self = *static_cast<VorbisFile*>(data);
+      ogg_int64_t base = whence == SEEK_SET ? 0 : whence == SEEK_CUR ? self.offset : self.file.size();
+      if (base + offset < 0 || base + offset > static_cast<ogg_int64_t>(self.file.size()))
+         return -1;
+
+      self.offset = base + offset;
+      return 0;
+   }
+
+   long VorbisFile::tell_cb(void *data)
+   {
+      return static_cast<VorbisFile*>(data)->offset;
+   }
+
    VorbisFile::~VorbisFile()
    {
       ov_clear(&vf);
@@ -306,50 +602,63 @@ namespace Audio
       return rendered;
    }
 
-   void VorbisLoader::request_vorbis(const string& path)
-   {
-      inflight.push_back(async(launch::async, [path]() {
-                  VorbisFile file{path};
-                  return file.decode();
-               }));
-   }
-
-   static bool erase_vorbis_stream(const future<vector<float>>& fut)
+   VorbisStream::VorbisStream(const string& path, unsigned ahead_ms)
+      : path(path), ring(44100 * Mixer::channels * ahead_ms / 1000), stop(false), done(false),
+      started(false), m_underruns(0)
    {
-      return !fut.valid();
+      decoder = thread(&VorbisStream::decode, this);
    }
 
-   void VorbisLoader::cleanup()
+   VorbisStream::~VorbisStream()
    {
-      inflight.erase(remove_if(inflight.begin(), inflight.end(), erase_vorbis_stream), inflight.end());
+      stop = true;
+      decoder.join();
    }
 
-   shared_ptr<vector<float>> VorbisLoader::flush()
+   // Opened here too, as reading the headers and setting up the decoder takes a while.
+   void VorbisStream::decode()
    {
       try
       {
-         for (auto& fut : inflight)
-            if (fut.wait_for(chrono::seconds(0)) == future_status::ready)
-               finished.push(fut.get()); 
-
-         cleanup();
+         VorbisFile file(path);
+         float buffer[1024 * Mixer::channels];
+         size_t decoded = 0, written = 0;
 
-         if (finished.size())
+         while (!stop)
          {
-            std::vector<float> f = finished.front();
-            std::shared_ptr<std::vector<float> > ret = make_shared<vector<float>>(move(f));
-            finished.pop();
-            return move(ret);
+            if (written == decoded)
+            {
+               decoded = file.render(buffer, 1024) * Mixer::channels;
+               written = 0;
+               if (!decoded)
+                  break;
+            }
+
+            written += ring.write(buffer + written, decoded - written);
+
+            // Full, wait for the mixer to catch up.
+            if (written < decoded)
+               this_thread::sleep_for(chrono::milliseconds(10));
          }
-         else
-            return {};
       }
       catch (const exception& e)
       {
-         cerr << "VorbisLoader::flush() failed ... " << e.what() << endl;
-         cleanup();
-         return {};
+         cerr << "Failed to stream " << path << ": " << e.what() << endl;
       }
+
+      done = true;
+   }
+
+   size_t VorbisStream::render(float* buffer, size_t frames)
+   {
+      size_t rendered = ring.read(buffer, frames * Mixer::channels) / Mixer::channels;
+
+      // Running short at the end of the track is fine.
+      started = started || rendered;
+      if (rendered < frames && started && !done.load())
+         m_underruns++;
+
+      return rendered;
    }
 }
 #endif
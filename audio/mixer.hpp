@@ -3,17 +3,21 @@
 
 #include <stdint.h>
 #include <string.h>
-#ifndef USE_CXX03
+#include <cstddef>
 #include <vector>
+#ifndef USE_CXX03
 #include <memory>
 #include <utility>
 #include <cmath>
 #include <string>
 #include <future>
 #include <chrono>
-#include <queue>
 #include <mutex>
+#include <thread>
+#include <atomic>
 #include <vorbis/vorbisfile.h>
+#include "../mapped_file.hpp"
+#include "ring_buffer.hpp"
 #endif
 
 #ifndef M_PI
@@ -22,6 +26,18 @@
 
 namespace Audio
 {
+   // Sound effect samples as they were stored, 16-bit mono or interleaved stereo.
+   // The mixer converts them as it plays.
+   struct PCM
+   {
+      PCM() : channels(2) {}
+
+      std::vector<int16_t> samples;
+      unsigned channels;
+
+      std::size_t frames() const { return samples.size() / channels; }
+   };
+
 #ifndef USE_CXX03
    class Stream
    {
@@ -32,6 +48,10 @@ namespace Audio
          virtual bool valid() const = 0;
          virtual ~Stream() {};
 
+         // Adds frames times gain to bus, returning how many there were. Renders to scratch first
+         // unless a stream has a quicker way.
+         virtual std::size_t mix(float *bus, float *scratch, std::size_t frames, float gain);
+
          float volume() const { return m_volume; }
          void volume(float vol) { m_volume = vol; }
 
@@ -72,22 +92,24 @@ namespace Audio
    class PCMStream : public Stream
    {
       public:
-         PCMStream(std::shared_ptr<std::vector<float>> data);
+         PCMStream(std::shared_ptr<const PCM> data);
 
-         bool valid() const { return ptr < data->size(); }
+         bool valid() const { return ptr < data->frames() || loop(); }
          void rewind() { ptr = 0; }
          std::size_t render(float* buffer, std::size_t frames);
+         std::size_t mix(float *bus, float *scratch, std::size_t frames, float gain);
 
       private:
-         std::shared_ptr<std::vector<float>> data;
-         std::atomic<std::size_t> ptr;
+         std::shared_ptr<const PCM> data;
+         template <typename F> std::size_t play(std::size_t frames, F func);
+         std::atomic<std::size_t> ptr; // Frames.
    };
 
    class WAVFile
    {
       public:
          WAVFile() = delete;
-         static std::vector<float> load_wave(const std::string& path);
+         static PCM load_wave(const std::string& path);
    };
 
    class VorbisFile : public Stream
@@ -107,57 +129,120 @@ namespace Audio
 
       private:
          std::string path;
+         Blit::MappedFile file;
+         std::size_t offset;
          OggVorbis_File vf;
          bool is_eof;
          bool is_mono;
+
+         static std::size_t read_cb(void *ptr, std::size_t size, std::size_t nmemb, void *data);
+         static int seek_cb(void *data, ogg_int64_t offset, int whence);
+         static long tell_cb(void *data);
    };
 
-   class Mixer;
-   class VorbisLoader
+   // Plays a Vorbis file as a thread of its own decodes it, staying up to ahead_ms in front.
+   // Only that much of the track is ever in memory. Runs silent for a moment if the decoder
+   // falls behind.
+   class VorbisStream : public Stream
    {
       public:
-         void request_vorbis(const std::string& path);
-         std::shared_ptr<std::vector<float>> flush();
-         size_t size() const { return inflight.size(); }
+         VorbisStream(const std::string& path, unsigned ahead_ms = 500);
+         VorbisStream(const VorbisStream&) = delete;
+         void operator=(const VorbisStream&) = delete;
 
-      private:
-         std::vector<std::future<std::vector<float>>> inflight;
-         std::queue<std::vector<float>> finished;
+         ~VorbisStream();
 
-         void cleanup();
+         std::size_t render(float* buffer, std::size_t frames);
+         bool valid() const { return !done.load() || ring.read_avail(); }
+
+         unsigned underruns() const { return m_underruns; }
+         std::size_t buffer_bytes() const { return ring.size() * sizeof(float); }
+
+      private:
+         std::string path;
+         RingBuffer<float> ring;
+         std::atomic<bool> stop;
+         std::atomic<bool> done;
+         bool started;
+         unsigned m_underruns;
+         std::thread decoder;
+
+         void decode();
    };
 
+   // Mixes streams on the audio thread without ever waiting for the game. Everything but render()
+   // is for the one game thread, which hands streams and changes to the mixer through a lock-free
+   // queue. Streams that are done come back through another one and are freed on the game thread,
+   // so rendering neither frees memory nor touches reference counts.
    class Mixer
    {
       public:
          static const unsigned channels = 2;
+         static const unsigned max_streams = 256; // Playing at once, more are dropped.
+         static const unsigned max_frames  = 1024; // Mixed at once, longer renders are split up.
 
          Mixer();
+         Mixer(const Mixer&) = delete;
+         void operator=(const Mixer&) = delete;
 
          void add_stream(std::shared_ptr<Stream> str);
-
+         void stop(const std::shared_ptr<Stream>& str);
+         void volume(const std::shared_ptr<Stream>& str, float vol);
          void clear();
 
+         // Frees the streams the audio thread is done with. Called by the above too.
+         void collect();
+
          void render(float *buffer, std::size_t frames);
          void render(int16_t *buffer, std::size_t frames);
-         void master_volume(float vol) { master_vol = vol; }
+         void master_volume(float vol);
          float master_volume() const { return master_vol; }
 
-         void lock() { m_lock->lock(); }
-         void unlock() { m_lock->unlock(); }
+         void enable(bool enable) { m_enabled.store(enable); }
+         bool enabled() const { return m_enabled.load(); }
 
-         void enable(bool enable) { m_enabled->store(enable); }
-         bool enabled() const { return m_enabled->load(); }
+         struct Stats
+         {
+            std::size_t streams;  // Handed to the mixer and not freed yet.
+            unsigned peak_voices; // Most streams mixed at once.
+            unsigned dropped;     // Streams or changes lost to a full queue or max_streams.
+         };
+         Stats stats() const;
 
       private:
-         std::vector<float> buffer;
-         std::vector<float> conv_buffer;
-         std::vector<std::shared_ptr<Stream>> streams;
-         std::unique_ptr<std::recursive_mutex> m_lock;
-         std::unique_ptr<std::atomic<unsigned>> m_enabled; // Have to use pointer as std::atomic is not CopyAssignable.
+         struct Command
+         {
+            enum Type { Add, Stop, Volume, MasterVolume, Clear } type;
+            Stream *stream;
+            float value;
+         };
 
+         struct Voice
+         {
+            Stream *stream;
+            float volume;
+         };
+
+         // Game thread.
+         std::vector<std::shared_ptr<Stream>> owned;
+         RingBuffer<Command> commands;
+         RingBuffer<Stream*> retired;
          float master_vol;
-         void purge_dead_streams();
+         bool send(Command command);
+
+         // Audio thread. Nothing here allocates once constructed.
+         std::vector<float> bus;
+         std::vector<float> scratch;
+         std::vector<Voice> voices;
+         float mix_vol;
+         void run_commands();
+         void retire(unsigned voice);
+         void mix(std::size_t frames);
+         template <typename T> void render_output(T *buffer, std::size_t frames);
+
+         std::atomic<unsigned> m_enabled;
+         std::atomic<unsigned> peak_voices;
+         std::atomic<unsigned> dropped;
    };
 #else
    class Mixer
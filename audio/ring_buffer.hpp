@@ -0,0 +1,82 @@
+#ifndef RING_BUFFER_HPP__
+#define RING_BUFFER_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+namespace Audio
+{
+   // Fixed size FIFO for one thread writing and another reading, without locks.
+   // Positions only ever grow and are masked into the buffer, so its size is a power of two.
+   template <typename T>
+   class RingBuffer
+   {
+      public:
+         explicit RingBuffer(std::size_t min_size)
+            : buffer(round_up(min_size)), mask(buffer.size() - 1), read_pos(0), write_pos(0)
+         {}
+
+         RingBuffer(const RingBuffer&) = delete;
+         void operator=(const RingBuffer&) = delete;
+
+         std::size_t size() const { return buffer.size(); }
+
+         // Writer side. Writes as much of data as fits, returning how much that was.
+         std::size_t write_avail() const
+         {
+            return buffer.size() - (write_pos.load(std::memory_order_relaxed) - read_pos.load(std::memory_order_acquire));
+         }
+
+         std::size_t write(const T *data, std::size_t count)
+         {
+            std::size_t pos = write_pos.load(std::memory_order_relaxed);
+            count = std::min(count, write_avail());
+
+            std::size_t first = std::min(count, buffer.size() - (pos & mask));
+            std::copy(data, data + first, buffer.begin() + (pos & mask));
+            std::copy(data + first, data + count, buffer.begin());
+
+            write_pos.store(pos + count, std::memory_order_release);
+            return count;
+         }
+
+         // Reader side. Reads up to count, returning how much there was.
+         std::size_t read_avail() const
+         {
+            return write_pos.load(std::memory_order_acquire) - read_pos.load(std::memory_order_relaxed);
+         }
+
+         std::size_t read(T *data, std::size_t count)
+         {
+            std::size_t pos = read_pos.load(std::memory_order_relaxed);
+            count = std::min(count, read_avail());
+
+            std::size_t first = std::min(count, buffer.size() - (pos & mask));
+            std::copy(buffer.begin() + (pos & mask), buffer.begin() + (pos & mask) + first, data);
+            std::copy(buffer.begin(), buffer.begin() + (count - first), data + first);
+
+            read_pos.store(pos + count, std::memory_order_release);
+            return count;
+         }
+
+      private:
+         std::vector<T> buffer;
+         std::size_t mask;
+
+         // On cache lines of their own, as each is written by a different thread.
+         alignas(64) std::atomic<std::size_t> read_pos;
+         alignas(64) std::atomic<std::size_t> write_pos;
+
+         static std::size_t round_up(std::size_t size)
+         {
+            std::size_t pow2 = 1;
+            while (pow2 < size)
+               pow2 <<= 1;
+            return pow2;
+         }
+   };
+}
+
+#endif
@@ -16,7 +16,8 @@ namespace Icy
 
    void BGManager::step(Audio::Mixer& mixer)
    {
-      lock_guard<Audio::Mixer> guard(mixer);
+      // Frees whatever the mixer has finished playing, once a frame.
+      mixer.collect();
 
       if (current && current->valid())
          return;
@@ -24,38 +25,21 @@ namespace Icy
       if (!tracks.size())
          return;
 
-      if (!loader.size())
+      unsigned index = 0;
+      if (!first)
       {
-         if (first)
-         {
-            loader.request_vorbis(tracks[0].path);
-            last = 0;
-         }
-         else
-         {
-            unsigned index = rand() % tracks.size();
-            if (index == last)
-               index = (index + 1) % tracks.size();
-
-            loader.request_vorbis(tracks[index].path);
-            last = index;
-         }
-
-         first = false;
+         index = rand() % tracks.size();
+         if (index == last)
+            index = (index + 1) % tracks.size();
       }
 
-      std::shared_ptr<std::vector<float> > ret = loader.flush();
+      first = false;
+      last  = index;
 
-      if (ret)
-      {
-         current = make_shared<Audio::PCMStream>(ret);
-         current->volume(tracks[last].gain);
-      }
-      else
-         current.reset();
-
-      if (current)
-         mixer.add_stream(current);
+      // Decoded as it plays, a little ahead of the mixer.
+      current = make_shared<Audio::VorbisStream>(tracks[index].path);
+      current->volume(tracks[index].gain);
+      mixer.add_stream(current);
    }
 }
 #endif
@@ -0,0 +1,243 @@
+#include "disk_cache.hpp"
+#include "asset_pack.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#include <sys/types.h>
+#endif
+
+using namespace std;
+
+namespace Blit
+{
+   namespace
+   {
+      enum { magic = 0x46534344, version = 1 }; // "DCSF"
+
+      // Followed by the dependencies, each a hash, path length and path,
+      // and then the pixels.
+      struct EntryHeader
+      {
+         uint32_t magic_id;
+         uint32_t version_id;
+         uint32_t pixel_size;
+         uint32_t width;
+         uint32_t height;
+         uint32_t dependencies;
+         uint64_t key;
+      };
+
+      thread_local DiskCache::Dependencies *active_dependencies;
+   }
+
+   shared_ptr<DiskCache> DiskCache::current;
+
+   DiskCache::DiskCache(const string& dir)
+      : dir(dir), hits(0), misses(0), stale(0), stores(0)
+   {
+#ifdef _WIN32
+      _mkdir(dir.c_str());
+#else
+      mkdir(dir.c_str(), 0755);
+#endif
+   }
+
+   void DiskCache::set(shared_ptr<DiskCache> cache)
+   {
+      current = move(cache);
+   }
+
+   // FNV-1a over 64-bit words, then the remaining bytes.
+   uint64_t DiskCache::hash_bytes(const void *data, size_t size, uint64_t seed)
+   {
+      const uint8_t *bytes = static_cast<const uint8_t*>(data);
+      uint64_t hash = seed;
+
+      size_t i = 0;
+      for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+      {
+         uint64_t word;
+         memcpy(&word, bytes + i, sizeof(word));
+         hash = (hash ^ word) * 0x100000001b3ull;
+      }
+      for (; i < size; i++)
+         hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+
+      return hash;
+   }
+
+   uint64_t DiskCache::hash_file(const string& path)
+   {
+      {
+         lock_guard<mutex> hold(lock);
+         auto itr = file_hashes.find(path);
+         if (itr != file_hashes.end())
+            return itr->second;
+      }
+
+      MappedFile file;
+      uint64_t hash = 0;
+      if (AssetPack::open(path, file))
+      {
+         hash = hash_bytes(file.data(), file.size());
+         hash += !hash;
+      }
+
+      lock_guard<mutex> hold(lock);
+      file_hashes[path] = hash;
+      return hash;
+   }
+
+   string DiskCache::entry_path(uint64_t key) const
+   {
+      char name[32];
+      snprintf(name, sizeof(name), "%016llx.surf", static_cast<unsigned long long>(key));
+      return Utils::join(dir, "/", name);
+   }
+
+   shared_ptr<const Surface::Data> DiskCache::load(uint64_t key)
+   {
+      MappedFile file;
+      if (!file.open(entry_path(key)))
+      {
+         misses++;
+         return nullptr;
+      }
+
+      const uint8_t *data = file.data();
+      const uint8_t *end  = data + file.size();
+
+      EntryHeader header;
+      if (file.size() < sizeof(header))
+      {
+         stale++;
+         return nullptr;
+      }
+      memcpy(&header, data, sizeof(header));
+      data += sizeof(header);
+
+      if (header.magic_id != magic || header.version_id != version ||
+            header.pixel_size != sizeof(Pixel) || header.key != key)
+      {
+         stale++;
+         return nullptr;
+      }
+
+      for (unsigned i = 0; i < header.dependencies; i++)
+      {
+         uint64_t hash;
+         uint32_t length;
+         if (end - data < static_cast<ptrdiff_t>(sizeof(hash) + sizeof(length)))
+         {
+            stale++;
+            return nullptr;
+         }
+         memcpy(&hash, data, sizeof(hash));
+         memcpy(&length, data + sizeof(hash), sizeof(length));
+         data += sizeof(hash) + sizeof(length);
+
+         if (static_cast<size_t>(end - data) < length ||
+               hash_file(string(reinterpret_cast<const char*>(data), length)) != hash)
+         {
+            stale++;
+            return nullptr;
+         }
+         data += length;
+      }
+
+      size_t pixels = size_t(header.width) * header.height;
+      if (static_cast<size_t>(end - data) != pixels * sizeof(Pixel))
+      {
+         stale++;
+         return nullptr;
+      }
+
+      vector<Pixel> pix(pixels);
+      memcpy(pix.data(), data, pixels * sizeof(Pixel));
+
+      hits++;
+      return make_shared<Surface::Data>(move(pix), header.width, header.height);
+   }
+
+   void DiskCache::store(uint64_t key, const Surface::Data& data, const vector<string>& dependencies)
+   {
+      EntryHeader header = {
+         magic, version, sizeof(Pixel),
+         static_cast<uint32_t>(data.w), static_cast<uint32_t>(data.h),
+         static_cast<uint32_t>(dependencies.size()), key,
+      };
+
+      vector<uint8_t> deps;
+      for (auto& path : dependencies)
+      {
+         uint64_t hash   = hash_file(path);
+         uint32_t length = path.size();
+         if (!hash)
+            return;
+
+         const uint8_t *hash_bytes   = reinterpret_cast<const uint8_t*>(&hash);
+         const uint8_t *length_bytes = reinterpret_cast<const uint8_t*>(&length);
+         deps.insert(deps.end(), hash_bytes, hash_bytes + sizeof(hash));
+         deps.insert(deps.end(), length_bytes, length_bytes + sizeof(length));
+         deps.insert(deps.end(), path.begin(), path.end());
+      }
+
+      // Written under a temporary name first, so nobody maps a half written entry.
+      string path = entry_path(key);
+      string temp = Utils::join(path, ".", hash<thread::id>()(this_thread::get_id()), ".tmp");
+
+      FILE *file = fopen(temp.c_str(), "wb");
+      if (!file)
+         return;
+
+      bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+      ok = ok && fwrite(deps.data(), 1, deps.size(), file) == deps.size();
+      ok = ok && fwrite(data.pixels.data(), sizeof(Pixel), data.pixels.size(), file) == data.pixels.size();
+      ok = fclose(file) == 0 && ok;
+
+      if (ok)
+      {
+#ifdef _WIN32
+         remove(path.c_str()); // Won't rename over an existing file.
+#endif
+         ok = rename(temp.c_str(), path.c_str()) == 0;
+      }
+
+      if (!ok)
+         remove(temp.c_str());
+      else
+         stores++;
+   }
+
+   DiskCache::Stats DiskCache::stats() const
+   {
+      Stats stats = { hits, misses, stale, stores };
+      return stats;
+   }
+
+   DiskCache::Dependencies::Dependencies() : outer(active_dependencies)
+   {
+      active_dependencies = this;
+   }
+
+   DiskCache::Dependencies::~Dependencies()
+   {
+      active_dependencies = outer;
+   }
+
+   void DiskCache::depend(const string& path)
+   {
+      Dependencies *deps = active_dependencies;
+      if (!deps)
+         return;
+
+      if (find(deps->m_paths.begin(), deps->m_paths.end(), path) == deps->m_paths.end())
+         deps->m_paths.push_back(path);
+   }
+}
@@ -0,0 +1,85 @@
+#ifndef DISK_CACHE_HPP__
+#define DISK_CACHE_HPP__
+
+#include "surface.hpp"
+
+#include <stdint.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace Blit
+{
+   // Decoded surfaces kept on disk between runs, so they don't have to be decoded or rendered again.
+   // Entries are named by a hash of the bytes they were made from. An entry can also list other
+   // files it was built from along with their hashes, and is ignored once any of them changes.
+   // Safe to use from several threads.
+   class DiskCache
+   {
+      public:
+         // Creates dir if it doesn't exist.
+         explicit DiskCache(const std::string& dir);
+
+         const std::string& directory() const { return dir; }
+
+         // Hash of the contents of a file, remembered for the lifetime of the cache.
+         // Returns 0 if the file can't be read.
+         uint64_t hash_file(const std::string& path);
+         static uint64_t hash_bytes(const void *data, std::size_t size, uint64_t seed = 0xcbf29ce484222325ull);
+
+         // Returns NULL if there is no valid entry for key.
+         std::shared_ptr<const Surface::Data> load(uint64_t key);
+         void store(uint64_t key, const Surface::Data& data,
+               const std::vector<std::string>& dependencies = std::vector<std::string>());
+
+         struct Stats
+         {
+            unsigned hits;
+            unsigned misses;
+            unsigned stale;
+            unsigned stores;
+         };
+         Stats stats() const;
+
+         // The process wide cache SurfaceCache and level previews go through, or NULL if there is none.
+         // Only change it while nothing is loading.
+         static void set(std::shared_ptr<DiskCache> cache);
+         static DiskCache* get() { return current.get(); }
+
+         // Collects the paths of files loaded on this thread during its lifetime,
+         // for entries which are built from more than one file.
+         class Dependencies
+         {
+            public:
+               Dependencies();
+               ~Dependencies();
+
+               const std::vector<std::string>& paths() const { return m_paths; }
+
+            private:
+               friend class DiskCache;
+               std::vector<std::string> m_paths;
+               Dependencies *outer;
+         };
+
+         // Called by loaders for every file they read.
+         static void depend(const std::string& path);
+
+      private:
+         std::string dir;
+
+         std::mutex lock;
+         std::map<std::string, uint64_t> file_hashes;
+
+         std::atomic<unsigned> hits, misses, stale, stores;
+
+         static std::shared_ptr<DiskCache> current;
+
+         std::string entry_path(uint64_t key) const;
+   };
+}
+
+#endif
@@ -1,4 +1,5 @@
 #include "font.hpp"
+#include "asset_pack.hpp"
 #include "pugixml/pugixml.hpp"
 #include "utils.hpp"
 
@@ -16,7 +17,7 @@ namespace Blit
       string dir = Utils::basedir(font);
 
       xml_document doc;
-      if (!doc.load_file(font.c_str()))
+      if (!AssetPack::load_xml(doc, font))
          throw runtime_error(Utils::join("Failed to load font: ", font, "."));
 
       xml_node glyph       = doc.child("font").child("glyphs");
@@ -96,13 +97,19 @@ namespace Blit
    
    void FontCluster::add_font(const string& font, Pos offset, Pixel color, string id)
    {
-      std::vector<OffsetFont>& fonts = fonts_map[move(id)];
+      add_font(load_font(font, color), offset, move(id));
+   }
 
-      OffsetFont tmp(font);
+   Font FontCluster::load_font(const string& font, Pixel color)
+   {
+      Font tmp(font);
       tmp.set_color(color);
-      tmp.offset = offset;
+      return tmp;
+   }
 
-      fonts.push_back(move(tmp));
+   void FontCluster::add_font(Font font, Pos offset, string id)
+   {
+      fonts_map[move(id)].push_back(OffsetFont(move(font), offset));
    }
 
    void FontCluster::set_id(string id)
@@ -145,7 +152,7 @@ namespace Blit
          font->render_msg(target, msg, x, y, dir, newline_offset);
    }
 
-   FontCluster::OffsetFont::OffsetFont(const string& font) : Font(font)
+   FontCluster::OffsetFont::OffsetFont(Font font, Pos offset) : Font(move(font)), offset(offset)
    {}
 
    void FontCluster::OffsetFont::render_msg(RenderTarget& target, const string& msg,
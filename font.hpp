@@ -43,6 +43,10 @@ namespace Blit
          Pos glyph_size() const;
 
          void add_font(const std::string& font, Pos offset, Pixel color, std::string id = "");
+
+         // The above in two steps, so fonts can be loaded on other threads and added in order.
+         static Font load_font(const std::string& font, Pixel color);
+         void add_font(Font font, Pos offset, std::string id = "");
          void set_id(std::string id);
          void render_msg(RenderTarget& target, const std::string& msg, int x, int y,
                Font::RenderAlignment dir = Font::Left, int newline_offset = 0) const;
@@ -53,7 +57,7 @@ namespace Blit
             OffsetFont()
             {
             }
-            OffsetFont(const std::string& font);
+            OffsetFont(Font font, Pos offset);
 
             void render_msg(RenderTarget& target, const std::string& msg, int x, int y,
                   Font::RenderAlignment dir, int newline_offset) const;
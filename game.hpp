@@ -4,12 +4,19 @@
 #include "surface.hpp"
 #include "tilemap.hpp"
 #include "font.hpp"
+#include "game_state.hpp"
+#include "job_pool.hpp"
 #include "audio/mixer.hpp"
 
 #include <string>
 #include <functional>
 #include <cstddef>
 #include <functional>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
 
 #include "libretro.h"
 
@@ -18,31 +25,28 @@ namespace Icy
    Audio::Mixer& get_mixer();
    const std::string& get_basedir();
 
-   enum class Input : unsigned
-   {
-      Up = 0,
-      Down,
-      Left,
-      Right,
-      Push,
-      Menu,
-      Reset,
-      None
-   };
-
    class SFXManager
    {
 #ifndef USE_CXX03
       public:
+         SFXManager() : muted(false) {}
+
          void add_stream(const std::string &ident, const std::string &path);
+         void add_effect(const std::string &ident, std::shared_ptr<const Audio::PCM> pcm);
          void play_sfx(const std::string &ident, float volume = 1.0f) const;
 
+         // While muted, play_sfx() does nothing. Used for frames which are simulated and then rolled back.
+         void mute(bool mute) { muted = mute; }
+
       private:
-         std::map<std::string, std::shared_ptr<std::vector<float>>> effects;
+         std::map<std::string, std::shared_ptr<const Audio::PCM>> effects;
+         bool muted;
 #else
       public:
          void add_stream(const std::string &ident, const std::string &path) {}
+         void add_effect(const std::string &ident, std::shared_ptr<const Audio::PCM> pcm) {}
          void play_sfx(const std::string &ident, float volume = 1.0f) const {}
+         void mute(bool mute) {}
 #endif
    };
 
@@ -62,7 +66,6 @@ namespace Icy
 
       private:
          std::shared_ptr<Audio::Stream> current;
-         Audio::VorbisLoader loader;
          std::vector<Track> tracks;
          bool first;
          unsigned last;
@@ -92,15 +95,6 @@ namespace Icy
          Blit::Pos map_size;
    };
 
-   class EdgeDetector
-   {
-      public:
-         EdgeDetector(bool init);
-         bool set(bool state);
-      private:
-         bool pos;
-   };
-
    class Game
    {
       public:
@@ -113,11 +107,25 @@ namespace Icy
          int width() const { return map.pix_width(); }
          int height() const { return map.pix_height(); }
 
-         unsigned get_pushes() const { return pushes; }
+         unsigned get_pushes() const { return state.pushes; }
          void set_bg(const Blit::Surface& bg);
 
-         void iterate();
-         bool won() const;
+         // Polls input, simulates one frame and renders it unless told otherwise.
+         void iterate(bool render = true);
+         void simulate(unsigned input);
+         void render();
+         unsigned poll_input() const;
+         bool won() const { return state.won(); }
+
+         const GameRules& rules() const { return m_rules; }
+         const GameState& get_state() const { return state; }
+         void set_state(const GameState& state) { this->state = state; }
+
+         // Starts the level over without loading it again.
+         void restart(unsigned best_pushes);
+
+         unsigned chapter_index() const { return chapter; }
+         unsigned level_index() const { return level; }
 
          static const unsigned fb_width = 320;
          static const unsigned fb_height = 200;
@@ -130,52 +138,124 @@ namespace Icy
          Blit::SurfaceCache cache;
          Blit::FontCluster *font;
          const Blit::Surface *bg;
-         Input facing;
 
          CameraManager camera;
 
-         unsigned won_frame_cnt;
-         bool m_won_early;
-         enum { won_frame_cnt_limit = 60 * 5 };
-         bool won_condition();
+         GameRules m_rules;
+         GameState state;
+         GameState initial;
 
          std::function<bool (Input)> m_input_cb;
          std::function<void (const void*, unsigned, unsigned, std::size_t)> m_video_cb;
 
-         std::function<bool ()> stepper;
-         void run_stepper();
+         // Face ids of the player and goal block faces in their sprites, in GameState's order,
+         // the latter for every block.
+         enum { num_player_faces = GameState::FaceCheer + 1, num_goal_faces = GameState::GoalCheer + 1 };
+         int player_faces[num_player_faces];
+         std::vector<int> goal_faces;
 
-         unsigned frame_cnt;
-         bool player_walking;
-         bool is_sliding;
-         unsigned stepper_cnt;
+         // What the render objects currently show, so they are only updated on change.
+         unsigned shown_player_face;
+         unsigned shown_player_frame;
+         unsigned shown_goal_face;
 
          void set_initial_pos(const std::string& level);
-         void update_player();
-         void update_animation();
-         void prepare_won_animation();
-         void update_input();
-         void update_triggers();
-         void move_if_no_collision(Input input);
-         void push_block();
-         bool is_offset_collision(Blit::Surface& surf, Blit::Pos offset);
-
-         bool tile_stepper(Blit::Surface& surf, Blit::Pos step_dir);
-         bool win_animation_stepper();
+         void update_render_objects();
 
          unsigned best_pushes;
-         unsigned pushes;
          unsigned chapter;
          unsigned level;
 
-         static Blit::Pos input_to_offset(Input input);
-         std::string input_to_string(Input input);
-         Input string_to_input(const std::string& dir);
+         int blocks_layer;
+   };
 
-         std::vector<std::reference_wrapper<Blit::SurfaceCluster::Elem>> get_tiles_with_attr(const std::string& layer,
-               const std::string& attr, const std::string& val = "");
+   // Renders level select previews on a worker thread, so loading a game doesn't have to build
+   // every level up front. Previews are rendered in the order they were queued, unless some
+   // are asked for sooner.
+   class PreviewLoader
+   {
+      public:
+         struct Preview
+         {
+            unsigned index;
+            Blit::Surface surface;
+            std::string error;
+         };
+
+         PreviewLoader() : bg_hash(0), pool(NULL), stop(false), pending(0) {}
+         ~PreviewLoader();
+
+         // Starts rendering the levels at paths, with bg behind them, as jobs on pool.
+         void start(std::vector<std::string> paths, const Blit::Surface& bg, Blit::JobPool& pool);
+
+         // Moves the previews with indices in [first, first + count) to the front of the queue.
+         void prioritize(unsigned first, unsigned count);
 
-         EdgeDetector push;
+         // Moves the previews finished since the last call into done. Doesn't block.
+         void poll(std::vector<Preview>& done);
+
+         // Blocks until every preview is finished, then moves them into done.
+         void wait(std::vector<Preview>& done);
+
+         bool finished() const;
+
+         // Loads a level and renders its first frame at half size.
+         static std::shared_ptr<const Blit::Surface::Data> render(const std::string& path, const Blit::Surface& bg);
+
+         static const unsigned scale_factor = 2;
+
+      private:
+         std::vector<std::string> paths;
+         Blit::Surface bg;
+         uint64_t bg_hash;
+
+         Blit::JobPool *pool;
+         std::vector<Blit::JobPool::Job> jobs;
+         mutable std::mutex lock;
+         std::condition_variable cond;
+         std::deque<unsigned> queue;
+         std::vector<Preview> finished_previews;
+         bool stop;
+         unsigned pending;
+
+         void render_next();
+         std::shared_ptr<const Blit::Surface::Data> load(unsigned index);
+   };
+
+   // Loads the level the player is expected to go to next on another thread while the current one
+   // is being played, so starting it doesn't hold up a frame.
+   class LevelLoader
+   {
+      public:
+         LevelLoader() : requested(false), chapter(0), level(0), m_stats() {}
+         ~LevelLoader();
+
+         // Starts loading a level, unless it's the one already requested. Drops the previous one.
+         void request(const std::string& path, unsigned chapter, unsigned level, Blit::FontCluster& font);
+
+         // Whether the level is the one requested and has finished loading, or failed to.
+         bool ready(unsigned chapter, unsigned level) const;
+
+         // Returns the level if it's the one requested, waiting for it if it's still loading.
+         // Returns NULL if it wasn't requested or failed to load.
+         std::unique_ptr<Game> take(unsigned chapter, unsigned level);
+
+         struct Stats
+         {
+            unsigned ready;  // Taken after it had finished loading.
+            unsigned waited; // Taken while still loading.
+            unsigned missed; // Not requested.
+         };
+         Stats stats() const { return m_stats; }
+
+      private:
+         std::future<std::unique_ptr<Game>> pending;
+         std::vector<std::future<std::unique_ptr<Game>>> dropped; // Still loading, but not wanted any more.
+         bool requested;
+         unsigned chapter, level;
+         Stats m_stats;
+
+         void cleanup();
    };
 
    class GameManager
@@ -200,17 +280,59 @@ namespace Icy
          void input_cb(std::function<bool (Input)> cb) { m_input_cb = cb; }
          void video_cb(std::function<void (const void*, unsigned, unsigned, std::size_t)> cb) { m_video_cb = cb; }
 
-         void iterate();
+         void iterate(bool render = true);
+
+         // Shows the current state again without advancing it, e.g. after loading a save state.
+         // Menus show the last frame they rendered.
+         void present();
+
+         // Simulates frames ahead with the current input and shows the last one, then rolls back,
+         // which hides input latency. Sound effects are muted while running ahead.
+         void run_ahead(unsigned frames);
 
          bool done() const;
 
          void reset_level();
-         void change_level(unsigned chapter, unsigned level);
+         // Uses loaded as the level if it's not the current or previous one already.
+         void change_level(unsigned chapter, unsigned level, std::unique_ptr<Game> loaded = nullptr);
          unsigned current_level() const { return m_current_level; }
          State game_state() const { return m_game_state; }
+         // The level being played, or null outside of one.
+         const Game* current_game() const { return m_game_state == State::Game ? game.get() : nullptr; }
+
+         std::vector<std::string> level_paths() const;
+
+         // Level select previews are rendered in the background after loading. Blocks until they are done.
+         void wait_for_previews();
+
+         // When and on which thread the jobs loading the game ran, previews included.
+         std::vector<Blit::JobPool::Span> load_timeline() const { return jobs.timeline(); }
+
+         // The level winning the current one leads to is loaded in the background. On by default.
+         void prefetch_levels(bool enable) { prefetch = enable; }
+
+         // What winning a level does while the next one is still loading in the background.
+         enum class Handoff
+         {
+            WhenReady, // Keeps the won level up until the next one is in. Never blocks the frame.
+            Wait,      // Waits for the next level, so a transition always takes the same frames.
+            Hold       // Keeps the won level up this frame regardless, to replay a held frame.
+         };
+         void level_handoff(Handoff handoff) { m_handoff = handoff; }
+
+         // Whether the last frame kept a won level up as the next one was still loading.
+         bool handoff_held() const { return held; }
+         unsigned held_frames() const { return m_held_frames; }
+         LevelLoader::Stats prefetch_stats() const { return next_level.stats(); }
 
          std::size_t save_size() const { return save.size(); }
          void* save_data() { return save.data(); }
+         const void* save_data() const { return save.data(); }
+
+         // Save states. The size is fixed once a game is loaded.
+         std::size_t serialize_size() const;
+         bool serialize(void *data, std::size_t size) const;
+         bool unserialize(const void *data, std::size_t size);
 
       private:
 
@@ -219,9 +341,12 @@ namespace Icy
             public:
                Level() : completion(false), best_pushes(0) {}
 
-               Level(const std::string& path, const Blit::Surface& bg);
+               Level(const std::string& path, const Blit::Surface& placeholder);
                const std::string& path() const { return m_path; }
 
+               // Replaces the placeholder shown until the preview is rendered.
+               void set_preview(const Blit::Surface& surface) { preview = surface; }
+
                void set_name(const std::string& name) { m_name = name; }
                const std::string& name() const { return m_name; }
 
@@ -231,6 +356,7 @@ namespace Icy
                bool get_completion() const { return completion; }
 
                void set_best_pushes(unsigned pushes) { if (!best_pushes || pushes < best_pushes) best_pushes = pushes; }
+               void restore_best_pushes(unsigned pushes) { best_pushes = pushes; completion = pushes; }
                unsigned get_best_pushes() const { return best_pushes; }
 
             private:
@@ -285,6 +411,7 @@ namespace Icy
                SaveManager(std::vector<Chapter> &chaps);
 
                void *data();
+               const void *data() const;
                void serialize();
                void unserialize();
                std::size_t size() const;
@@ -299,8 +426,21 @@ namespace Icy
 
          std::vector<Chapter> chapters;
          std::unique_ptr<Game> game;
+         std::unique_ptr<Game> previous_game; // Kept around so going back to it is cheap.
+         LevelLoader next_level;
+         bool prefetch;
+         Handoff m_handoff;
+         bool held;
+         unsigned m_held_frames;
+         std::vector<uint8_t> run_ahead_state;
+         bool running_ahead; // Frames run ahead are rolled back, so they must not touch SRAM or the prefetch.
          std::string dir;
 
+         Blit::JobPool jobs; // Loads the game, and then the previews.
+         PreviewLoader previews;
+         std::vector<PreviewLoader::Preview> finished_previews;
+         int prioritized_chap;
+
          unsigned m_current_chap;
          unsigned m_current_level;
          State m_game_state;
@@ -321,25 +461,30 @@ namespace Icy
          std::function<bool (Input)> m_input_cb;
          std::function<void (const void*, unsigned, unsigned, std::size_t)> m_video_cb;
 
-         void init_menu(const std::string& title);
-         void init_menu_sprite(pugi::xml_node doc);
+         void init_menu(const Blit::Surface& title);
+         void init_menu_sprite();
          void init_level(unsigned chapter, unsigned level);
-         void init_sfx(pugi::xml_node doc);
+         void prefetch_next_level();
+         bool can_hand_off(unsigned chapter, unsigned level);
+         // Moves on to the level if it can, otherwise keeps the won level up this frame.
+         void hand_off(unsigned chapter, unsigned level);
          void init_bg(pugi::xml_node doc);
 
-         Chapter load_chapter(pugi::xml_node chap_node, int chapter);
+         Chapter load_chapter(pugi::xml_node chap_node, int chapter, const Blit::Surface& placeholder);
+         void update_previews();
+         void apply_previews();
          const Level& get_selected_level() const;
 
-         void step_title();
-         void step_game();
-         void step_end();
+         void step_title(bool render);
+         void step_game(bool render, bool was_held);
+         void step_end(bool render);
 
          // Menu stuff.
          void enter_menu();
          void set_initial_level();
          bool find_next_unsolved_level(unsigned& chap, unsigned& level);
-         void step_menu();
-         void step_menu_slide();
+         void step_menu(bool render);
+         void step_menu_slide(bool render);
          void start_slide(Blit::Pos dir, unsigned cnt);
          void menu_render_ui();
 
@@ -1,9 +1,12 @@
 #include "game.hpp"
+#include "asset_pack.hpp"
 #include "pugixml/pugixml.hpp"
 #include "utils.hpp"
 
 #include <iostream>
 #include <cstdlib>
+#include <cstring>
+#include <type_traits>
 #include <assert.h>
 
 using namespace Blit;
@@ -12,49 +15,165 @@ using namespace std;
 
 namespace Icy
 {
+   namespace
+   {
+      // The fonts are drawn twice, a shadow and then the letters.
+      struct FontStyle
+      {
+         int x, y;
+         uint8_t r, g, b;
+         const char *id;
+      };
+
+      const FontStyle font_styles[] = {
+         { -1, 1, 0xc0, 0x98, 0x00, "yellow" },
+         {  0, 0, 0xff, 0xde, 0x00, "yellow" },
+         { -1, 1, 0x73, 0x73, 0x8b, "white" },
+         {  0, 0, 0xff, 0xff, 0xff, "white" },
+         { -1, 1, 0x39, 0x5a, 0x94, "lime" },
+         {  0, 0, 0xb8, 0xe8, 0xb0, "lime" },
+      };
+      const unsigned num_font_styles = sizeof(font_styles) / sizeof(font_styles[0]);
+
+      enum MenuImage
+      {
+         image_title = 0,
+         image_level_complete,
+         image_lock_sprite,
+         image_menu_bg,
+         image_end_bg,
+         image_game_bg,
+         num_menu_images
+      };
+
+      const char *menu_images[num_menu_images] = {
+         "title", "level_complete", "lock_sprite", "menu_bg", "end_bg", "game_bg"
+      };
+
+      // What the jobs loading the game produce. The jobs hold on to it, so it stays around for
+      // them even if loading fails and the constructor throws before they are done.
+      struct Startup
+      {
+         Font fonts[num_font_styles];
+         Surface images[num_menu_images];
+         vector<shared_ptr<const Audio::PCM>> sounds;
+      };
+
+      // Name and path of every sound effect.
+      vector<pair<string, string>> list_sfx(xml_node game)
+      {
+         pugi::xml_node sfx = game.child("sfx");
+         Utils::xml_node_walker walk(sfx, "sound", "name");
+         Utils::xml_node_walker walk_source(sfx, "sound", "source");
+
+         vector<pair<string, string> > sfxs;
+         for (auto& val : walk)
+            sfxs.push_back({val, ""});
+
+         vector<pair<string, string> >::iterator itr = sfxs.begin();
+         for (auto& val : walk_source)
+         {
+            itr->second = val;
+            ++itr;
+         }
+
+         return sfxs;
+      }
+   }
+
    GameManager::GameManager(const string& path_game,
          function<bool (Input)> input_cb,
          function<void (const void*, unsigned, unsigned, size_t)> video_cb)
-      : save(chapters), dir(Utils::basedir(path_game)),
+      : save(chapters), prefetch(true), m_handoff(Handoff::WhenReady), held(false), m_held_frames(0), running_ahead(false), dir(Utils::basedir(path_game)), prioritized_chap(-1),
       m_current_chap(0), m_current_level(0), m_game_state(State::Title),
-      m_input_cb(input_cb), m_video_cb(video_cb)
+      m_input_cb(input_cb), m_video_cb(video_cb),
+      chap_select(0), level_select(0),
+      old_pressed_menu_left(false), old_pressed_menu_right(false),
+      old_pressed_menu_up(false), old_pressed_menu_down(false),
+      old_pressed_menu_ok(false), old_pressed_menu(false), old_pressed_reset(false),
+      slide_cnt(0), slide_end(0)
    {
       xml_document doc;
 
-      if (!doc.load_file(path_game.c_str()))
+      if (!AssetPack::load_xml(doc, path_game))
          throw runtime_error(Utils::join("Failed to load game: ", path_game, "."));
+      xml_node game_node = doc.child("game");
 
-      string font_path = Utils::join(dir, "/", doc.child("game").child("font").attribute("source").value());
-      font.add_font(font_path, Pos(-1, 1), Pixel::ARGB(0xff, 0xc0, 0x98, 0x00), "yellow");
-      font.add_font(font_path, Pos( 0, 0), Pixel::ARGB(0xff, 0xff, 0xde, 0x00), "yellow");
-      font.add_font(font_path, Pos(-1, 1), Pixel::ARGB(0xff, 0x73, 0x73, 0x8b), "white");
-      font.add_font(font_path, Pos( 0, 0), Pixel::ARGB(0xff, 0xff, 0xff, 0xff), "white");
-      font.add_font(font_path, Pos(-1, 1), Pixel::ARGB(0xff, 0x39, 0x5a, 0x94), "lime");
-      font.add_font(font_path, Pos( 0, 0), Pixel::ARGB(0xff, 0xb8, 0xe8, 0xb0), "lime");
-
-      init_menu(doc.child("game").child("title").attribute("source").value());
-      init_menu_sprite(doc);
-      init_sfx(doc);
-      init_bg(doc);
+      // Fonts, images and sound effects load as jobs spread over all cores, followed by the level
+      // previews. This thread hands out the jobs and puts together what they loaded, running jobs
+      // itself while it waits for them.
+      auto loaded = make_shared<Startup>();
+
+      string font_path = Utils::join(dir, "/", game_node.child("font").attribute("source").value());
+      vector<JobPool::Job> font_jobs;
+      for (unsigned i = 0; i < num_font_styles; i++)
+      {
+         Pixel color = Pixel::ARGB(0xff, font_styles[i].r, font_styles[i].g, font_styles[i].b);
+         font_jobs.push_back(jobs.add("font", [loaded, i, font_path, color] {
+                  loaded->fonts[i] = FontCluster::load_font(font_path, color);
+               }));
+      }
+
+      vector<JobPool::Job> image_jobs;
+      for (unsigned i = 0; i < num_menu_images; i++)
+      {
+         string path = Utils::join(dir, "/", game_node.child(menu_images[i]).attribute("source").value());
+         image_jobs.push_back(jobs.add(Utils::join("image ", menu_images[i]), [loaded, i, path] {
+                  loaded->images[i] = SurfaceCache().from_image(path);
+               }));
+      }
+
+      vector<pair<string, string>> sounds = list_sfx(game_node);
+      vector<JobPool::Job> sfx_jobs;
+      loaded->sounds.resize(sounds.size());
+      for (unsigned i = 0; i < sounds.size(); i++)
+      {
+         string path = Utils::join(dir, "/", sounds[i].second);
+         sfx_jobs.push_back(jobs.add(Utils::join("sfx ", sounds[i].first), [loaded, i, path] {
+                  loaded->sounds[i] = make_shared<Audio::PCM>(Audio::WAVFile::load_wave(path));
+               }));
+      }
+
+      // Previews are rendered in the background, this stands in for them until then.
+      Surface placeholder(make_shared<Surface::Data>(Pixel::ARGB(0xff, 0x18, 0x20, 0x38),
+               Game::fb_width / PreviewLoader::scale_factor, Game::fb_height / PreviewLoader::scale_factor));
 
-      for (xml_node node = doc.child("game").child("chapter"); node; node = node.next_sibling("chapter"))
+      for (xml_node node = game_node.child("chapter"); node; node = node.next_sibling("chapter"))
       {
-         Icy::GameManager::Chapter chapter = load_chapter(node, chapters.size());
+         Icy::GameManager::Chapter chapter = load_chapter(node, chapters.size(), placeholder);
          if (chapter.num_levels() > 0)
             chapters.push_back(move(chapter));
       }
+      init_bg(doc);
+
+      jobs.wait(image_jobs);
+      level_complete  = loaded->images[image_level_complete];
+      lock_sprite     = loaded->images[image_lock_sprite];
+      level_select_bg = loaded->images[image_menu_bg];
+      end_credit_bg   = loaded->images[image_end_bg];
+      game_bg         = loaded->images[image_game_bg];
+      init_menu_sprite();
+
+      jobs.wait(font_jobs);
+      for (unsigned i = 0; i < num_font_styles; i++)
+         font.add_font(move(loaded->fonts[i]), Pos(font_styles[i].x, font_styles[i].y), font_styles[i].id);
+      init_menu(loaded->images[image_title]);
+
+      jobs.wait(sfx_jobs);
+      for (unsigned i = 0; i < sounds.size(); i++)
+         get_sfx().add_effect(sounds[i].first, loaded->sounds[i]);
 
       ui_target = RenderTarget(Game::fb_width, Game::fb_height);
 
+      // Started last, so waiting for the jobs above never ends up rendering previews.
+      previews.start(level_paths(), game_bg, jobs);
    }
 
-   GameManager::GameManager() : save(chapters), m_current_chap(0), m_current_level(0), m_game_state(State::Game) {}
+   GameManager::GameManager() : save(chapters), prefetch(true), m_handoff(Handoff::WhenReady), held(false),
+      m_held_frames(0), running_ahead(false), prioritized_chap(-1), m_current_chap(0), m_current_level(0), m_game_state(State::Game) {}
 
-   void GameManager::init_menu_sprite(xml_node doc)
+   void GameManager::init_menu_sprite()
    {
-      level_complete = cache.from_image(Utils::join(dir, "/", doc.child("game").child("level_complete").attribute("source").value()));
-
-      lock_sprite = cache.from_image(Utils::join(dir, "/", doc.child("game").child("lock_sprite").attribute("source").value()));
       lock_sprite.ignore_camera(true);
       int arrow_x = (Game::fb_width - lock_sprite.rect().w) / 2;
       lock_sprite.rect().pos = Pos( arrow_x, 160 );
@@ -64,13 +183,8 @@ namespace Icy
       level_complete.rect().pos = Pos( complete_x, complete_y );
       level_complete.ignore_camera(true);
 
-      level_select_bg = cache.from_image(Utils::join(dir, "/", doc.child("game").child("menu_bg").attribute("source").value()));
       level_select_bg.ignore_camera(true);
-
-      end_credit_bg = cache.from_image(Utils::join(dir, "/", doc.child("game").child("end_bg").attribute("source").value()));
       end_credit_bg.ignore_camera(true);
-
-      game_bg = cache.from_image(Utils::join(dir, "/", doc.child("game").child("game_bg").attribute("source").value()));
       game_bg.ignore_camera(true);
    }
 
@@ -93,35 +207,14 @@ namespace Icy
       get_bg().init(tracks);
    }
 
-   void GameManager::init_sfx(xml_node doc)
-   {
-      pugi::xml_node sfx = doc.child("game").child("sfx");
-      Utils::xml_node_walker walk(sfx, "sound", "name");
-      Utils::xml_node_walker walk_source(sfx, "sound", "source");
-
-      vector<pair<string, string> > sfxs;
-      for (auto& val : walk)
-         sfxs.push_back({val, ""});
-
-      vector<pair<string, string> >::iterator itr = sfxs.begin();
-      for (auto& val : walk_source)
-      {
-         itr->second = val;
-         ++itr;
-      }
-
-      for (auto& sfx : sfxs)
-         get_sfx().add_stream(sfx.first, Utils::join(dir, "/", sfx.second));
-   }
-
-   GameManager::Chapter GameManager::load_chapter(xml_node chap, int chapter)
+   GameManager::Chapter GameManager::load_chapter(xml_node chap, int chapter, const Surface& placeholder)
    {
       Utils::xml_node_walker walk(chap, "map", "source");
       Utils::xml_node_walker walk_name(chap, "map", "name");
 
       vector<Level> levels;
       for (auto& val : walk)
-         levels.push_back({Utils::join(dir, "/", val), game_bg});
+         levels.push_back({Utils::join(dir, "/", val), placeholder});
 
       std::vector<Icy::GameManager::Level>::iterator itr = levels.begin();
       for (auto& val : walk_name)
@@ -144,12 +237,10 @@ namespace Icy
       return move(loaded_chap);
    }
 
-   void GameManager::init_menu(const string& level)
+   void GameManager::init_menu(const Surface& title)
    {
-      Surface surf = cache.from_image(Utils::join(dir, "/", level));
-
       target = RenderTarget(Game::fb_width, Game::fb_height);
-      target.blit(surf, Rect());
+      target.blit(title, Rect());
 
       font.set_id("yellow");
       font.render_msg(target, "Press OK/Push button", 160, 170, Font::RenderAlignment::Centered);
@@ -160,20 +251,93 @@ namespace Icy
       change_level(m_current_chap, m_current_level);
    }
 
-   void GameManager::change_level(unsigned chapter, unsigned level) 
+   void GameManager::change_level(unsigned chapter, unsigned level, unique_ptr<Game> loaded)
    {
-      game = Utils::make_unique<Game>(
-            chapters.at(chapter).level(level).path(), 
-            chapter,
-            level,
-            chapters.at(chapter).level(level).get_best_pushes(),
-            font);
-      game->input_cb(m_input_cb);
-      game->video_cb(m_video_cb);
-      game->set_bg(game_bg);
+      unsigned best_pushes = chapters.at(chapter).level(level).get_best_pushes();
+
+      // Restarting, or going back to the level we just left, doesn't need to load the level again.
+      if (previous_game && previous_game->chapter_index() == chapter && previous_game->level_index() == level)
+         swap(game, previous_game);
+
+      if (game && game->chapter_index() == chapter && game->level_index() == level)
+         game->restart(best_pushes);
+      else
+      {
+         if (game)
+            previous_game = move(game);
+
+         if (loaded)
+            game = move(loaded);
+         else if (prefetch)
+            game = next_level.take(chapter, level);
+
+         if (game)
+            game->restart(best_pushes);
+         else
+         {
+            game = Utils::make_unique<Game>(
+                  chapters.at(chapter).level(level).path(), 
+                  chapter,
+                  level,
+                  best_pushes,
+                  font);
+         }
+         game->input_cb(m_input_cb);
+         game->video_cb(m_video_cb);
+         game->set_bg(game_bg);
+      }
 
       m_current_chap  = chapter;
       m_current_level = level;
+      prefetch_next_level();
+   }
+
+   // Starts loading the level winning the current one leads to, see step_game().
+   void GameManager::prefetch_next_level()
+   {
+      if (!prefetch)
+         return;
+
+      unsigned chap  = m_current_chap;
+      unsigned level = m_current_level;
+
+      bool completion = chapters[chap].get_completion(level);
+      chapters[chap].set_completion(level, true);
+      bool found = find_next_unsolved_level(chap, level);
+      chapters[m_current_chap].set_completion(m_current_level, completion);
+
+      if (!found || (previous_game && previous_game->chapter_index() == chap && previous_game->level_index() == level))
+         return;
+
+      next_level.request(chapters[chap].level(level).path(), chap, level, font);
+   }
+
+   // Whether the level after a win can take over this frame without waiting for it to load.
+   // If not, it gets requested in case it wasn't the one prefetched, and the won level stays up.
+   bool GameManager::can_hand_off(unsigned chapter, unsigned level)
+   {
+      if (m_handoff == Handoff::Hold)
+         return false;
+      if (m_handoff == Handoff::Wait || !prefetch)
+         return true;
+
+      if ((previous_game && previous_game->chapter_index() == chapter && previous_game->level_index() == level) ||
+            next_level.ready(chapter, level))
+         return true;
+
+      next_level.request(chapters[chapter].level(level).path(), chapter, level, font);
+      return false;
+   }
+
+   void GameManager::hand_off(unsigned chapter, unsigned level)
+   {
+      if (can_hand_off(chapter, level))
+         change_level(chapter, level);
+      else
+      {
+         held = true;
+         m_held_frames++;
+      }
    }
 
    void GameManager::init_level(unsigned chapter, unsigned level)
@@ -226,7 +390,7 @@ namespace Icy
       }
    }
 
-   void GameManager::step_title()
+   void GameManager::step_title(bool render)
    {
       if (m_input_cb(Input::Push) || m_input_cb(Input::Menu))
       {
@@ -234,7 +398,8 @@ namespace Icy
          enter_menu();
       }
 
-      m_video_cb(target.buffer(), target.width(), target.height(), target.width() * sizeof(Pixel));
+      if (render)
+         m_video_cb(target.buffer(), target.width(), target.height(), target.width() * sizeof(Pixel));
    }
 
    void GameManager::enter_menu()
@@ -274,8 +439,63 @@ namespace Icy
                "%"), 315, 185, Font::RenderAlignment::Right);
    }
 
-   void GameManager::step_menu_slide()
+   // Gets the chapters around the selected one rendered first, and shows whatever is done.
+   void GameManager::update_previews()
+   {
+      if (chap_select != prioritized_chap)
+      {
+         unsigned first = 0;
+         for (int i = 0; i < chap_select - 1; i++)
+            first += chapters[i].num_levels();
+
+         unsigned count = 0;
+         for (int i = max(chap_select - 1, 0); i <= chap_select + 1 && i < static_cast<int>(chapters.size()); i++)
+            count += chapters[i].num_levels();
+
+         previews.prioritize(first, count);
+         prioritized_chap = chap_select;
+      }
+
+      previews.poll(finished_previews);
+      apply_previews();
+   }
+
+   void GameManager::apply_previews()
    {
+      for (auto& preview : finished_previews)
+      {
+         if (!preview.error.empty())
+         {
+            if (log_cb)
+               log_cb(RETRO_LOG_ERROR, "Dinothawr: Failed to render preview: %s\n", preview.error.c_str());
+            continue;
+         }
+
+         unsigned index = preview.index;
+         for (auto& chap : chapters)
+         {
+            if (index < chap.num_levels())
+            {
+               chap.level(index).set_preview(preview.surface);
+               break;
+            }
+            index -= chap.num_levels();
+         }
+      }
+
+      finished_previews.clear();
+   }
+
+   void GameManager::wait_for_previews()
+   {
+      previews.wait(finished_previews);
+      apply_previews();
+   }
+
+   void GameManager::step_menu_slide(bool render)
+   {
+      update_previews();
+
       ui_target.camera_move(menu_slide_dir);
       slide_cnt++;
       if (slide_cnt >= slide_end)
@@ -292,7 +512,8 @@ namespace Icy
 
       menu_render_ui();
 
-      m_video_cb(ui_target.buffer(), ui_target.width(), ui_target.height(), ui_target.width() * sizeof(Pixel));
+      if (render)
+         m_video_cb(ui_target.buffer(), ui_target.width(), ui_target.height(), ui_target.width() * sizeof(Pixel));
    }
 
    const GameManager::Level& GameManager::get_selected_level() const
@@ -312,8 +533,10 @@ namespace Icy
       get_sfx().play_sfx("level_next", 0.5);
    }
 
-   void GameManager::step_menu()
+   void GameManager::step_menu(bool render)
    {
+      update_previews();
+
       ui_target.blit(level_select_bg, Rect());
 
       for (auto& chap : chapters)
@@ -398,15 +621,16 @@ namespace Icy
       old_pressed_menu_ok     = pressed_menu_ok;
       old_pressed_menu        = pressed_menu;
 
-      m_video_cb(ui_target.buffer(), ui_target.width(), ui_target.height(), ui_target.width() * sizeof(Pixel));
+      if (render)
+         m_video_cb(ui_target.buffer(), ui_target.width(), ui_target.height(), ui_target.width() * sizeof(Pixel));
    }
 
-   void GameManager::step_game()
+   void GameManager::step_game(bool render, bool was_held)
    {
       if (!game)
          return;
 
-      game->iterate();
+      game->iterate(render);
 
       bool pressed_menu = m_input_cb(Input::Menu);
       bool pressed_reset = m_input_cb(Input::Reset);
@@ -419,15 +643,23 @@ namespace Icy
       old_pressed_menu = pressed_menu;
       old_pressed_reset = pressed_reset;
 
-      if (game->won())
+      // A held level stays won, but the win was recorded on the frame it happened, so the frames
+      // after it only try to hand off again.
+      if (game->won() && was_held)
+      {
+         unsigned chap = m_current_chap, level = m_current_level;
+         find_next_unsolved_level(chap, level);
+         hand_off(chap, level);
+      }
+      else if (game->won())
       {
          unsigned pushes = game->get_pushes();
          chapters[m_current_chap].level(m_current_level).set_best_pushes(pushes);
 
-         game.reset();
          bool trigger_completion = !chapters[m_current_chap].get_completion(m_current_level);
          chapters[m_current_chap].set_completion(m_current_level, true);
-         save.serialize();
+         if (!running_ahead)
+            save.serialize();
 
          // Go to ending screen on the event that all levels have been cleared.
          bool cleared_all = trigger_completion;
@@ -443,22 +675,26 @@ namespace Icy
             }
          }
 
+         // Left to change_level() to move the level just won out of the way, as the next level
+         // may be the previous one already, e.g. after running ahead past the win and rolling back.
+         unsigned chap = m_current_chap, level = m_current_level;
          if (cleared_all)
          {
+            previous_game = move(game);
             m_game_state = State::End;
             old_pressed_menu_ok = true; // Don't allow us to exit immediately after we enter end credits.
          }
+         else if (find_next_unsolved_level(chap, level))
+            hand_off(chap, level);
          else
          {
-            if (find_next_unsolved_level(m_current_chap, m_current_level))
-               change_level(m_current_chap, m_current_level);
-            else
-               enter_menu();
+            previous_game = move(game);
+            enter_menu();
          }
       }
    }
 
-   void GameManager::step_end()
+   void GameManager::step_end(bool render)
    {
       ui_target.blit(end_credit_bg, Rect());
 
@@ -474,81 +710,283 @@ namespace Icy
 
       font.set_id("white");
       font.render_msg(ui_target, "You completed all levels!\nAwesome! :D\nThanks for playing Dinothawr!", 160, 155, Font::RenderAlignment::Centered, 2);
-      m_video_cb(ui_target.buffer(), ui_target.width(), ui_target.height(), ui_target.width() * sizeof(Pixel));
+      if (render)
+         m_video_cb(ui_target.buffer(), ui_target.width(), ui_target.height(), ui_target.width() * sizeof(Pixel));
    }
 
-   void GameManager::iterate()
+   // Menus are cheap and always draw, as their camera moves with them, but only present when rendering.
+   // Gameplay skips drawing frames that aren't presented.
+   void GameManager::iterate(bool render)
    {
+      bool was_held = held;
+      held = false;
       switch (m_game_state)
       {
-         case State::Title: return step_title();
-         case State::Menu: return step_menu();
-         case State::MenuSlide: return step_menu_slide();
-         case State::Game: return step_game();
-         case State::End: return step_end();
+         case State::Title: return step_title(render);
+         case State::Menu: return step_menu(render);
+         case State::MenuSlide: return step_menu_slide(render);
+         case State::Game: return step_game(render, was_held);
+         case State::End: return step_end(render);
          default: throw logic_error("Game state is invalid.");
       }
    }
 
+   void GameManager::present()
+   {
+      if (m_game_state == State::Game && game)
+         game->render();
+      else if (m_game_state == State::Title)
+         m_video_cb(target.buffer(), target.width(), target.height(), target.width() * sizeof(Pixel));
+      else
+         m_video_cb(ui_target.buffer(), ui_target.width(), ui_target.height(), ui_target.width() * sizeof(Pixel));
+   }
+
+   void GameManager::run_ahead(unsigned frames)
+   {
+      if (!frames)
+         return;
+
+      run_ahead_state.resize(serialize_size());
+      serialize(run_ahead_state.data(), run_ahead_state.size());
+
+      // A level won ahead stays up rather than taking the prefetched level, which the real frames need.
+      Handoff handoff = m_handoff;
+      bool was_held = held;
+      unsigned held_frames = m_held_frames;
+      m_handoff = Handoff::Hold;
+      running_ahead = true;
+
+      get_sfx().mute(true);
+      for (unsigned i = 1; i <= frames; i++)
+         iterate(i == frames);
+      get_sfx().mute(false);
+
+      unserialize(run_ahead_state.data(), run_ahead_state.size());
+
+      running_ahead = false;
+      m_handoff = handoff;
+      held = was_held;
+      m_held_frames = held_frames;
+   }
+
    bool GameManager::done() const
    {
       return false;
    }
 
-   unsigned GameManager::total_levels() const
+   // Save state layout. It is followed by the best push count of every level, as those change when a level is won.
+   // Static content like maps and sprites is not part of it, so a state is only valid for the game it was made with.
+   struct SaveState
    {
-      unsigned levels = 0;
-      for (auto& chap : chapters)
-         levels += chap.num_levels();
+      enum { magic = 0x4f4e4944, version = 1 }; // "DINO"
 
-      return levels;
+      uint32_t magic_id;
+      uint32_t version_id;
+      uint32_t levels;
+
+      uint32_t game_state;
+      uint32_t current_chap;
+      uint32_t current_level;
+
+      int32_t chap_select;
+      int32_t level_select;
+      uint32_t pressed; // Bit per old_pressed_* flag.
+
+      Pos menu_slide_dir;
+      uint32_t slide_cnt;
+      uint32_t slide_end;
+      Pos menu_camera;
+
+      uint32_t has_game;
+      uint32_t game_chap;
+      uint32_t game_level;
+      GameState game;
+   };
+
+   static_assert(std::is_trivially_copyable<SaveState>::value, "SaveState is read and written with memcpy().");
+
+   size_t GameManager::serialize_size() const
+   {
+      return sizeof(SaveState) + total_levels() * sizeof(uint32_t);
    }
 
-   unsigned GameManager::total_cleared_levels() const
+   bool GameManager::serialize(void *data, size_t size) const
    {
-      unsigned levels = 0;
+      if (size < serialize_size())
+         return false;
+
+      SaveState state = SaveState();
+      state.magic_id      = SaveState::magic;
+      state.version_id    = SaveState::version;
+      state.levels        = total_levels();
+      state.game_state    = static_cast<uint32_t>(m_game_state);
+      state.current_chap  = m_current_chap;
+      state.current_level = m_current_level;
+      state.chap_select   = chap_select;
+      state.level_select  = level_select;
+
+      const bool pressed[] = {
+         old_pressed_menu_left, old_pressed_menu_right, old_pressed_menu_up, old_pressed_menu_down,
+         old_pressed_menu_ok, old_pressed_menu, old_pressed_reset,
+      };
+      for (unsigned i = 0; i < sizeof(pressed) / sizeof(pressed[0]); i++)
+         state.pressed |= pressed[i] << i;
+
+      state.menu_slide_dir = menu_slide_dir;
+      state.slide_cnt      = slide_cnt;
+      state.slide_end      = slide_end;
+      state.menu_camera    = ui_target.camera_pos();
+
+      if (game)
+      {
+         state.has_game   = 1;
+         state.game_chap  = game->chapter_index();
+         state.game_level = game->level_index();
+         state.game       = game->get_state();
+      }
+
+      uint8_t *out = static_cast<uint8_t*>(data);
+      memcpy(out, &state, sizeof(state));
+      out += sizeof(state);
+
       for (auto& chap : chapters)
-         levels += chap.cleared_count();
+      {
+         for (auto& level : chap.levels())
+         {
+            uint32_t pushes = level.get_best_pushes();
+            memcpy(out, &pushes, sizeof(pushes));
+            out += sizeof(pushes);
+         }
+      }
 
-      return levels;
+      return true;
    }
 
-   GameManager::Level::Level(const string& path, const Blit::Surface& bg)
-      : m_path(path), completion(false), best_pushes(0)
+   bool GameManager::unserialize(const void *data, size_t size)
    {
-      Game game{path};
-      game.set_bg(bg);
+      if (size < serialize_size())
+         return false;
+
+      SaveState state;
+      const uint8_t *in = static_cast<const uint8_t*>(data);
+      memcpy(&state, in, sizeof(state));
+      in += sizeof(state);
 
-      static const unsigned scale_factor = 2;
-      int preview_width  = Game::fb_width / scale_factor;
-      int preview_height = Game::fb_height / scale_factor;
+      if (state.magic_id != SaveState::magic || state.version_id != SaveState::version ||
+            state.levels != total_levels() || state.game_state > static_cast<uint32_t>(State::End))
+         return false;
+
+      if (state.current_chap >= chapters.size() ||
+            state.current_level >= chapters[state.current_chap].num_levels() ||
+            state.chap_select < 0 || state.chap_select >= static_cast<int>(chapters.size()) ||
+            state.level_select < 0 || state.level_select >= static_cast<int>(chapters[state.chap_select].num_levels()))
+         return false;
 
-      vector<Pixel> data(preview_width * preview_height);
+      if (state.has_game && (state.game_chap >= chapters.size() ||
+               state.game_level >= chapters[state.game_chap].num_levels()))
+         return false;
 
-      game.input_cb([](Input) { return false; });
-      game.video_cb([&data, preview_width](const void* pix_data, unsigned width, unsigned height, size_t pitch) {
-         const Pixel* pix = reinterpret_cast<const Pixel*>(pix_data);
-         pitch /= sizeof(Pixel);
+      if (!state.has_game && state.game_state == static_cast<uint32_t>(State::Game))
+         return false;
 
-         for (unsigned y = 0; y < height; y += scale_factor)
+      // Everything is checked before anything changes, so a rejected state leaves the game as it
+      // was. Only loads the level if it's neither the current nor the previous one.
+      unique_ptr<Game> loaded;
+      if (state.has_game)
+      {
+         const Game *target = nullptr;
+         for (const Game *candidate : { game.get(), previous_game.get() })
+            if (candidate && candidate->chapter_index() == state.game_chap && candidate->level_index() == state.game_level)
+               target = candidate;
+
+         if (!target)
          {
-            for (unsigned x = 0; x < width; x += scale_factor)
-            {
-               Blit::PixelBase<unsigned int, 8u, 24u, 8u, 16u, 8u, 8u, 8u, 0u> a0 = pix[pitch * (y + 0) + (x + 0)];
-               Blit::PixelBase<unsigned int, 8u, 24u, 8u, 16u, 8u, 8u, 8u, 0u> a1 = pix[pitch * (y + 0) + (x + 1)];
-               Blit::PixelBase<unsigned int, 8u, 24u, 8u, 16u, 8u, 8u, 8u, 0u> b0 = pix[pitch * (y + 1) + (x + 0)];
-               Blit::PixelBase<unsigned int, 8u, 24u, 8u, 16u, 8u, 8u, 8u, 0u> b1 = pix[pitch * (y + 1) + (x + 1)];
-               Blit::PixelBase<unsigned int, 8u, 24u, 8u, 16u, 8u, 8u, 8u, 0u> res = Pixel::blend(Pixel::blend(a0, a1), Pixel::blend(b0, b1));
+            loaded = Utils::make_unique<Game>(chapters[state.game_chap].level(state.game_level).path(),
+                  state.game_chap, state.game_level, 0, font);
+            target = loaded.get();
+         }
 
-               data[preview_width * (y / scale_factor) + (x / scale_factor)] = res | static_cast<Pixel>(Pixel::alpha_mask);
-            }
+         if (!target->rules().is_valid(state.game))
+            return false;
+
+         change_level(state.game_chap, state.game_level, move(loaded));
+      }
+      else if (game)
+         previous_game = move(game);
+
+      for (auto& chap : chapters)
+      {
+         for (auto& level : chap.levels())
+         {
+            uint32_t pushes;
+            memcpy(&pushes, in, sizeof(pushes));
+            in += sizeof(pushes);
+            level.restore_best_pushes(pushes);
          }
-      });
+      }
+
+      // Save states don't keep whether a won level is being held, so its win is recorded again.
+      held = false;
 
-      game.iterate();
+      m_game_state    = static_cast<State>(state.game_state);
+      m_current_chap  = state.current_chap;
+      m_current_level = state.current_level;
+      chap_select     = state.chap_select;
+      level_select    = state.level_select;
 
-      preview = Surface(make_shared<Surface::Data>(std::move(data), preview_width, preview_height));
-      pos(Pos(Game::fb_width, Game::fb_height) / scale_factor - Pos(5, 5));
+      bool *pressed[] = {
+         &old_pressed_menu_left, &old_pressed_menu_right, &old_pressed_menu_up, &old_pressed_menu_down,
+         &old_pressed_menu_ok, &old_pressed_menu, &old_pressed_reset,
+      };
+      for (unsigned i = 0; i < sizeof(pressed) / sizeof(pressed[0]); i++)
+         *pressed[i] = state.pressed & (1u << i);
+
+      menu_slide_dir = state.menu_slide_dir;
+      slide_cnt      = state.slide_cnt;
+      slide_end      = state.slide_end;
+      ui_target.camera_set(state.menu_camera);
+
+      if (game)
+      {
+         game->restart(chapters[state.game_chap].level(state.game_level).get_best_pushes());
+         game->set_state(state.game);
+      }
+
+      return true;
+   }
+
+   unsigned GameManager::total_levels() const
+   {
+      unsigned levels = 0;
+      for (auto& chap : chapters)
+         levels += chap.num_levels();
+
+      return levels;
+   }
+
+   vector<string> GameManager::level_paths() const
+   {
+      vector<string> paths;
+      for (auto& chap : chapters)
+         for (auto& level : chap.levels())
+            paths.push_back(level.path());
+
+      return paths;
+   }
+
+   unsigned GameManager::total_cleared_levels() const
+   {
+      unsigned levels = 0;
+      for (auto& chap : chapters)
+         levels += chap.cleared_count();
+
+      return levels;
+   }
+
+   GameManager::Level::Level(const string& path, const Blit::Surface& placeholder)
+      : m_path(path), preview(placeholder), completion(false), best_pushes(0)
+   {
+      pos(Pos(Game::fb_width, Game::fb_height) / PreviewLoader::scale_factor - Pos(5, 5));
    }
 
    void GameManager::Level::render(RenderTarget& target) const
@@ -569,6 +1007,11 @@ namespace Icy
       return save_data.data();
    }
 
+   const void* GameManager::SaveManager::data() const
+   {
+      return save_data.data();
+   }
+
    void GameManager::SaveManager::serialize()
    {
       string full_pushes;
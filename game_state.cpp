@@ -0,0 +1,420 @@
+#include "game_state.hpp"
+#include "utils.hpp"
+
+#include <stdexcept>
+#include <cstdlib>
+
+using namespace Blit;
+using namespace std;
+
+namespace Icy
+{
+   GameRules::GameRules(const Tilemap& map)
+      : width(map.tiles_width()), height(map.tiles_height()),
+      tile_width(map.tile_width()), tile_height(map.tile_height()),
+      cells(width * height), num_blocks(0), goal_mask(0)
+   {
+      int floor  = map.find_layer_index("floor");
+      int blocks = map.find_layer_index("blocks");
+
+      if (floor < 0)
+         throw runtime_error("Floor layer not found.");
+
+      unsigned goal_floors = 0;
+      for (int y = 0; y < height; y++)
+      {
+         for (int x = 0; x < width; x++)
+         {
+            uint8_t& cell = cells[y * width + x];
+            unsigned flags = map.tile_flags(floor, Pos(x, y));
+
+            if (map.static_collision(Pos(x, y)))
+               cell |= CellCollision;
+            if (flags & Tilemap::FlagGoal)
+            {
+               cell |= CellGoal;
+               goal_floors++;
+            }
+            if (flags & Tilemap::FlagSlipperyPlayer)
+               cell |= CellSlipperyPlayer;
+            if (flags & Tilemap::FlagSlipperyBlock)
+               cell |= CellSlipperyBlock;
+         }
+      }
+
+      if (blocks >= 0)
+      {
+         const vector<SurfaceCluster::Elem>& elems = map.layers()[blocks].cluster.vec();
+         if (elems.size() > GameState::max_blocks)
+            throw logic_error(Utils::join("Level has more than ", unsigned(GameState::max_blocks), " blocks."));
+
+         for (auto& elem : elems)
+         {
+            if (map.tile(elem.tag).flags & Tilemap::FlagGoal)
+               goal_mask |= 1u << num_blocks;
+            block_start[num_blocks++] = elem.surf.rect().pos;
+         }
+      }
+
+      unsigned goal_blocks = 0;
+      for (unsigned i = 0; i < num_blocks; i++)
+         goal_blocks += is_goal_block(i);
+
+      if (goal_floors != goal_blocks)
+         throw logic_error("Number of goal floors and goal blocks do not match.");
+
+      if (!goal_floors || !goal_blocks)
+         throw logic_error("Goal floor or blocks are empty.");
+   }
+
+   static bool on_goal(const GameRules& rules, Pos pos)
+   {
+      if (pos.x % rules.tile_w() || pos.y % rules.tile_h())
+         return false;
+
+      return rules.cell(pos.x / rules.tile_w(), pos.y / rules.tile_h()) & GameRules::CellGoal;
+   }
+
+   GameState GameRules::initial_state(Pos player_tile, Input facing) const
+   {
+      GameState state = GameState();
+
+      state.player     = player_tile * Pos(tile_width, tile_height);
+      state.facing     = static_cast<uint8_t>(facing);
+      state.push_held  = true;
+
+      switch (facing)
+      {
+         case Input::Up:    state.player_face = GameState::FaceUp; break;
+         case Input::Down:  state.player_face = GameState::FaceDown; break;
+         case Input::Left:  state.player_face = GameState::FaceLeft; break;
+         case Input::Right: state.player_face = GameState::FaceRight; break;
+         default: throw logic_error("Invalid start facing.");
+      }
+
+      for (unsigned i = 0; i < num_blocks; i++)
+      {
+         state.blocks[i] = block_start[i];
+         if (is_goal_block(i) && on_goal(*this, block_start[i]))
+            state.goals_satisfied |= 1u << i;
+      }
+
+      return state;
+   }
+
+   // Whether pos is inside the map and on the tile grid, or on its way between two tiles along step
+   // in steps of two pixels, like tile_stepper() moves.
+   static bool valid_pos(const GameRules& rules, Pos pos, Pos step)
+   {
+      if (pos.x < 0 || pos.y < 0 ||
+            pos.x > (rules.tiles_width() - 1) * rules.tile_w() ||
+            pos.y > (rules.tiles_height() - 1) * rules.tile_h())
+         return false;
+
+      int off_x = pos.x % rules.tile_w();
+      int off_y = pos.y % rules.tile_h();
+      return (step.x ? off_x % 2 == 0 : !off_x) && (step.y ? off_y % 2 == 0 : !off_y);
+   }
+
+   bool GameRules::is_valid(const GameState& state) const
+   {
+      bool stepping = state.stepper == GameState::StepperPlayer || state.stepper == GameState::StepperBlock;
+      Pos step(state.step_x, state.step_y);
+      if (stepping && abs(step.x) + abs(step.y) != 1)
+         return false;
+
+      if (!valid_pos(*this, state.player, state.stepper == GameState::StepperPlayer ? step : Pos()))
+         return false;
+
+      for (unsigned i = 0; i < num_blocks; i++)
+      {
+         bool moving = state.stepper == GameState::StepperBlock && state.stepper_block == i;
+         if (!valid_pos(*this, state.blocks[i], moving ? step : Pos()))
+            return false;
+      }
+
+      return state.stepper <= GameState::StepperWin &&
+         (state.stepper != GameState::StepperBlock || state.stepper_block < num_blocks) &&
+         state.step_x >= -1 && state.step_x <= 1 && state.step_y >= -1 && state.step_y <= 1 &&
+         state.facing <= static_cast<uint8_t>(Input::Right) &&
+         state.player_face <= GameState::FaceCheer &&
+         state.player_frame <= 7 &&
+         state.goal_face <= GameState::GoalCheer &&
+         !(state.goals_satisfied & ~goal_mask);
+   }
+
+   Pos input_to_offset(Input input)
+   {
+      switch (input)
+      {
+         case Input::Up:    return Pos(0, -1);
+         case Input::Left:  return Pos(-1, 0);
+         case Input::Right: return Pos(1, 0);
+         case Input::Down:  return Pos(0, 1);
+         default:           return Pos();
+      }
+   }
+
+   static bool edge(GameState& state, unsigned input)
+   {
+      bool pressed = input & input_bit(Input::Push);
+      bool ret = pressed && !state.push_held;
+      state.push_held = pressed;
+      return ret;
+   }
+
+   static int find_block(const GameRules& rules, const GameState& state, Pos pos)
+   {
+      for (unsigned i = 0; i < rules.blocks(); i++)
+         if (state.blocks[i] == pos)
+            return i;
+      return -1;
+   }
+
+   static bool collision(const GameRules& rules, const GameState& state, Pos tile)
+   {
+      return (rules.cell(tile.x, tile.y) & GameRules::CellCollision) ||
+         find_block(rules, state, tile * Pos(rules.tile_w(), rules.tile_h())) >= 0;
+   }
+
+   static bool is_offset_collision(const GameRules& rules, const GameState& state, Pos pos, Pos offset)
+   {
+      int tile_w = rules.tile_w();
+      int tile_h = rules.tile_h();
+
+      // Always assume that the rect in question is inside a single tile.
+      // This is needed as the dino sprite can be slightly larger than 16x16, but it's
+      // *assumed* from a collition detection POV that a surface is tile sized to simplify things.
+      Pos new_pos = pos + offset;
+
+      if (pos.x % tile_w || pos.y % tile_h)
+         throw logic_error("Offset collision check was performed outside tile grid.");
+
+      int current_x = pos.x / tile_w;
+      int current_y = pos.y / tile_h;
+
+      int min_tile_x = new_pos.x / tile_w;
+      int max_tile_x = (new_pos.x + tile_w - 1) / tile_w;
+
+      int min_tile_y = new_pos.y / tile_h;
+      int max_tile_y = (new_pos.y + tile_h - 1) / tile_h;
+
+      for (int y = min_tile_y; y <= max_tile_y; y++)
+         for (int x = min_tile_x; x <= max_tile_x; x++)
+            if (Pos(x, y) != Pos(current_x, current_y) && collision(rules, state, Pos(x, y))) // Can't collide against ourselves.
+               return true;
+
+      return false;
+   }
+
+   static void update_goal(const GameRules& rules, GameState& state, unsigned block)
+   {
+      if (!rules.is_goal_block(block))
+         return;
+
+      if (on_goal(rules, state.blocks[block]))
+         state.goals_satisfied |= 1u << block;
+      else
+         state.goals_satisfied &= ~(1u << block);
+   }
+
+   static bool tile_stepper(const GameRules& rules, GameState& state, unsigned& events)
+   {
+      Pos step_dir(state.step_x, state.step_y);
+      bool is_player = state.stepper == GameState::StepperPlayer;
+      Pos& pos = is_player ? state.player : state.blocks[state.stepper_block];
+
+      pos += 2 * step_dir;
+
+      if (!is_player)
+         update_goal(rules, state, state.stepper_block);
+
+      if (!state.player_walking)
+      {
+         state.player_frame = state.stepper_cnt <= 6 ? 7 : 0;
+         state.stepper_cnt++;
+      }
+
+      if (pos.x % rules.tile_w() || pos.y % rules.tile_h())
+         return true;
+
+      if (is_offset_collision(rules, state, pos, step_dir))
+      {
+         state.is_sliding = false;
+
+         if (!is_player)
+            events |= EventBump;
+
+         return false;
+      }
+
+      unsigned cell = rules.cell(pos.x / rules.tile_w(), pos.y / rules.tile_h());
+      bool slippery = cell & (is_player ? GameRules::CellSlipperyPlayer : GameRules::CellSlipperyBlock);
+
+      state.is_sliding = slippery;
+      return slippery;
+   }
+
+   static void win_animation_stepper(GameState& state, unsigned input, unsigned& events)
+   {
+      state.won_frame_cnt++;
+
+      const unsigned frame_per_iter = 24;
+      unsigned won_frame_cnt = state.won_frame_cnt;
+
+      uint8_t face = GameState::GoalFrozen;
+      if (won_frame_cnt >= 3 * frame_per_iter)
+      {
+         bool jump = ((won_frame_cnt / frame_per_iter - 3) >> 1) & 1;
+         unsigned last_jump = (((won_frame_cnt - 1) / frame_per_iter - 3) >> 1) & 1;
+         face = jump ? GameState::GoalCheer : GameState::GoalDown;
+         state.player_face  = jump ? GameState::FaceCheer : GameState::FaceDown;
+         state.player_frame = 0;
+
+         if (jump && !last_jump)
+            events |= EventJump;
+      }
+      else if (won_frame_cnt >= 2 * frame_per_iter)
+         face = GameState::GoalDefrost2;
+      else if (won_frame_cnt >= 1 * frame_per_iter)
+         face = GameState::GoalDefrost1;
+
+      state.goal_face = face;
+      state.won_early = (won_frame_cnt >= frame_per_iter * 3) && edge(state, input);
+   }
+
+   static void run_stepper(const GameRules& rules, GameState& state, unsigned input, unsigned& events)
+   {
+      switch (state.stepper)
+      {
+         case GameState::StepperNone:
+            break;
+
+         case GameState::StepperWin:
+            win_animation_stepper(state, input, events);
+            break;
+
+         default:
+            if (!tile_stepper(rules, state, events))
+               state.stepper = GameState::StepperNone;
+            break;
+      }
+   }
+
+   static void push_block(const GameRules& rules, GameState& state, unsigned& events)
+   {
+      Pos offset = input_to_offset(static_cast<Input>(state.facing));
+      Pos dir    = offset * Pos(rules.tile_w(), rules.tile_h());
+      int block  = find_block(rules, state, state.player + dir);
+
+      if (block < 0)
+         return;
+
+      int tile_x = state.player.x / rules.tile_w();
+      int tile_y = state.player.y / rules.tile_h();
+      Pos tile_pos(tile_x, tile_y);
+
+      if (!collision(rules, state, tile_pos + (2 * offset)))
+      {
+         state.stepper        = GameState::StepperBlock;
+         state.stepper_block  = block;
+         state.step_x         = offset.x;
+         state.step_y         = offset.y;
+         state.stepper_cnt    = 0;
+         state.player_walking = false;
+         state.player_frame   = 0;
+         state.pushes++;
+         events |= EventPush;
+      }
+   }
+
+   static void move_if_no_collision(const GameRules& rules, GameState& state, Input input)
+   {
+      static const uint8_t faces[] = {
+         GameState::FaceUp, GameState::FaceDown, GameState::FaceLeft, GameState::FaceRight,
+      };
+
+      state.facing       = static_cast<uint8_t>(input);
+      state.player_face  = faces[static_cast<unsigned>(input)];
+      state.player_frame = 0;
+
+      Pos offset = input_to_offset(input);
+      if (!is_offset_collision(rules, state, state.player, offset))
+      {
+         state.stepper        = GameState::StepperPlayer;
+         state.step_x         = offset.x;
+         state.step_y         = offset.y;
+         state.player_walking = true;
+      }
+   }
+
+   static void update_input(const GameRules& rules, GameState& state, unsigned input, unsigned& events)
+   {
+      bool push_trigger = edge(state, input);
+
+      if (push_trigger)
+         push_block(rules, state, events);
+      else if (input & input_bit(Input::Up))
+         move_if_no_collision(rules, state, Input::Up);
+      else if (input & input_bit(Input::Down))
+         move_if_no_collision(rules, state, Input::Down);
+      else if (input & input_bit(Input::Left))
+         move_if_no_collision(rules, state, Input::Left);
+      else if (input & input_bit(Input::Right))
+         move_if_no_collision(rules, state, Input::Right);
+   }
+
+   static void update_animation(GameState& state)
+   {
+      state.frame_cnt++;
+
+      // Animation from index 1 to 4, "neutral position" in 0. "Slippery" animations in 5 and 6.
+      if (state.is_sliding)
+         state.player_frame = (state.frame_cnt / 10) % 2 + 5;
+      else
+         state.player_frame = (state.frame_cnt / 10) % 4 + 1;
+   }
+
+   static void prepare_won_animation(GameState& state, unsigned& events)
+   {
+      state.won_frame_cnt  = 1;
+      state.player_walking = false;
+      state.push_held      = true; // Avoid exiting win animation early.
+      state.won_early      = false;
+      state.stepper        = GameState::StepperWin;
+      events |= EventMelt;
+   }
+
+   unsigned step(const GameRules& rules, GameState& state, unsigned input)
+   {
+      unsigned events = 0;
+
+      bool had_stepper = state.stepper != GameState::StepperNone;
+      run_stepper(rules, state, input, events);
+
+      if (state.won_frame_cnt)
+         return events;
+
+      if (state.stepper == GameState::StepperNone)
+         update_input(rules, state, input, events);
+      else
+         edge(state, input);
+
+      // Reset animation.
+      if (!had_stepper && state.stepper != GameState::StepperNone)
+         state.frame_cnt = 0;
+      else if (state.stepper == GameState::StepperNone)
+      {
+         state.frame_cnt    = 0;
+         state.player_frame = 0;
+      }
+
+      if (state.stepper != GameState::StepperNone && state.player_walking)
+         update_animation(state);
+
+      if (state.goals_satisfied == rules.goals())
+         prepare_won_animation(state, events);
+
+      return events;
+   }
+}
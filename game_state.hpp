@@ -0,0 +1,153 @@
+#ifndef GAME_STATE_HPP__
+#define GAME_STATE_HPP__
+
+#include "blit.hpp"
+#include "tilemap.hpp"
+
+#include <stdint.h>
+#include <type_traits>
+#include <vector>
+
+namespace Icy
+{
+   enum class Input : unsigned
+   {
+      Up = 0,
+      Down,
+      Left,
+      Right,
+      Push,
+      Menu,
+      Reset,
+      None
+   };
+
+   inline unsigned input_bit(Input input)
+   {
+      return input == Input::None ? 0 : 1u << static_cast<unsigned>(input);
+   }
+
+   // Side effects of a simulation step which the caller might want to present, e.g. as sound.
+   enum GameEvent
+   {
+      EventPush = 1 << 0,
+      EventBump = 1 << 1,
+      EventMelt = 1 << 2,
+      EventJump = 1 << 3
+   };
+
+   // Everything which changes while a level is played.
+   // Trivially copyable, so snapshots are a plain copy.
+   struct GameState
+   {
+      enum { max_blocks = 32 };
+
+      enum Stepper
+      {
+         StepperNone = 0,
+         StepperPlayer,
+         StepperBlock,
+         StepperWin
+      };
+
+      enum PlayerFace
+      {
+         FaceUp = 0,
+         FaceDown,
+         FaceLeft,
+         FaceRight,
+         FaceCheer
+      };
+
+      enum GoalFace
+      {
+         GoalFrozen = 0,
+         GoalDefrost1,
+         GoalDefrost2,
+         GoalDown,
+         GoalCheer
+      };
+
+      Blit::Pos player;
+      Blit::Pos blocks[max_blocks];
+
+      uint32_t pushes;
+      uint32_t frame_cnt;
+      uint32_t stepper_cnt;
+      uint32_t won_frame_cnt;
+      uint32_t goals_satisfied; // Bitmask of goal blocks resting on a goal floor.
+
+      uint8_t stepper;
+      uint8_t stepper_block;
+      int8_t step_x, step_y;
+
+      uint8_t facing; // Input
+      uint8_t player_face;
+      uint8_t player_frame;
+      uint8_t goal_face;
+
+      bool player_walking;
+      bool is_sliding;
+      bool won_early;
+      bool push_held;
+
+      enum { won_frame_cnt_limit = 60 * 5 };
+      bool won() const { return won_early || won_frame_cnt >= won_frame_cnt_limit; }
+   };
+
+   static_assert(std::is_trivially_copyable<GameState>::value,
+         "GameState is copied with memcpy() by save states and the rewind buffer.");
+
+   // Static, per-level data the rules need. Built once from the tilemap.
+   class GameRules
+   {
+      public:
+         enum CellFlag
+         {
+            CellCollision      = 1 << 0,
+            CellGoal           = 1 << 1,
+            CellSlipperyPlayer = 1 << 2,
+            CellSlipperyBlock  = 1 << 3
+         };
+
+         GameRules() : width(0), height(0), tile_width(0), tile_height(0), num_blocks(0), goal_mask(0) {}
+         GameRules(const Blit::Tilemap& map);
+
+         GameState initial_state(Blit::Pos player_tile, Input facing) const;
+
+         // Whether a state, e.g. one read from a save state, is safe to step and render.
+         bool is_valid(const GameState& state) const;
+
+         unsigned cell(int x, int y) const
+         {
+            if (x < 0 || y < 0 || x >= width || y >= height)
+               return 0;
+            return cells[y * width + x];
+         }
+
+         int tiles_width() const { return width; }
+         int tiles_height() const { return height; }
+         int tile_w() const { return tile_width; }
+         int tile_h() const { return tile_height; }
+
+         unsigned blocks() const { return num_blocks; }
+         uint32_t goals() const { return goal_mask; }
+         bool is_goal_block(unsigned block) const { return goal_mask & (1u << block); }
+
+      private:
+         int width, height, tile_width, tile_height;
+         std::vector<uint8_t> cells;
+
+         unsigned num_blocks;
+         uint32_t goal_mask;
+         Blit::Pos block_start[GameState::max_blocks];
+   };
+
+   // Advances the game by one frame. Input is a mask of input_bit() values.
+   // Has no side effects outside of state, returns a mask of GameEvent.
+   unsigned step(const GameRules& rules, GameState& state, unsigned input);
+
+   Blit::Pos input_to_offset(Input input);
+}
+
+#endif
@@ -0,0 +1,275 @@
+#include "job_pool.hpp"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace Blit
+{
+   namespace
+   {
+      // The pool and queue of the worker running on this thread, if any.
+      thread_local const JobPool *current_pool;
+      thread_local unsigned current_queue;
+   }
+
+   JobPool::JobPool(unsigned threads)
+      : origin(Clock::now()),
+      num_threads(threads ? threads : max(thread::hardware_concurrency(), 2u) - 1),
+      queued(0), unfinished(0), waiters(0), stop(false), queues(num_threads + 1)
+   {}
+
+   JobPool::~JobPool()
+   {
+      wait_all();
+
+      {
+         lock_guard<mutex> hold(lock);
+         stop = true;
+      }
+      cond.notify_all();
+
+      for (auto& worker : workers)
+         worker.join();
+   }
+
+   JobPool::Job JobPool::add(string name, function<void ()> func, const vector<Job>& dependencies)
+   {
+      Job job;
+      bool ready;
+      {
+         lock_guard<mutex> hold(lock);
+         if (workers.empty())
+            for (unsigned i = 0; i < num_threads; i++)
+               workers.push_back(thread(&JobPool::work, this, i));
+
+         job = tasks.size();
+         tasks.emplace_back();
+         Task& task   = tasks.back();
+         task.name    = move(name);
+         task.func    = move(func);
+         task.waiting = 0;
+         task.done    = false;
+
+         for (auto dependency : dependencies)
+         {
+            Task& other = tasks.at(dependency);
+            if (!other.done)
+            {
+               other.dependents.push_back(job);
+               task.waiting++;
+            }
+            else if (other.error && !task.error)
+               task.error = other.error;
+         }
+
+         unfinished++;
+         ready = !task.waiting;
+         if (ready)
+            push(queue_index(), job);
+      }
+
+      if (ready)
+         cond.notify_all();
+      return job;
+   }
+
+   void JobPool::wait(Job job)
+   {
+      unsigned index = queue_index();
+      for (;;)
+      {
+         {
+            lock_guard<mutex> hold(lock);
+            const Task& task = tasks.at(job);
+            if (task.done)
+            {
+               if (task.error)
+                  rethrow_exception(task.error);
+               return;
+            }
+         }
+
+         Job other;
+         if (pop(index, other))
+         {
+            run(index, other);
+            continue;
+         }
+
+         unique_lock<mutex> hold(lock);
+         waiters++;
+         cond.wait(hold, [this, job] { return tasks[job].done || queued; });
+         waiters--;
+      }
+   }
+
+   void JobPool::wait(const vector<Job>& jobs)
+   {
+      for (auto job : jobs)
+         wait(job);
+   }
+
+   void JobPool::wait_all()
+   {
+      unsigned index = queue_index();
+      for (;;)
+      {
+         {
+            lock_guard<mutex> hold(lock);
+            if (!unfinished)
+               return;
+         }
+
+         Job other;
+         if (pop(index, other))
+         {
+            run(index, other);
+            continue;
+         }
+
+         unique_lock<mutex> hold(lock);
+         waiters++;
+         cond.wait(hold, [this] { return !unfinished || queued; });
+         waiters--;
+      }
+   }
+
+   vector<JobPool::Span> JobPool::timeline() const
+   {
+      vector<Span> spans;
+      {
+         lock_guard<mutex> hold(lock);
+         for (auto& task : tasks)
+            if (task.done)
+               spans.push_back(task.span);
+      }
+
+      sort(begin(spans), end(spans), [](const Span& a, const Span& b) { return a.start < b.start; });
+      return spans;
+   }
+
+   void JobPool::work(unsigned index)
+   {
+      current_pool  = this;
+      current_queue = index;
+
+      for (;;)
+      {
+         Job job;
+         if (pop(index, job))
+         {
+            run(index, job);
+
+            // Lets a thread woken up by the job run before taking on the next one, in case
+            // there are more threads than cores.
+            if (waiters)
+               this_thread::yield();
+            continue;
+         }
+
+         unique_lock<mutex> hold(lock);
+         cond.wait(hold, [this] { return stop || queued; });
+         if (stop)
+            return;
+      }
+   }
+
+   // Called with the lock held.
+   void JobPool::push(unsigned queue, Job job)
+   {
+      {
+         lock_guard<mutex> hold(queues[queue].lock);
+         queues[queue].jobs.push_back(job);
+      }
+      queued++;
+   }
+
+   bool JobPool::pop(unsigned queue, Job& job)
+   {
+      bool found = false;
+      for (unsigned i = 0; i < queues.size() && !found; i++)
+      {
+         // Newest first from our own queue, oldest first from the others.
+         Queue& from = queues[(queue + i) % queues.size()];
+         lock_guard<mutex> hold(from.lock);
+         if (from.jobs.empty())
+            continue;
+
+         if (i == 0)
+         {
+            job = from.jobs.back();
+            from.jobs.pop_back();
+         }
+         else
+         {
+            job = from.jobs.front();
+            from.jobs.pop_front();
+         }
+         found = true;
+      }
+
+      if (found)
+      {
+         lock_guard<mutex> hold(lock);
+         queued--;
+      }
+      return found;
+   }
+
+   void JobPool::run(unsigned queue, Job job)
+   {
+      function<void ()> func;
+      exception_ptr error;
+      {
+         lock_guard<mutex> hold(lock);
+         func  = move(tasks[job].func);
+         error = tasks[job].error;
+      }
+
+      double start = now();
+      if (!error)
+      {
+         try
+         {
+            func();
+         }
+         catch (...)
+         {
+            error = current_exception();
+         }
+      }
+      double end = now();
+      func = nullptr;
+
+      {
+         lock_guard<mutex> hold(lock);
+         Task& task = tasks[job];
+         task.done  = true;
+         task.error = error;
+         task.span  = Span{task.name, queue == num_threads ? 0 : queue + 1, start, end};
+
+         for (auto dependent : task.dependents)
+         {
+            Task& other = tasks[dependent];
+            if (error && !other.error)
+               other.error = error;
+            if (!--other.waiting)
+               push(queue, dependent);
+         }
+
+         unfinished--;
+      }
+      cond.notify_all();
+   }
+
+   unsigned JobPool::queue_index() const
+   {
+      return current_pool == this ? current_queue : num_threads;
+   }
+
+   double JobPool::now() const
+   {
+      return chrono::duration<double, milli>(Clock::now() - origin).count();
+   }
+}
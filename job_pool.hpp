@@ -0,0 +1,98 @@
+#ifndef JOB_POOL_HPP__
+#define JOB_POOL_HPP__
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Blit
+{
+   // Runs jobs on worker threads, each job once the jobs it depends on are done.
+   // Every thread has its own queue. Jobs a thread makes ready go to the back of its queue and it
+   // works from there, so related work stays on one core; an idle thread steals from the front of
+   // the others. Threads waiting for a job run queued jobs in the meantime.
+   // Workers are started by the first job. Safe to use from several threads.
+   class JobPool
+   {
+      public:
+         typedef std::size_t Job;
+
+         // 0 threads means one less than the number of cores, as the thread waiting helps out.
+         explicit JobPool(unsigned threads = 0);
+         ~JobPool();
+
+         JobPool(const JobPool&) = delete;
+         void operator=(const JobPool&) = delete;
+
+         Job add(std::string name, std::function<void ()> func, const std::vector<Job>& dependencies = std::vector<Job>());
+
+         // Blocks until job is done and rethrows what it threw, if anything. A job fails if one it
+         // depends on does, without running.
+         void wait(Job job);
+         void wait(const std::vector<Job>& jobs);
+         // Waits for every job added so far, ignoring failures.
+         void wait_all();
+
+         // When and on which thread jobs ran. Thread 0 is any thread which isn't a worker.
+         struct Span
+         {
+            std::string name;
+            unsigned thread;
+            double start, end; // Milliseconds since the pool was created.
+         };
+
+         std::vector<Span> timeline() const;
+         unsigned threads() const { return num_threads + 1; }
+
+      private:
+         struct Task
+         {
+            std::string name;
+            std::function<void ()> func;
+            std::vector<Job> dependents;
+            unsigned waiting;
+            bool done;
+            std::exception_ptr error;
+            Span span;
+         };
+
+         struct Queue
+         {
+            std::mutex lock;
+            std::deque<Job> jobs;
+         };
+
+         typedef std::chrono::steady_clock Clock;
+
+         Clock::time_point origin;
+         unsigned num_threads;
+
+         mutable std::mutex lock; // Guards the tasks and the counters.
+         std::condition_variable cond; // Signalled whenever a job is queued or done.
+         std::deque<Task> tasks;
+         std::size_t queued;
+         std::size_t unfinished;
+         std::atomic<unsigned> waiters; // Threads blocked in wait().
+         bool stop;
+
+         std::deque<Queue> queues; // One per worker, the last one for other threads.
+         std::vector<std::thread> workers;
+
+         void work(unsigned index);
+         void push(unsigned queue, Job job);
+         bool pop(unsigned queue, Job& job);
+         void run(unsigned queue, Job job);
+         unsigned queue_index() const;
+         double now() const;
+   };
+}
+
+#endif
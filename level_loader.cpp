@@ -0,0 +1,78 @@
+#include "game.hpp"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace Icy
+{
+   LevelLoader::~LevelLoader()
+   {
+      // Futures from std::async wait for their task when destroyed.
+      pending = future<unique_ptr<Game>>();
+      dropped.clear();
+   }
+
+   void LevelLoader::request(const string& path, unsigned chapter, unsigned level, Blit::FontCluster& font)
+   {
+      cleanup();
+
+      if (requested && this->chapter == chapter && this->level == level)
+         return;
+
+      // Waiting for the old one here would hold up the frame, so it finishes loading on its own.
+      if (pending.valid())
+         dropped.push_back(move(pending));
+
+      Blit::FontCluster *font_ptr = &font;
+      pending = async(launch::async, [path, chapter, level, font_ptr]() {
+               return Blit::Utils::make_unique<Game>(path, chapter, level, 0, *font_ptr);
+            });
+
+      requested     = true;
+      this->chapter = chapter;
+      this->level   = level;
+   }
+
+   bool LevelLoader::ready(unsigned chapter, unsigned level) const
+   {
+      return requested && this->chapter == chapter && this->level == level && pending.valid() &&
+         pending.wait_for(chrono::seconds(0)) == future_status::ready;
+   }
+
+   unique_ptr<Game> LevelLoader::take(unsigned chapter, unsigned level)
+   {
+      cleanup();
+
+      if (!requested || this->chapter != chapter || this->level != level || !pending.valid())
+      {
+         m_stats.missed++;
+         return nullptr;
+      }
+
+      requested = false;
+      if (pending.wait_for(chrono::seconds(0)) == future_status::ready)
+         m_stats.ready++;
+      else
+         m_stats.waited++;
+
+      try
+      {
+         return pending.get();
+      }
+      catch (const exception& e)
+      {
+         // Loading it again on the spot reports the error.
+         if (log_cb)
+            log_cb(RETRO_LOG_ERROR, "Dinothawr: Prefetching level failed: %s\n", e.what());
+         return nullptr;
+      }
+   }
+
+   void LevelLoader::cleanup()
+   {
+      dropped.erase(remove_if(dropped.begin(), dropped.end(), [](const future<unique_ptr<Game>>& fut) {
+               return fut.wait_for(chrono::seconds(0)) == future_status::ready;
+            }), dropped.end());
+   }
+}
@@ -5,8 +5,13 @@
 #include <stdlib.h>
 #include <iostream>
 #include <cmath>
+#include <time.h>
 
+#include "asset_pack.hpp"
+#include "disk_cache.hpp"
 #include "game.hpp"
+#include "replay.hpp"
+#include "rewind.hpp"
 #include "utils.hpp"
 #include "audio/mixer.hpp"
 
@@ -28,6 +33,16 @@ static bool use_audio_cb;
 static bool use_frame_time_cb;
 static bool option_use_frame_time;
 
+static RewindBuffer rewind_buffer;
+static vector<uint8_t> rewind_state;
+static size_t option_rewind_budget;
+static unsigned option_run_ahead;
+
+static Recording recording;
+static bool option_record;
+static bool recording_pending;
+static unsigned frame_input;
+
 retro_log_printf_t log_cb;
 static retro_video_refresh_t video_cb;
 static retro_audio_sample_t audio_cb;
@@ -89,7 +104,7 @@ void retro_get_system_info(struct retro_system_info *info)
 #endif
    info->library_version  = "v1.0" GIT_VERSION;
    info->need_fullpath    = true;
-   info->valid_extensions = "game";
+   info->valid_extensions = "game|pack";
 }
 
 void retro_get_system_av_info(struct retro_system_av_info *info)
@@ -152,6 +167,79 @@ static void frame_time_cb(retro_usec_t usec)
    frame_time = usec;
 }
 
+static void init_rewind()
+{
+   if (!game || !option_rewind_budget)
+   {
+      rewind_buffer = RewindBuffer();
+      rewind_state.clear();
+      return;
+   }
+
+   rewind_state.resize(game->serialize_size());
+   rewind_buffer = RewindBuffer(rewind_state.size(), option_rewind_budget);
+}
+
+static void record_rewind()
+{
+   if (rewind_state.empty() || !game->serialize(rewind_state.data(), rewind_state.size()))
+      return;
+
+   rewind_buffer.push(rewind_state.data());
+}
+
+static void step_back(bool present)
+{
+   if (rewind_buffer.pop(rewind_state.data()))
+   {
+      game->unserialize(rewind_state.data(), rewind_state.size());
+
+      // Rewinding past the start of the recording begins a new one.
+      if (option_record && !recording.drop_last())
+         recording_pending = true;
+   }
+
+   if (present)
+      game->present();
+}
+
+static void save_recording()
+{
+   if (!recording.frames())
+      return;
+
+   const char *dir = NULL;
+   if (!environ_cb(RETRO_ENVIRONMENT_GET_SAVE_DIRECTORY, &dir) || !dir)
+      dir = game_path_dir.c_str();
+
+   char name[64];
+   time_t now = time(NULL);
+   strftime(name, sizeof(name), "dinothawr-%Y%m%d-%H%M%S.rec", localtime(&now));
+   string path = join(dir, "/", name);
+
+   try
+   {
+      recording.save(path);
+      if (log_cb)
+         log_cb(RETRO_LOG_INFO, "Dinothawr: Saved %u frames of input to %s.\n",
+               static_cast<unsigned>(recording.frames()), path.c_str());
+   }
+   catch (const exception& e)
+   {
+      if (log_cb)
+         log_cb(RETRO_LOG_ERROR, "Dinothawr: %s\n", e.what());
+   }
+}
+
+// Saves what has been recorded so far. If recording is enabled, a new one starts on the next frame,
+// after the frontend has had a chance to load save RAM.
+static void restart_recording()
+{
+   save_recording();
+   recording = Recording();
+   recording_pending = option_record;
+}
+
 static void update_variables()
 {
    retro_variable var = { "dino_timer" };
@@ -165,6 +253,55 @@ static void update_variables()
       if (log_cb)
          log_cb(RETRO_LOG_INFO, "Dinothawr: Using timer as FPS reference: %s.\n", option_use_frame_time ? "enabled" : "disabled");
    }
+
+   var = { "dino_rewind" };
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+   {
+      size_t budget = strtoul(var.value, NULL, 0) << 20;
+      if (budget != option_rewind_budget)
+      {
+         option_rewind_budget = budget;
+         init_rewind();
+      }
+   }
+
+   var = { "dino_run_ahead" };
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+      option_run_ahead = strtoul(var.value, NULL, 0);
+
+   var = { "dino_image_cache" };
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+      Blit::SurfaceCache::set_budget(strtoul(var.value, NULL, 0) << 20);
+
+   var = { "dino_record" };
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+   {
+      bool record = !strcmp(var.value, "enabled");
+      if (record != option_record)
+      {
+         option_record = record;
+         restart_recording();
+      }
+   }
+}
+
+// Samples every button once per frame, so the game and the recording see the same input.
+static void poll_input()
+{
+   static const unsigned buttons[] = {
+      RETRO_DEVICE_ID_JOYPAD_UP,
+      RETRO_DEVICE_ID_JOYPAD_DOWN,
+      RETRO_DEVICE_ID_JOYPAD_LEFT,
+      RETRO_DEVICE_ID_JOYPAD_RIGHT,
+      RETRO_DEVICE_ID_JOYPAD_B,     // Push
+      RETRO_DEVICE_ID_JOYPAD_A,     // Menu
+      RETRO_DEVICE_ID_JOYPAD_X,     // Reset
+   };
+
+   frame_input = 0;
+   for (unsigned i = 0; i < sizeof(buttons) / sizeof(buttons[0]); i++)
+      if (input_state_cb(0, RETRO_DEVICE_JOYPAD, 0, buttons[i]))
+         frame_input |= input_bit(static_cast<Input>(i));
 }
 
 static void check_variables()
@@ -181,6 +318,8 @@ void retro_run(void)
       frame_time = time_reference;
 
    input_poll_cb();
+   bool rewinding = !rewind_state.empty() && input_state_cb(0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_L);
+   poll_input();
 
    if (frame_time < (time_reference >> 1))
       total_time += frame_time;
@@ -192,11 +331,34 @@ void retro_run(void)
       video_cb(NULL, Game::fb_width, Game::fb_height, 0);
    else
    {
-      present_frame = false;
-      for (int i = 0; i < frames - 1; i++)
-         game->iterate();
-      present_frame = true;
-      game->iterate();
+      bool run_ahead = option_run_ahead && !rewinding;
+
+      for (int i = 0; i < frames; i++)
+      {
+         present_frame = i == frames - 1 && !run_ahead;
+
+         if (rewinding)
+            step_back(present_frame);
+         else
+         {
+            if (recording_pending)
+            {
+               recording.start(*game);
+               recording_pending = false;
+            }
+
+            game->iterate(present_frame);
+            record_rewind();
+            if (option_record)
+               recording.record(frame_input, *game);
+         }
+      }
+
+      if (run_ahead)
+      {
+         present_frame = true;
+         game->run_ahead(option_run_ahead);
+      }
       total_time -= time_reference * frames;
    }
 
@@ -212,20 +374,7 @@ void retro_run(void)
 static void load_game(const string& path)
 {
    auto input_cb = [&](Input input) -> bool {
-      unsigned btn;
-      switch (input)
-      {
-         case Input::Up:    btn = RETRO_DEVICE_ID_JOYPAD_UP; break;
-         case Input::Down:  btn = RETRO_DEVICE_ID_JOYPAD_DOWN; break;
-         case Input::Left:  btn = RETRO_DEVICE_ID_JOYPAD_LEFT; break;
-         case Input::Right: btn = RETRO_DEVICE_ID_JOYPAD_RIGHT; break;
-         case Input::Push:  btn = RETRO_DEVICE_ID_JOYPAD_B; break;
-         case Input::Menu:  btn = RETRO_DEVICE_ID_JOYPAD_A; break;
-         case Input::Reset: btn = RETRO_DEVICE_ID_JOYPAD_X; break;
-         default: return false;
-      }
-
-      return input_state_cb(0, RETRO_DEVICE_JOYPAD, 0, btn);
+      return frame_input & input_bit(input);
    };
 
    game = Blit::Utils::make_unique<GameManager>(path, input_cb,
@@ -234,6 +383,9 @@ static void load_game(const string& path)
                video_cb(data, width, height, pitch);
          }
    );
+
+   init_rewind();
+   restart_recording();
 }
 
 void retro_reset(void)
@@ -260,6 +412,7 @@ bool retro_load_game(const struct retro_game_info* info)
       { 0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_B,     "Push" },
       { 0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_A,     "Menu" },
       { 0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_X,     "Reset" },
+      { 0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_L,     "Rewind" },
 
       { 0 },
    };
@@ -274,11 +427,20 @@ bool retro_load_game(const struct retro_game_info* info)
    struct retro_frame_time_callback frame_cb = { frame_time_cb, time_reference };
    use_frame_time_cb = environ_cb(RETRO_ENVIRONMENT_SET_FRAME_TIME_CALLBACK, &frame_cb);
 
-   game_path     = info->path;
+   // Content is either a .game file or an asset pack holding one.
+   game_path     = Blit::AssetPack::mount_content(info->path);
    game_path_dir = basedir(game_path);
+
+   // Decoded images and level previews are kept on disk between runs.
+   const char *save_dir = NULL;
+   if (environ_cb(RETRO_ENVIRONMENT_GET_SAVE_DIRECTORY, &save_dir) && save_dir)
+      Blit::DiskCache::set(make_shared<Blit::DiskCache>(join(save_dir, "/dinothawr_cache")));
+   else
+      Blit::DiskCache::set(make_shared<Blit::DiskCache>(join(game_path_dir, "/cache")));
+
    load_game(game_path);
 
-   mixer         = Audio::Mixer();
+   mixer.clear();
 
    retro_pixel_format fmt = RETRO_PIXEL_FORMAT_XRGB8888;
    environ_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &fmt);
@@ -294,7 +456,11 @@ bool retro_load_game_special(unsigned, const struct retro_game_info*, size_t)
 
 void retro_unload_game(void)
 {
+   restart_recording();
    game.reset();
+   Blit::DiskCache::set(nullptr);
+   Blit::AssetPack::mount(nullptr, "");
+   init_rewind();
 }
 
 unsigned retro_get_region(void)
@@ -304,17 +470,21 @@ unsigned retro_get_region(void)
 
 size_t retro_serialize_size(void)
 {
-   return 0;
+   return game ? game->serialize_size() : 0;
 }
 
-bool retro_serialize(void*, size_t)
+bool retro_serialize(void *data, size_t size)
 {
-   return false;
+   return game && game->serialize(data, size);
 }
 
-bool retro_unserialize(const void*, size_t)
+bool retro_unserialize(const void *data, size_t size)
 {
-   return false;
+   if (!game || !game->unserialize(data, size))
+      return false;
+
+   restart_recording();
+   return true;
 }
 
 void* retro_get_memory_data(unsigned id)
@@ -38,6 +38,58 @@ struct retro_core_option_definition option_defs_us[] = {
       },
       "enabled",
    },
+   {
+      "dino_rewind",
+      "Rewind memory",
+      "Memory kept for stepping back in time with the L button. Older history is dropped when it runs out.",
+      {
+         { "disabled", NULL },
+         { "1MB",  NULL },
+         { "4MB",  NULL },
+         { "16MB", NULL },
+         { "64MB", NULL },
+         { NULL, NULL},
+      },
+      "4MB",
+   },
+   {
+      "dino_run_ahead",
+      "Run-ahead frames",
+      "Shows the game this many frames ahead to hide input latency. Costs one extra simulated frame each.",
+      {
+         { "disabled", NULL },
+         { "1", NULL },
+         { "2", NULL },
+         { "3", NULL },
+         { "4", NULL },
+         { NULL, NULL},
+      },
+      "disabled",
+   },
+   {
+      "dino_image_cache",
+      "Image cache size",
+      "Memory kept for decoded images which are not on screen, so changing levels doesn't decode them again.",
+      {
+         { "8MB",  NULL },
+         { "16MB", NULL },
+         { "32MB", NULL },
+         { "64MB", NULL },
+         { NULL, NULL},
+      },
+      "32MB",
+   },
+   {
+      "dino_record",
+      "Record input",
+      "Records the input and a checksum of every frame to a file in the save directory, for replaying bug reports.",
+      {
+         { "disabled", NULL },
+         { "enabled",  NULL },
+         { NULL, NULL},
+      },
+      "disabled",
+   },
    { NULL, NULL, NULL, { NULL, NULL }, NULL },
 };
 
@@ -0,0 +1,126 @@
+#include "mapped_file.hpp"
+
+#include <stdio.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace Blit
+{
+   MappedFile::MappedFile(MappedFile&& other)
+      : map(other.map), length(other.length), buffer(move(other.buffer)), owner(move(other.owner))
+   {
+      other.map    = NULL;
+      other.length = 0;
+   }
+
+   MappedFile& MappedFile::operator=(MappedFile&& other)
+   {
+      if (this != &other)
+      {
+         close();
+         map    = other.map;
+         length = other.length;
+         buffer = move(other.buffer);
+         owner  = move(other.owner);
+
+         other.map    = NULL;
+         other.length = 0;
+      }
+      return *this;
+   }
+
+   void MappedFile::view(shared_ptr<const void> owner, const uint8_t *data, size_t size)
+   {
+      close();
+      this->owner = move(owner);
+      map    = data;
+      length = size;
+   }
+
+#ifdef HAVE_MMAP
+   bool MappedFile::open(const string& path)
+   {
+      close();
+
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if (fd < 0)
+         return false;
+
+      struct stat st;
+      if (fstat(fd, &st) < 0)
+      {
+         ::close(fd);
+         return false;
+      }
+
+      length = st.st_size;
+      if (length)
+      {
+         void *ptr = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+         if (ptr == MAP_FAILED)
+         {
+            ::close(fd);
+            length = 0;
+            return false;
+         }
+         map = static_cast<const uint8_t*>(ptr);
+      }
+
+      ::close(fd);
+      return true;
+   }
+
+   void MappedFile::close()
+   {
+      if (map && !owner)
+         munmap(const_cast<uint8_t*>(map), length);
+
+      map    = NULL;
+      length = 0;
+      buffer.clear();
+      owner.reset();
+   }
+#else
+   bool MappedFile::open(const string& path)
+   {
+      close();
+
+      FILE *file = fopen(path.c_str(), "rb");
+      if (!file)
+         return false;
+
+      fseek(file, 0, SEEK_END);
+      long size = ftell(file);
+      fseek(file, 0, SEEK_SET);
+
+      buffer.resize(size > 0 ? size : 0);
+      bool ok = size >= 0 && fread(buffer.data(), 1, buffer.size(), file) == buffer.size();
+      fclose(file);
+
+      if (!ok)
+      {
+         buffer.clear();
+         return false;
+      }
+
+      length = buffer.size();
+      return true;
+   }
+
+   void MappedFile::close()
+   {
+      map    = NULL;
+      length = 0;
+      buffer.clear();
+      owner.reset();
+   }
+#endif
+}
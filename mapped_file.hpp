@@ -0,0 +1,43 @@
+#ifndef MAPPED_FILE_HPP__
+#define MAPPED_FILE_HPP__
+
+#include <stdint.h>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Blit
+{
+   // Read-only view of a whole file. It's memory mapped where the platform supports it,
+   // and read into memory otherwise.
+   class MappedFile
+   {
+      public:
+         MappedFile() : map(NULL), length(0) {}
+         ~MappedFile() { close(); }
+
+         MappedFile(MappedFile&& other);
+         MappedFile& operator=(MappedFile&& other);
+         MappedFile(const MappedFile&) = delete;
+         void operator=(const MappedFile&) = delete;
+
+         // Returns false if the file can't be opened. Empty files open fine.
+         bool open(const std::string& path);
+
+         // Refers to memory kept alive by owner instead, e.g. a file inside an asset pack.
+         void view(std::shared_ptr<const void> owner, const uint8_t *data, std::size_t size);
+         void close();
+
+         const uint8_t* data() const { return map ? map : buffer.data(); }
+         std::size_t size() const { return length; }
+
+      private:
+         const uint8_t *map;
+         std::size_t length;
+         std::vector<uint8_t> buffer;
+         std::shared_ptr<const void> owner;
+   };
+}
+
+#endif
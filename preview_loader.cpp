@@ -0,0 +1,158 @@
+#include "game.hpp"
+#include "disk_cache.hpp"
+
+#include <algorithm>
+
+using namespace std;
+using namespace Blit;
+
+namespace Icy
+{
+   PreviewLoader::~PreviewLoader()
+   {
+      if (!pool)
+         return;
+
+      {
+         lock_guard<mutex> hold(lock);
+         stop = true;
+      }
+      pool->wait(jobs);
+   }
+
+   void PreviewLoader::start(vector<string> paths, const Surface& bg, JobPool& pool)
+   {
+      this->paths = move(paths);
+      this->bg    = bg;
+
+      const Rect& rect = bg.rect();
+      if (rect.w && rect.h)
+         bg_hash = DiskCache::hash_bytes(bg.pixel_raw(rect.pos), rect.w * rect.h * sizeof(Pixel));
+
+      pending = this->paths.size();
+      for (unsigned i = 0; i < this->paths.size(); i++)
+         queue.push_back(i);
+
+      // Each job renders whichever preview is first in the queue when it runs, so prioritize()
+      // still applies to previews not started yet.
+      this->pool = &pool;
+      for (unsigned i = 0; i < this->paths.size(); i++)
+         jobs.push_back(pool.add("preview", [this] { render_next(); }));
+   }
+
+   void PreviewLoader::prioritize(unsigned first, unsigned count)
+   {
+      lock_guard<mutex> hold(lock);
+      stable_partition(queue.begin(), queue.end(), [first, count](unsigned index) {
+            return index >= first && index < first + count;
+         });
+   }
+
+   void PreviewLoader::poll(vector<Preview>& done)
+   {
+      lock_guard<mutex> hold(lock);
+      for (auto& preview : finished_previews)
+         done.push_back(move(preview));
+      finished_previews.clear();
+   }
+
+   void PreviewLoader::wait(vector<Preview>& done)
+   {
+      // Lends a hand with the previews rather than just waiting for them.
+      if (pool)
+         pool->wait(jobs);
+
+      {
+         unique_lock<mutex> hold(lock);
+         cond.wait(hold, [this] { return !pending; });
+      }
+      poll(done);
+   }
+
+   bool PreviewLoader::finished() const
+   {
+      lock_guard<mutex> hold(lock);
+      return !pending;
+   }
+
+   void PreviewLoader::render_next()
+   {
+      unique_lock<mutex> hold(lock);
+      if (stop || queue.empty())
+         return;
+
+      Preview preview;
+      preview.index = queue.front();
+      queue.pop_front();
+
+      hold.unlock();
+      try
+      {
+         preview.surface = Surface(load(preview.index));
+      }
+      catch (const exception& e)
+      {
+         preview.error = e.what();
+      }
+      hold.lock();
+
+      finished_previews.push_back(move(preview));
+      pending--;
+      cond.notify_all();
+   }
+
+   // Previews on disk are named by the hash of the level and the background, and list
+   // the tilesets and sprites the level uses as dependencies.
+   shared_ptr<const Surface::Data> PreviewLoader::load(unsigned index)
+   {
+      DiskCache *disk = DiskCache::get();
+      uint64_t key = disk ? disk->hash_file(paths[index]) : 0;
+      if (!key)
+         return render(paths[index], bg);
+
+      key = DiskCache::hash_bytes(&bg_hash, sizeof(bg_hash), DiskCache::hash_bytes("preview", 7, key));
+      shared_ptr<const Surface::Data> data = disk->load(key);
+      if (data)
+         return data;
+
+      DiskCache::Dependencies dependencies;
+      data = render(paths[index], bg);
+      disk->store(key, *data, dependencies.paths());
+      return data;
+   }
+
+   shared_ptr<const Surface::Data> PreviewLoader::render(const string& path, const Surface& bg)
+   {
+      Game game{path};
+      game.set_bg(bg);
+
+      int preview_width  = Game::fb_width / scale_factor;
+      int preview_height = Game::fb_height / scale_factor;
+
+      vector<Pixel> data(preview_width * preview_height);
+
+      game.input_cb([](Input) { return false; });
+      game.video_cb([&data, preview_width](const void* pix_data, unsigned width, unsigned height, size_t pitch) {
+         const Pixel* pix = reinterpret_cast<const Pixel*>(pix_data);
+         pitch /= sizeof(Pixel);
+
+         for (unsigned y = 0; y < height; y += scale_factor)
+         {
+            for (unsigned x = 0; x < width; x += scale_factor)
+            {
+               Blit::PixelBase<unsigned int, 8u, 24u, 8u, 16u, 8u, 8u, 8u, 0u> a0 = pix[pitch * (y + 0) + (x + 0)];
+               Blit::PixelBase<unsigned int, 8u, 24u, 8u, 16u, 8u, 8u, 8u, 0u> a1 = pix[pitch * (y + 0) + (x + 1)];
+               Blit::PixelBase<unsigned int, 8u, 24u, 8u, 16u, 8u, 8u, 8u, 0u> b0 = pix[pitch * (y + 1) + (x + 0)];
+               Blit::PixelBase<unsigned int, 8u, 24u, 8u, 16u, 8u, 8u, 8u, 0u> b1 = pix[pitch * (y + 1) + (x + 1)];
+               Blit::PixelBase<unsigned int, 8u, 24u, 8u, 16u, 8u, 8u, 8u, 0u> res = Pixel::blend(Pixel::blend(a0, a1), Pixel::blend(b0, b1));
+
+               data[preview_width * (y / scale_factor) + (x / scale_factor)] = res | static_cast<Pixel>(Pixel::alpha_mask);
+            }
+         }
+      });
+
+      game.iterate();
+
+      return make_shared<Surface::Data>(std::move(data), preview_width, preview_height);
+   }
+}
@@ -56,12 +56,10 @@ namespace Blit
       blit_offset(surf, subrect, Pos(0, 0));
    }
 
-   void RenderTarget::blit_offset(const Surface& surf_, Rect subrect, Pos pos)
+   void RenderTarget::blit_offset(const Surface& surf, Rect subrect, Pos pos)
    {
-      Surface surf(surf_);
-      surf.rect() += pos;
-
       Rect surf_rect = surf.rect();
+      surf_rect += pos;
       Rect dest_rect = rect;
 
       bool ignore_camera = surf.ignore_camera();
@@ -72,18 +70,18 @@ namespace Blit
 
       if (subrect)
       {
-         subrect += surf.rect().pos;
+         subrect += surf_rect.pos;
          blit_rect &= subrect;
       }
 
       if (!blit_rect)
          return;
 
-      const Blit::PixelBase<unsigned int, 8u, 24u, 8u, 16u, 8u, 8u, 8u, 0u>* src_data = surf.pixel_raw(blit_rect.pos);
-      Blit::PixelBase<unsigned int, 8u, 24u, 8u, 16u, 8u, 8u, 8u, 0u>* dst_data = ignore_camera ?
+      const Pixel* src_data = surf.pixel_raw(blit_rect.pos - pos);
+      Pixel* dst_data = ignore_camera ?
          pixel_raw_no_offset(blit_rect.pos) : pixel_raw(blit_rect.pos);
 
-      for (int y = 0; y < blit_rect.h; y++, src_data += surf_rect.w, dst_data += rect.w)
+      for (int y = 0; y < blit_rect.h; y++, src_data += surf.pitch(), dst_data += rect.w)
          Pixel::set_line_if_alpha(dst_data, src_data, blit_rect.w);
    }
 
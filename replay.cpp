@@ -0,0 +1,124 @@
+#include "replay.hpp"
+#include "game.hpp"
+#include "utils.hpp"
+
+#include <fstream>
+
+using namespace std;
+using namespace Blit;
+
+namespace Icy
+{
+   namespace
+   {
+      enum { magic = 0x43455244, version = 1 }; // "DREC"
+
+      struct Header
+      {
+         uint32_t magic_id;
+         uint32_t version_id;
+         uint32_t frames;
+         uint32_t state_size;
+         uint32_t save_size;
+      };
+   }
+
+   Recording::Recording(const string& path)
+   {
+      ifstream file(path, ios::in | ios::binary);
+      if (!file.is_open())
+         throw runtime_error(Utils::join("Failed to open recording: ", path));
+
+      Header header;
+      if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+            header.magic_id != magic || header.version_id != version)
+         throw runtime_error(Utils::join("Not a recording: ", path));
+
+      // The header sizes everything after it, so they have to add up to the file before anything is allocated.
+      file.seekg(0, ios::end);
+      uint64_t file_size = file.tellg();
+      uint64_t expected = sizeof(header) + uint64_t(header.state_size) + header.save_size +
+         uint64_t(header.frames) * (sizeof(uint8_t) + sizeof(uint32_t));
+      if (!file || expected != file_size)
+         throw runtime_error(Utils::join("Recording is truncated or corrupt: ", path));
+      file.seekg(sizeof(header));
+
+      initial.resize(header.state_size);
+      save_ram.resize(header.save_size);
+      inputs.resize(header.frames);
+      checksums.resize(header.frames);
+
+      file.read(reinterpret_cast<char*>(initial.data()), initial.size());
+      file.read(reinterpret_cast<char*>(save_ram.data()), save_ram.size());
+      file.read(reinterpret_cast<char*>(inputs.data()), inputs.size());
+      file.read(reinterpret_cast<char*>(checksums.data()), checksums.size() * sizeof(uint32_t));
+      if (!file)
+         throw runtime_error(Utils::join("Recording is truncated: ", path));
+   }
+
+   void Recording::start(const GameManager& game)
+   {
+      initial.resize(game.serialize_size());
+      game.serialize(initial.data(), initial.size());
+
+      const uint8_t *save = static_cast<const uint8_t*>(game.save_data());
+      save_ram.assign(save, save + game.save_size());
+
+      inputs.clear();
+      checksums.clear();
+   }
+
+   bool Recording::restore(GameManager& game) const
+   {
+      if (initial.size() != game.serialize_size() || save_ram.size() != game.save_size())
+         return false;
+
+      copy(save_ram.begin(), save_ram.end(), static_cast<uint8_t*>(game.save_data()));
+      return game.unserialize(initial.data(), initial.size());
+   }
+
+   void Recording::record(unsigned input, const GameManager& game)
+   {
+      inputs.push_back(input | (game.handoff_held() ? held_bit : 0));
+      checksums.push_back(checksum(game));
+   }
+
+   bool Recording::drop_last()
+   {
+      if (inputs.empty())
+         return false;
+
+      inputs.pop_back();
+      checksums.pop_back();
+      return true;
+   }
+
+   void Recording::save(const string& path) const
+   {
+      ofstream file(path, ios::out | ios::binary | ios::trunc);
+      if (!file.is_open())
+         throw runtime_error(Utils::join("Failed to create recording: ", path));
+
+      Header header = { magic, version, static_cast<uint32_t>(inputs.size()),
+         static_cast<uint32_t>(initial.size()), static_cast<uint32_t>(save_ram.size()) };
+      file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      file.write(reinterpret_cast<const char*>(initial.data()), initial.size());
+      file.write(reinterpret_cast<const char*>(save_ram.data()), save_ram.size());
+      file.write(reinterpret_cast<const char*>(inputs.data()), inputs.size());
+      file.write(reinterpret_cast<const char*>(checksums.data()), checksums.size() * sizeof(uint32_t));
+      if (!file)
+         throw runtime_error(Utils::join("Failed to write recording: ", path));
+   }
+
+   // FNV-1a, save states are small enough that this is cheap next to serializing.
+   uint32_t Recording::checksum(const GameManager& game)
+   {
+      scratch.resize(game.serialize_size());
+      game.serialize(scratch.data(), scratch.size());
+
+      uint32_t hash = 0x811c9dc5u;
+      for (auto byte : scratch)
+         hash = (hash ^ byte) * 0x01000193u;
+      return hash;
+   }
+}
@@ -0,0 +1,65 @@
+#ifndef REPLAY_HPP__
+#define REPLAY_HPP__
+
+#include <stdint.h>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace Icy
+{
+   class GameManager;
+
+   // Recording of a play session which can be fed back deterministically.
+   // Starts from a save state and the save RAM, which the menus read, then keeps the input mask
+   // of every frame and a checksum of the save state after it, so a replay can tell the first
+   // frame where it went wrong.
+   //
+   // File layout, native endian like save states:
+   //    magic, version, frames, state size, save RAM size (uint32_t each), initial save state,
+   //    save RAM, input of every frame (uint8_t), checksum of every frame (uint32_t).
+   // The top bit of a frame's input is set if it kept a won level up while the next one loaded,
+   // which depends on how fast it loaded, so a replay holds on exactly the same frames.
+   class Recording
+   {
+      public:
+         Recording() {}
+
+         // Throws if the file can't be read or isn't a recording.
+         explicit Recording(const std::string& path);
+
+         // Drops all frames and starts over from the current state of game.
+         void start(const GameManager& game);
+
+         // Puts game back where the recording starts. Returns false if the state doesn't fit game.
+         bool restore(GameManager& game) const;
+
+         // Appends a frame which game was just advanced by.
+         void record(unsigned input, const GameManager& game);
+
+         // Drops the newest frame, when the game is rewound by one. Returns false if there was none.
+         bool drop_last();
+
+         void save(const std::string& path) const;
+
+         std::size_t frames() const { return inputs.size(); }
+         unsigned input(std::size_t frame) const { return inputs[frame] & ~held_bit; }
+         bool held(std::size_t frame) const { return inputs[frame] & held_bit; }
+         uint32_t checksum(std::size_t frame) const { return checksums[frame]; }
+         const std::vector<uint8_t>& initial_state() const { return initial; }
+
+         // Checksum of the current save state of game.
+         uint32_t checksum(const GameManager& game);
+
+      private:
+         enum { held_bit = 0x80 };
+
+         std::vector<uint8_t> initial;
+         std::vector<uint8_t> save_ram;
+         std::vector<uint8_t> inputs;
+         std::vector<uint32_t> checksums;
+         std::vector<uint8_t> scratch;
+   };
+}
+
+#endif
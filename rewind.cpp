@@ -0,0 +1,177 @@
+#include "rewind.hpp"
+
+#include <string.h>
+#include <algorithm>
+
+using namespace std;
+
+namespace Icy
+{
+   RewindBuffer::RewindBuffer()
+      : state_size(0), has_current(false), head(0), tail(0), used(0), entries(0)
+   {}
+
+   RewindBuffer::RewindBuffer(size_t state_size, size_t budget)
+      : state_size(state_size), has_current(false), current(state_size),
+      delta(2 * state_size + 16), ring(budget), head(0), tail(0), used(0), entries(0)
+   {}
+
+   void RewindBuffer::clear()
+   {
+      has_current = false;
+      head = tail = used = entries = 0;
+   }
+
+   static uint8_t* put_varint(uint8_t *out, size_t value)
+   {
+      while (value >= 0x80)
+      {
+         *out++ = (value & 0x7f) | 0x80;
+         value >>= 7;
+      }
+      *out++ = value;
+      return out;
+   }
+
+   static const uint8_t* get_varint(const uint8_t *in, size_t& value)
+   {
+      value = 0;
+      for (unsigned shift = 0;; shift += 7)
+      {
+         uint8_t byte = *in++;
+         value |= size_t(byte & 0x7f) << shift;
+         if (!(byte & 0x80))
+            return in;
+      }
+   }
+
+   // Encodes a XOR b as pairs of (unchanged bytes, changed bytes), followed by the changed bytes XORed.
+   static size_t encode_delta(const uint8_t *a, const uint8_t *b, size_t size, uint8_t *out)
+   {
+      uint8_t *start = out;
+      size_t pos = 0;
+
+      while (pos < size)
+      {
+         size_t same = pos;
+         while (same + sizeof(uint64_t) <= size && !memcmp(a + same, b + same, sizeof(uint64_t)))
+            same += sizeof(uint64_t);
+         while (same < size && a[same] == b[same])
+            same++;
+
+         size_t diff = same;
+         while (diff < size && a[diff] != b[diff])
+            diff++;
+
+         out = put_varint(out, same - pos);
+         out = put_varint(out, diff - same);
+         for (size_t i = same; i < diff; i++)
+            *out++ = a[i] ^ b[i];
+
+         pos = diff;
+      }
+
+      return out - start;
+   }
+
+   static void apply_delta(uint8_t *state, const uint8_t *in, size_t size)
+   {
+      size_t pos = 0;
+      while (pos < size)
+      {
+         size_t same, diff;
+         in = get_varint(in, same);
+         in = get_varint(in, diff);
+
+         pos += same;
+         for (size_t i = 0; i < diff; i++)
+            state[pos++] ^= *in++;
+      }
+   }
+
+   void RewindBuffer::write(const void *data, size_t size)
+   {
+      const uint8_t *bytes = static_cast<const uint8_t*>(data);
+      size_t first = min(size, ring.size() - head);
+      copy(bytes, bytes + first, ring.begin() + head);
+      copy(bytes + first, bytes + size, ring.begin());
+
+      head = (head + size) % ring.size();
+      used += size;
+   }
+
+   void RewindBuffer::read(size_t pos, void *data, size_t size) const
+   {
+      uint8_t *bytes = static_cast<uint8_t*>(data);
+      pos %= ring.size();
+      size_t first = min(size, ring.size() - pos);
+      copy(ring.begin() + pos, ring.begin() + pos + first, bytes);
+      copy(ring.begin(), ring.begin() + (size - first), bytes + first);
+   }
+
+   void RewindBuffer::drop_oldest()
+   {
+      uint32_t size;
+      read(tail, &size, sizeof(size));
+
+      size_t entry = size + 2 * sizeof(size);
+      tail = (tail + entry) % ring.size();
+      used -= entry;
+      entries--;
+   }
+
+   void RewindBuffer::push(const void *state)
+   {
+      if (!state_size)
+         return;
+
+      const uint8_t *bytes = static_cast<const uint8_t*>(state);
+      if (!has_current)
+      {
+         copy(bytes, bytes + state_size, current.begin());
+         has_current = true;
+         return;
+      }
+
+      uint32_t size = encode_delta(current.data(), bytes, state_size, delta.data());
+      size_t entry = size + 2 * sizeof(size);
+      copy(bytes, bytes + state_size, current.begin());
+
+      if (entry > ring.size())
+      {
+         // Can't go back past a change this large.
+         head = tail = used = entries = 0;
+         return;
+      }
+
+      while (used + entry > ring.size())
+         drop_oldest();
+
+      write(&size, sizeof(size));
+      write(delta.data(), size);
+      write(&size, sizeof(size));
+      entries++;
+   }
+
+   bool RewindBuffer::pop(void *state)
+   {
+      if (!entries)
+         return false;
+
+      uint32_t size;
+      size_t footer = (head + ring.size() - sizeof(size)) % ring.size();
+      read(footer, &size, sizeof(size));
+
+      size_t payload = (footer + ring.size() - size) % ring.size();
+      read(payload, delta.data(), size);
+      apply_delta(current.data(), delta.data(), state_size);
+
+      size_t entry = size + 2 * sizeof(size);
+      head = (head + ring.size() - entry) % ring.size();
+      used -= entry;
+      entries--;
+
+      copy(current.begin(), current.end(), static_cast<uint8_t*>(state));
+      return true;
+   }
+}
@@ -0,0 +1,48 @@
+#ifndef REWIND_HPP__
+#define REWIND_HPP__
+
+#include <stdint.h>
+#include <cstddef>
+#include <vector>
+
+namespace Icy
+{
+   // Fixed memory history of save states, for stepping backwards one frame at a time.
+   // Only the newest state is kept whole. Every older state is stored as the run length encoded
+   // XOR against the state recorded after it, and the oldest ones are dropped when memory runs out.
+   class RewindBuffer
+   {
+      public:
+         RewindBuffer();
+         RewindBuffer(std::size_t state_size, std::size_t budget);
+
+         // Records a new state. Doesn't allocate.
+         void push(const void *state);
+
+         // Drops the newest state and writes the one before it to state.
+         // Returns false if there is nothing older to go back to.
+         bool pop(void *state);
+
+         void clear();
+
+         std::size_t frames() const { return entries; }
+         std::size_t memory_used() const { return used; }
+         std::size_t memory_budget() const { return ring.size(); }
+
+      private:
+         std::size_t state_size;
+         bool has_current;
+         std::vector<uint8_t> current;
+         std::vector<uint8_t> delta;
+
+         // Entries are laid out as size, payload, size, so they can be walked from both ends.
+         std::vector<uint8_t> ring;
+         std::size_t head, tail, used, entries;
+
+         void write(const void *data, std::size_t size);
+         void read(std::size_t pos, void *data, std::size_t size) const;
+         void drop_oldest();
+   };
+}
+
+#endif
@@ -1,6 +1,6 @@
 /*  RetroArch - A frontend for libretro.
  *  Copyright (C) 2010-2013 - Hans-Kristian Arntzen
- * 
+ *
  *  RetroArch is free software: you can redistribute it and/or modify it under the terms
  *  of the GNU General Public License as published by the Free Software Found-
  *  ation, either version 3 of the License, or (at your option) any later version.
@@ -13,47 +13,573 @@
  *  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <file/nbio.h>
+#include <compat/zlib.h>
 #include <formats/image.h>
 #include <formats/rpng.h>
+#include <retro_inline.h>
 #include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "rpng_front.h"
 
-bool rpng_load_image_argb(const char *path, uint32_t **data,
-      unsigned *width, unsigned *height)
+/* The fast path decodes in a single pass over the PNG in memory. IDAT chunks are inflated where
+ * they are, one row at a time, into a window of two rows, which are unfiltered and converted to
+ * ARGB as they come out. Interlaced images are left to rpng. */
+
+enum
 {
-   int retval;
-   size_t file_len;
-   bool              ret = true;
-   rpng_t          *rpng = NULL;
-   void             *ptr = NULL;
-   struct nbio_t* handle = (struct nbio_t*)nbio_open(path, NBIO_READ);
+   PNG_COLOR_GRAY       = 0,
+   PNG_COLOR_RGB        = 2,
+   PNG_COLOR_PLT        = 3,
+   PNG_COLOR_GRAY_ALPHA = 4,
+   PNG_COLOR_RGBA       = 6
+};
 
-   if (!handle)
-      goto end;
+enum
+{
+   PNG_FILTER_NONE = 0,
+   PNG_FILTER_SUB,
+   PNG_FILTER_UP,
+   PNG_FILTER_AVERAGE,
+   PNG_FILTER_PAETH
+};
 
-   nbio_begin_read(handle);
+/* Rows sit this far into their buffer, behind zeros, so the pixel left of the first one reads
+ * as zero like the filters want. The filter type byte is inflated into the last of them. */
+#define PNG_ROW_PAD 16
 
-   while (!nbio_iterate(handle));
+struct png_info
+{
+   uint32_t width, height;
+   unsigned depth, color_type, interlace;
+   unsigned bpp;   /* Bytes per complete pixel, at least 1. */
+   size_t pitch;   /* Bytes per row, without the filter type. */
+   const uint8_t *idat;
+   const uint8_t *end;
+   uint64_t idat_size;
+   uint32_t palette[256];
+   bool has_plte;
+   bool has_iend;
+};
 
-   ptr = nbio_get_ptr(handle, &file_len);
+static INLINE uint32_t png_be32(const uint8_t *buf)
+{
+   return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | buf[3];
+}
 
-   if (!ptr)
+static bool png_valid_depth(unsigned color_type, unsigned depth)
+{
+   switch (color_type)
    {
-      ret = false;
-      goto end;
+      case PNG_COLOR_GRAY:
+         return depth == 1 || depth == 2 || depth == 4 || depth == 8 || depth == 16;
+      case PNG_COLOR_PLT:
+         return depth == 1 || depth == 2 || depth == 4 || depth == 8;
+      case PNG_COLOR_RGB:
+      case PNG_COLOR_GRAY_ALPHA:
+      case PNG_COLOR_RGBA:
+         return depth == 8 || depth == 16;
    }
 
-   rpng = rpng_alloc();
+   return false;
+}
 
-   if (!rpng)
+/* Walks the chunks up to IEND, checking they all lie within the buffer. */
+static bool png_parse(const uint8_t *buf, size_t len, struct png_info *png)
+{
+   static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', 0x0d, 0x0a, 0x1a, 0x0a };
+   const uint8_t *end = buf + len;
+   const uint8_t *chunk;
+   bool has_ihdr = false;
+
+   if (len < 8 || memcmp(buf, signature, sizeof(signature)))
+      return false;
+
+   memset(png, 0, sizeof(*png));
+   png->end = end;
+
+   for (chunk = buf + 8; end - chunk >= 12; )
    {
-      ret = false;
-      goto end;
+      uint32_t size       = png_be32(chunk);
+      const uint8_t *data = chunk + 8;
+
+      if (size > (size_t)(end - chunk) - 12)
+         return false;
+
+      if (!memcmp(chunk + 4, "IHDR", 4))
+      {
+         uint64_t bits;
+         unsigned channels;
+
+         if (has_ihdr || size != 13)
+            return false;
+
+         png->width      = png_be32(data);
+         png->height     = png_be32(data + 4);
+         png->depth      = data[8];
+         png->color_type = data[9];
+         png->interlace  = data[12];
+
+         /* Compression and filter method. */
+         if (data[10] || data[11] || png->interlace > 1)
+            return false;
+         if (!png->width || !png->height || !png_valid_depth(png->color_type, png->depth))
+            return false;
+         if ((uint64_t)png->width * png->height > SIZE_MAX / sizeof(uint32_t))
+            return false;
+
+         channels   = png->color_type == PNG_COLOR_RGB ? 3 :
+            png->color_type == PNG_COLOR_GRAY_ALPHA ? 2 :
+            png->color_type == PNG_COLOR_RGBA ? 4 : 1;
+         bits       = (uint64_t)png->width * channels * png->depth;
+         if (bits > SIZE_MAX - 7 - 64)
+            return false;
+         png->bpp   = (channels * png->depth + 7) / 8;
+         png->pitch = (size_t)((bits + 7) / 8);
+         has_ihdr   = true;
+      }
+      else if (!has_ihdr)
+         return false;
+      else if (!memcmp(chunk + 4, "PLTE", 4))
+      {
+         unsigned i;
+
+         if (png->has_plte || png->idat || size % 3 || size > 3 * 256)
+            return false;
+
+         for (i = 0; i < size / 3; i++)
+            png->palette[i] = (0xffu << 24) | ((uint32_t)data[3 * i] << 16) |
+               ((uint32_t)data[3 * i + 1] << 8) | data[3 * i + 2];
+         png->has_plte = true;
+      }
+      else if (!memcmp(chunk + 4, "tRNS", 4))
+      {
+         unsigned i;
+
+         if (png->idat)
+            return false;
+
+         /* Like rpng, only palettes get transparency. */
+         if (png->color_type == PNG_COLOR_PLT)
+         {
+            if (size > 256)
+               return false;
+            for (i = 0; i < size; i++)
+               png->palette[i] = (png->palette[i] & 0x00ffffff) | ((uint32_t)data[i] << 24);
+         }
+      }
+      else if (!memcmp(chunk + 4, "IDAT", 4))
+      {
+         if (png->color_type == PNG_COLOR_PLT && !png->has_plte)
+            return false;
+         if (!png->idat)
+            png->idat = chunk;
+         png->idat_size += size;
+      }
+      else if (!memcmp(chunk + 4, "IEND", 4))
+      {
+         png->has_iend = true;
+         break;
+      }
+
+      chunk = data + size + 4;
+   }
+
+   if (!has_ihdr || !png->idat)
+      return false;
+
+   /* Deflate can't do better than about 1032:1, so a corrupt header can't make us allocate
+    * more than that. */
+   return (uint64_t)(png->pitch + 1) * png->height <= png->idat_size * 1032 + 1024;
+}
+
+/* Scalar unfilters, for any pixel size. row[-bpp .. -1] and prev[-bpp .. -1] are zero. */
+static void png_unfilter_scalar(unsigned filter, uint8_t *row, const uint8_t *prev,
+      size_t pitch, unsigned bpp)
+{
+   size_t i;
+
+   switch (filter)
+   {
+      case PNG_FILTER_SUB:
+         for (i = 0; i < pitch; i++)
+            row[i] += row[i - bpp];
+         break;
+      case PNG_FILTER_UP:
+         for (i = 0; i < pitch; i++)
+            row[i] += prev[i];
+         break;
+      case PNG_FILTER_AVERAGE:
+         for (i = 0; i < pitch; i++)
+            row[i] += (row[i - bpp] + prev[i]) >> 1;
+         break;
+      case PNG_FILTER_PAETH:
+         for (i = 0; i < pitch; i++)
+         {
+            int a  = row[i - bpp];
+            int b  = prev[i];
+            int c  = prev[i - bpp];
+            int p  = a + b - c;
+            int pa = abs(p - a);
+            int pb = abs(p - b);
+            int pc = abs(p - c);
+
+            row[i] += (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+         }
+         break;
+   }
+}
+
+#if defined(__SSE2__)
+/* Pixel loads and stores for 3 and 4 byte pixels. Loads may read one byte past a 3 byte pixel,
+ * which the row padding allows for. */
+static INLINE __m128i png_load_pixel(const uint8_t *ptr)
+{
+   int32_t value;
+   memcpy(&value, ptr, 4);
+   return _mm_cvtsi32_si128(value);
+}
+
+static INLINE void png_store_pixel(uint8_t *ptr, __m128i pixel, unsigned bpp)
+{
+   int32_t value = _mm_cvtsi128_si32(pixel);
+   memcpy(ptr, &value, bpp);
+}
+
+/* The Sub filter is a running sum over pixels, done a vector at a time as a prefix sum. */
+static void png_unfilter_sub_sse2(uint8_t *row, size_t pitch, unsigned bpp)
+{
+   __m128i carry = _mm_setzero_si128();
+   size_t i;
+
+   if (bpp == 4)
+   {
+      for (i = 0; i < pitch; i += 16)
+      {
+         __m128i x = _mm_loadu_si128((const __m128i*)(row + i));
+         x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+         x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+         x = _mm_add_epi8(x, carry);
+         _mm_storeu_si128((__m128i*)(row + i), x);
+         carry = _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 3, 3, 3));
+      }
    }
+   else
+   {
+      /* Four 3 byte pixels at a time, storing only those 12 bytes. */
+      const __m128i low_pixel = _mm_setr_epi8(-1, -1, -1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+
+      for (i = 0; i < pitch; i += 12)
+      {
+         __m128i x = _mm_loadu_si128((const __m128i*)(row + i));
+         __m128i last;
+         int32_t high;
 
-   if (!rpng_set_buf_ptr(rpng, (uint8_t*)ptr))
+         x = _mm_add_epi8(x, _mm_slli_si128(x, 3));
+         x = _mm_add_epi8(x, _mm_slli_si128(x, 6));
+         x = _mm_add_epi8(x, carry);
+         _mm_storel_epi64((__m128i*)(row + i), x);
+         high = _mm_cvtsi128_si32(_mm_srli_si128(x, 8));
+         memcpy(row + i + 8, &high, 4);
+
+         last  = _mm_and_si128(_mm_srli_si128(x, 9), low_pixel);
+         last  = _mm_or_si128(last, _mm_slli_si128(last, 3));
+         carry = _mm_or_si128(last, _mm_slli_si128(last, 6));
+      }
+   }
+}
+
+static void png_unfilter_up_sse2(uint8_t *row, const uint8_t *prev, size_t pitch)
+{
+   size_t i;
+
+   for (i = 0; i < pitch; i += 16)
+   {
+      __m128i x = _mm_loadu_si128((const __m128i*)(row + i));
+      __m128i b = _mm_loadu_si128((const __m128i*)(prev + i));
+      _mm_storeu_si128((__m128i*)(row + i), _mm_add_epi8(x, b));
+   }
+}
+
+/* Average and Paeth depend on the pixel to the left, so they go a pixel at a time, with all
+ * channels of a pixel in one vector. */
+static void png_unfilter_average_sse2(uint8_t *row, const uint8_t *prev, size_t pitch, unsigned bpp)
+{
+   const __m128i ones = _mm_set1_epi8(1);
+   __m128i a = _mm_setzero_si128();
+   size_t i;
+
+   for (i = 0; i < pitch; i += bpp)
+   {
+      __m128i b   = png_load_pixel(prev + i);
+      __m128i avg = _mm_avg_epu8(a, b);
+
+      /* _mm_avg_epu8 rounds up, the filter rounds down. */
+      avg = _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a, b), ones));
+      a   = _mm_add_epi8(png_load_pixel(row + i), avg);
+      png_store_pixel(row + i, a, bpp);
+   }
+}
+
+static INLINE __m128i png_abs_epi16(__m128i x)
+{
+   return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+static INLINE __m128i png_select(__m128i mask, __m128i a, __m128i b)
+{
+   return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+static void png_unfilter_paeth_sse2(uint8_t *row, const uint8_t *prev, size_t pitch, unsigned bpp)
+{
+   const __m128i zero = _mm_setzero_si128();
+   __m128i a = zero, c = zero;
+   size_t i;
+
+   for (i = 0; i < pitch; i += bpp)
+   {
+      __m128i b  = _mm_unpacklo_epi8(png_load_pixel(prev + i), zero);
+      __m128i pa = _mm_sub_epi16(b, c);
+      __m128i pb = _mm_sub_epi16(a, c);
+      __m128i pc = _mm_add_epi16(pa, pb);
+      __m128i smallest, nearest;
+
+      pa       = png_abs_epi16(pa);
+      pb       = png_abs_epi16(pb);
+      pc       = png_abs_epi16(pc);
+      smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+      nearest  = png_select(_mm_cmpeq_epi16(smallest, pa), a,
+            png_select(_mm_cmpeq_epi16(smallest, pb), b, c));
+
+      nearest = _mm_add_epi8(png_load_pixel(row + i), _mm_packus_epi16(nearest, nearest));
+      png_store_pixel(row + i, nearest, bpp);
+
+      a = _mm_unpacklo_epi8(nearest, zero);
+      c = b;
+   }
+}
+#endif
+
+static void png_unfilter(unsigned filter, uint8_t *row, const uint8_t *prev,
+      size_t pitch, unsigned bpp)
+{
+#if defined(__SSE2__)
+   if (filter == PNG_FILTER_UP)
+   {
+      png_unfilter_up_sse2(row, prev, pitch);
+      return;
+   }
+
+   if (bpp == 3 || bpp == 4)
+   {
+      switch (filter)
+      {
+         case PNG_FILTER_SUB:
+            png_unfilter_sub_sse2(row, pitch, bpp);
+            return;
+         case PNG_FILTER_AVERAGE:
+            png_unfilter_average_sse2(row, prev, pitch, bpp);
+            return;
+         case PNG_FILTER_PAETH:
+            png_unfilter_paeth_sse2(row, prev, pitch, bpp);
+            return;
+      }
+   }
+#endif
+
+   png_unfilter_scalar(filter, row, prev, pitch, bpp);
+}
+
+static void png_convert_rgba8(uint32_t *out, const uint8_t *row, unsigned width)
+{
+   unsigned i = 0;
+
+#if defined(__SSE2__)
+   /* RGBA bytes are 0xAABBGGRR read as little endian words, so swap R and B. */
+   const __m128i ag_mask = _mm_set1_epi32((int)0xff00ff00);
+   const __m128i rb_mask = _mm_set1_epi32(0x00ff00ff);
+
+   for (; i + 4 <= width; i += 4)
+   {
+      __m128i x  = _mm_loadu_si128((const __m128i*)(row + 4 * i));
+      __m128i rb = _mm_and_si128(x, rb_mask);
+      rb = _mm_or_si128(_mm_slli_epi32(rb, 16), _mm_srli_epi32(rb, 16));
+      _mm_storeu_si128((__m128i*)(out + i), _mm_or_si128(_mm_and_si128(x, ag_mask), rb));
+   }
+#endif
+
+   for (row += 4 * i; i < width; i++, row += 4)
+      out[i] = ((uint32_t)row[3] << 24) | ((uint32_t)row[0] << 16) | ((uint32_t)row[1] << 8) | row[2];
+}
+
+static void png_convert_row(uint32_t *out, const uint8_t *row, const struct png_info *png)
+{
+   /* 16 bit channels keep their high byte. */
+   unsigned step = png->depth == 16 ? 2 : 1;
+   unsigned i;
+
+   switch (png->color_type)
+   {
+      case PNG_COLOR_RGBA:
+         if (step == 1)
+         {
+            png_convert_rgba8(out, row, png->width);
+            break;
+         }
+         for (i = 0; i < png->width; i++, row += 8)
+            out[i] = ((uint32_t)row[6] << 24) | ((uint32_t)row[0] << 16) | ((uint32_t)row[2] << 8) | row[4];
+         break;
+
+      case PNG_COLOR_RGB:
+         for (i = 0; i < png->width; i++, row += 3 * step)
+            out[i] = (0xffu << 24) | ((uint32_t)row[0] << 16) | ((uint32_t)row[step] << 8) | row[2 * step];
+         break;
+
+      case PNG_COLOR_GRAY_ALPHA:
+         for (i = 0; i < png->width; i++, row += 2 * step)
+            out[i] = (row[0] * 0x010101u) | ((uint32_t)row[step] << 24);
+         break;
+
+      case PNG_COLOR_GRAY:
+      case PNG_COLOR_PLT:
+      {
+         static const unsigned scale[] = { 0, 0xff, 0x55, 0, 0x11, 0, 0, 0, 0x01 };
+         unsigned depth = png->depth == 16 ? 8 : png->depth;
+         unsigned mask  = (1u << depth) - 1;
+         unsigned bit   = 0;
+
+         for (i = 0; i < png->width; i++, bit += depth * step)
+         {
+            unsigned value = (row[bit >> 3] >> (8 - depth - (bit & 7))) & mask;
+
+            if (png->color_type == PNG_COLOR_PLT)
+               out[i] = png->palette[value];
+            else
+               out[i] = (value * scale[depth] * 0x010101u) | (0xffu << 24);
+         }
+         break;
+      }
+   }
+}
+
+/* Inflates the next row, filter type byte included, moving on to the following IDAT chunks
+ * as they run out. */
+static bool png_inflate_row(z_stream *stream, const uint8_t **chunk, const uint8_t *end,
+      uint8_t *out, size_t size)
+{
+   stream->next_out  = out;
+   stream->avail_out = (uInt)size;
+
+   while (stream->avail_out)
+   {
+      int ret;
+
+      while (!stream->avail_in)
+      {
+         uint32_t chunk_size = png_be32(*chunk);
+
+         *chunk     += chunk_size + 12;
+         if (end - *chunk < 12 || memcmp(*chunk + 4, "IDAT", 4))
+            return false;
+
+         chunk_size = png_be32(*chunk);
+         if (chunk_size > (size_t)(end - *chunk) - 12)
+            return false;
+
+         stream->next_in  = (Bytef*)(*chunk + 8);
+         stream->avail_in = chunk_size;
+      }
+
+      ret = inflate(stream, Z_NO_FLUSH);
+      if (ret == Z_STREAM_END)
+         return !stream->avail_out;
+      if (ret != Z_OK)
+         return false;
+   }
+
+   return true;
+}
+
+static bool png_decode(const struct png_info *png, uint32_t *data)
+{
+   /* Room behind each row for the padding, and after it for vector loads and stores. */
+   size_t stride = PNG_ROW_PAD + ((png->pitch + 15) & ~(size_t)15) + 16;
+   uint8_t *rows = (uint8_t*)calloc(2, stride);
+   uint8_t *row  = rows + PNG_ROW_PAD;
+   uint8_t *prev = rows + stride + PNG_ROW_PAD;
+   const uint8_t *chunk = png->idat;
+   bool ret = true;
+   z_stream stream;
+   uint32_t y;
+
+   if (!rows)
+      return false;
+
+   memset(&stream, 0, sizeof(stream));
+   if (inflateInit(&stream) != Z_OK)
+   {
+      free(rows);
+      return false;
+   }
+
+   stream.next_in  = (Bytef*)(chunk + 8);
+   stream.avail_in = png_be32(chunk);
+
+   for (y = 0; y < png->height; y++, data += png->width)
+   {
+      unsigned filter;
+      uint8_t *tmp;
+
+      if (!png_inflate_row(&stream, &chunk, png->end, row - 1, png->pitch + 1))
+      {
+         ret = false;
+         break;
+      }
+
+      filter  = row[-1];
+      row[-1] = 0;
+      if (filter > PNG_FILTER_PAETH)
+      {
+         ret = false;
+         break;
+      }
+
+      if (filter != PNG_FILTER_NONE)
+         png_unfilter(filter, row, prev, png->pitch, png->bpp);
+      png_convert_row(data, row, png);
+
+      tmp  = prev;
+      prev = row;
+      row  = tmp;
+   }
+
+   inflateEnd(&stream);
+   free(rows);
+   return ret;
+}
+
+bool rpng_load_image_argb_generic(const uint8_t *buf, size_t len,
+      uint32_t **data, unsigned *width, unsigned *height)
+{
+   int retval;
+   bool              ret = true;
+   rpng_t          *rpng = NULL;
+
+   /* Shorter than the PNG signature and one chunk header. */
+   if (len < 16)
+      return false;
+
+   rpng = rpng_alloc();
+   if (!rpng)
+      return false;
+
+   /* rpng only reads from the buffer. */
+   if (!rpng_set_buf_ptr(rpng, (uint8_t*)buf))
    {
       ret = false;
       goto end;
@@ -72,23 +598,83 @@ bool rpng_load_image_argb(const char *path, uint32_t **data,
       ret = false;
       goto end;
    }
-   
+
    do
    {
       retval = rpng_process_image(rpng,
-            (void**)data, file_len, width, height);
+            (void**)data, len, width, height);
    }while(retval == IMAGE_PROCESS_NEXT);
 
    if (retval == IMAGE_PROCESS_ERROR || retval == IMAGE_PROCESS_ERROR_END)
       ret = false;
 
 end:
-   if (handle)
-      nbio_free(handle);
-   if (rpng)
-      rpng_free(rpng);
-   rpng = NULL;
+   rpng_free(rpng);
    if (!ret)
       free(*data);
    return ret;
 }
+
+bool rpng_load_image_argb_into(const uint8_t *buf, size_t len, rpng_alloc_t alloc, void *userdata)
+{
+   struct png_info png;
+   uint32_t *data;
+
+   if (!png_parse(buf, len, &png))
+      return false;
+
+   /* rpng walks the chunks without looking at the size of the buffer, so it only gets to
+    * see images that were checked to end within it. */
+   if (png.interlace)
+   {
+      uint32_t *image = NULL;
+      unsigned width  = 0;
+      unsigned height = 0;
+
+      if (!png.has_iend || !rpng_load_image_argb_generic(buf, len, &image, &width, &height))
+         return false;
+
+      data = alloc(userdata, width, height);
+      if (data)
+         memcpy(data, image, (size_t)width * height * sizeof(uint32_t));
+      free(image);
+      return data != NULL;
+   }
+
+   data = alloc(userdata, png.width, png.height);
+   return data && png_decode(&png, data);
+}
+
+struct png_malloc
+{
+   uint32_t *data;
+   unsigned width, height;
+};
+
+static uint32_t *png_malloc_pixels(void *userdata, unsigned width, unsigned height)
+{
+   struct png_malloc *image = (struct png_malloc*)userdata;
+
+   image->data   = (uint32_t*)malloc((size_t)width * height * sizeof(uint32_t));
+   image->width  = width;
+   image->height = height;
+   return image->data;
+}
+
+bool rpng_load_image_argb_from_memory(const uint8_t *buf, size_t len,
+      uint32_t **data, unsigned *width, unsigned *height)
+{
+   struct png_malloc image;
+
+   memset(&image, 0, sizeof(image));
+   if (!rpng_load_image_argb_into(buf, len, png_malloc_pixels, &image))
+   {
+      free(image.data);
+      return false;
+   }
+
+   *data   = image.data;
+   *width  = image.width;
+   *height = image.height;
+   return true;
+}
@@ -17,13 +17,26 @@
 #define RPNG_H__
 
 #include <stdint.h>
+#include <stddef.h>
 #include <boolean.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-bool rpng_load_image_argb(const char *path, uint32_t **data, unsigned *width, unsigned *height);
+/* Returns room for width * height ARGB pixels, or NULL to give up. */
+typedef uint32_t *(*rpng_alloc_t)(void *userdata, unsigned width, unsigned height);
+
+/* Decodes a PNG in memory to ARGB, straight into the pixels alloc returns once it knows the size. */
+bool rpng_load_image_argb_into(const uint8_t *buf, size_t len, rpng_alloc_t alloc, void *userdata);
+
+/* The same, with the pixels allocated with malloc(). */
+bool rpng_load_image_argb_from_memory(const uint8_t *buf, size_t len,
+      uint32_t **data, unsigned *width, unsigned *height);
+
+/* The same with the generic rpng decoder, which the above falls back to for interlaced images. */
+bool rpng_load_image_argb_generic(const uint8_t *buf, size_t len,
+      uint32_t **data, unsigned *width, unsigned *height);
 
 #ifdef __cplusplus
 }
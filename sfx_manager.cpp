@@ -9,15 +9,23 @@ namespace Icy
 {
    void SFXManager::add_stream(const string &ident, const string &path)
    {
-      effects[ident] = make_shared<vector<float>>(Audio::WAVFile::load_wave(path));
+      add_effect(ident, make_shared<Audio::PCM>(Audio::WAVFile::load_wave(path)));
+   }
+
+   void SFXManager::add_effect(const string &ident, shared_ptr<const Audio::PCM> pcm)
+   {
+      effects[ident] = move(pcm);
    }
 
    void SFXManager::play_sfx(const string &ident, float volume) const
    {
-      std::map<std::basic_string<char>, std::shared_ptr<std::vector<float> > >::const_iterator sfx = effects.find(ident);
+      std::map<std::basic_string<char>, std::shared_ptr<const Audio::PCM> >::const_iterator sfx = effects.find(ident);
       if (sfx == effects.end())
          throw runtime_error("Invalid SFX!");
 
+      if (muted)
+         return;
+
       std::shared_ptr<Audio::PCMStream> duped = make_shared<Audio::PCMStream>(sfx->second);
       duped->volume(volume);
       Audio::Mixer& mixer = get_mixer();
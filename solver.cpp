@@ -0,0 +1,591 @@
+#include "solver.hpp"
+#include "utils.hpp"
+
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <limits>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+
+using namespace Blit;
+using namespace std;
+
+namespace Icy
+{
+   static const uint32_t no_entry = numeric_limits<uint32_t>::max();
+
+   // Tile level view of the rules with neighbors precomputed. Cells are indexed y * width + x,
+   // -1 is outside the map. Leaving the map counts as a collision. step() would let the player
+   // walk off an open border, but such states can't be represented here, and no level leaves its border open.
+   struct Solver::Grid
+   {
+      Grid(const GameRules& rules)
+         : width(rules.tiles_width()), links(4 * width * rules.tiles_height()), cells(width * rules.tiles_height())
+      {
+         for (int y = 0; y < rules.tiles_height(); y++)
+         {
+            for (int x = 0; x < width; x++)
+            {
+               int cell = y * width + x;
+               cells[cell] = rules.cell(x, y);
+
+               for (unsigned dir = 0; dir < 4; dir++)
+               {
+                  Pos pos = Pos(x, y) + input_to_offset(static_cast<Input>(dir));
+                  bool inside = pos.x >= 0 && pos.y >= 0 && pos.x < width && pos.y < rules.tiles_height();
+                  links[4 * cell + dir] = inside ? pos.y * width + pos.x : -1;
+               }
+            }
+         }
+      }
+
+      int neighbor(int cell, unsigned dir) const { return links[4 * cell + dir]; }
+      unsigned flags(int cell) const { return cells[cell]; }
+
+      bool blocked(const uint16_t *occupied, int cell) const
+      {
+         return cell < 0 || (cells[cell] & GameRules::CellCollision) || occupied[cell];
+      }
+
+      // Where the player ends up after walking from cell in dir, -1 if it can't move.
+      // Mirrors tile_stepper(): stop at a collision first, otherwise keep going while the floor is slippery.
+      int walk(const uint16_t *occupied, int cell, unsigned dir) const
+      {
+         int next = neighbor(cell, dir);
+         if (blocked(occupied, next))
+            return -1;
+
+         for (;;)
+         {
+            cell = next;
+            next = neighbor(cell, dir);
+            if (blocked(occupied, next) || !(cells[cell] & GameRules::CellSlipperyPlayer))
+               return cell;
+         }
+      }
+
+      int width;
+      vector<int> links;
+      vector<uint8_t> cells;
+   };
+
+   Solver::VisitedTable::VisitedTable(size_t memory)
+      : shard_size(1), entries(nullptr, free), counts(new atomic<uint64_t>[shards])
+   {
+      size_t max_entries = min<size_t>(memory / sizeof(Entry), no_entry);
+      while (shard_size * 2 * shards <= max_entries)
+         shard_size *= 2;
+
+      if (shard_size < 16)
+         throw runtime_error("Solver memory budget is too small.");
+
+      // calloc() lets the OS hand out zeroed pages lazily, so an unused budget costs nothing.
+      entries.reset(static_cast<Entry*>(calloc(shards * shard_size, sizeof(Entry))));
+      if (!entries)
+         throw bad_alloc();
+
+      // Default construction starts the atomics' lifetimes without writing over the zeroes, which
+      // leaves the pages untouched. Entry is trivially destructible, so free() is enough after.
+      for (size_t i = 0; i < shards * shard_size; i++)
+         new (&entries[i]) Entry;
+      static_assert(std::is_trivially_destructible<Entry>::value, "Entries are freed without being destroyed.");
+
+      for (unsigned i = 0; i < shards; i++)
+         counts[i] = 0;
+   }
+
+   uint32_t Solver::VisitedTable::insert(uint64_t hash, const Key& key,
+         uint32_t parent, unsigned cell, unsigned dir, bool& inserted)
+   {
+      uint64_t tag = hash | 1;
+      size_t shard = hash >> 58;
+      size_t mask = shard_size - 1;
+      Entry *base = entries.get() + shard * shard_size;
+
+      if (counts[shard].load(memory_order_relaxed) >= shard_size - shard_size / 8)
+         throw runtime_error("Solver ran out of its memory budget.");
+
+      for (size_t i = hash & mask;; i = (i + 1) & mask)
+      {
+         Entry& entry = base[i];
+         uint64_t current = entry.hash.load(memory_order_acquire);
+
+         if (!current && entry.hash.compare_exchange_strong(current, tag, memory_order_acq_rel))
+         {
+            entry.key    = key;
+            entry.parent = parent;
+            entry.cell   = cell;
+            entry.dir    = dir;
+            entry.ready.store(1, memory_order_release);
+
+            counts[shard].fetch_add(1, memory_order_relaxed);
+            inserted = true;
+            return shard * shard_size + i;
+         }
+
+         if (current == tag)
+         {
+            // Someone else claimed the slot, but might not have written the key yet.
+            while (!entry.ready.load(memory_order_acquire))
+               this_thread::yield();
+
+            if (entry.key == key)
+            {
+               inserted = false;
+               return shard * shard_size + i;
+            }
+         }
+      }
+   }
+
+   uint64_t Solver::VisitedTable::size() const
+   {
+      uint64_t size = 0;
+      for (unsigned i = 0; i < shards; i++)
+         size += counts[i].load(memory_order_relaxed);
+      return size;
+   }
+
+   struct Solver::Worker
+   {
+      Worker(unsigned cells) : occupied(cells), seen(cells), queue(cells), generation(0), expanded(0) {}
+
+      vector<uint32_t> next;
+      vector<uint16_t> occupied; // Block index + 1, or 0.
+      vector<uint32_t> seen;     // Generation a cell was reached by the player in.
+      vector<uint16_t> queue;
+      uint32_t generation;
+      uint64_t expanded;
+   };
+
+   static uint64_t splitmix64(uint64_t& state)
+   {
+      uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+      return z ^ (z >> 31);
+   }
+
+   Solver::Solver(const GameRules& rules, const GameState& initial)
+      : rules(rules), width(rules.tiles_width()), height(rules.tiles_height()),
+      num_cells(width * height), bits(1), num_goal(0), num_blocks(rules.blocks()),
+      grid(new Grid(rules)), initial_hash(0), solved_index(no_entry)
+   {
+      // Cells are indexed with 16 bits in the search.
+      if (num_cells > 0x10000)
+         throw runtime_error(Utils::join("Level is too large to solve, ", num_cells, " tiles."));
+
+      while ((1u << bits) < num_cells)
+         bits++;
+
+      if (bits * (num_blocks + 1) > 128)
+         throw runtime_error(Utils::join("Level is too large to solve, ", num_blocks, " blocks on ", num_cells, " tiles."));
+
+      if (initial.stepper != GameState::StepperNone ||
+            initial.player.x % rules.tile_w() || initial.player.y % rules.tile_h())
+         throw logic_error("Solver must start from a resting state.");
+
+      // Blocks of the same kind are interchangeable, so a state only stores sorted positions per kind.
+      // Goal blocks come first.
+      uint16_t blocks[GameState::max_blocks];
+      unsigned count = 0;
+      for (unsigned kind = 0; kind < 2; kind++)
+      {
+         for (unsigned i = 0; i < num_blocks; i++)
+         {
+            if (rules.is_goal_block(i) != (kind == 0))
+               continue;
+
+            Pos pos = initial.blocks[i];
+            if (pos.x % rules.tile_w() || pos.y % rules.tile_h())
+               throw logic_error("Solver must start from a resting state.");
+
+            blocks[count++] = (pos.y / rules.tile_h()) * width + pos.x / rules.tile_w();
+         }
+
+         if (kind == 0)
+            num_goal = count;
+      }
+
+      sort(blocks, blocks + num_goal);
+      sort(blocks + num_goal, blocks + num_blocks);
+
+      uint64_t seed = 0x1ce1ce;
+      zobrist.resize(3 * num_cells);
+      for (auto& value : zobrist)
+         value = splitmix64(seed);
+
+      unsigned player = (initial.player.y / rules.tile_h()) * width + initial.player.x / rules.tile_w();
+      initial_key  = pack(player, blocks);
+      initial_hash = hash(player, blocks);
+   }
+
+   Solver::~Solver()
+   {}
+
+   uint64_t Solver::hash(unsigned player, const uint16_t *blocks) const
+   {
+      uint64_t hash = zobrist[player];
+      for (unsigned i = 0; i < num_blocks; i++)
+         hash ^= zobrist[(i < num_goal ? 1 : 2) * num_cells + blocks[i]];
+      return hash;
+   }
+
+   Solver::Key Solver::pack(unsigned player, const uint16_t *blocks) const
+   {
+      Key key = {{0, 0}};
+      unsigned offset = 0;
+
+      for (unsigned i = 0; i <= num_blocks; i++, offset += bits)
+      {
+         uint64_t value = i ? blocks[i - 1] : player;
+         key.word[offset >> 6] |= value << (offset & 63);
+         if ((offset & 63) + bits > 64)
+            key.word[1] |= value >> (64 - (offset & 63));
+      }
+
+      return key;
+   }
+
+   void Solver::unpack(const Key& key, unsigned& player, uint16_t *blocks) const
+   {
+      uint64_t mask = (uint64_t(1) << bits) - 1;
+      unsigned offset = 0;
+
+      for (unsigned i = 0; i <= num_blocks; i++, offset += bits)
+      {
+         uint64_t value = key.word[offset >> 6] >> (offset & 63);
+         if ((offset & 63) + bits > 64)
+            value |= key.word[1] << (64 - (offset & 63));
+
+         if (i)
+            blocks[i - 1] = value & mask;
+         else
+            player = value & mask;
+      }
+   }
+
+   void Solver::expand(uint32_t index, Worker& worker)
+   {
+      const Entry& entry = table->entry(index);
+
+      unsigned player;
+      uint16_t blocks[GameState::max_blocks];
+      unpack(entry.key, player, blocks);
+
+      const Grid& grid = *this->grid;
+      uint64_t parent_hash = hash(player, blocks);
+      uint16_t *occupied = worker.occupied.data();
+
+      unsigned goals = 0;
+      for (unsigned i = 0; i < num_blocks; i++)
+      {
+         occupied[blocks[i]] = i + 1;
+         if (i < num_goal && (grid.flags(blocks[i]) & GameRules::CellGoal))
+            goals++;
+      }
+
+      // Every tile the player can reach without pushing.
+      uint32_t *seen = worker.seen.data();
+      uint16_t *queue = worker.queue.data();
+      uint32_t generation = ++worker.generation;
+      unsigned queued = 0;
+
+      queue[queued++] = player;
+      seen[player] = generation;
+
+      for (unsigned head = 0; head < queued; head++)
+      {
+         int cell = queue[head];
+
+         for (unsigned dir = 0; dir < 4; dir++)
+         {
+            int next = grid.neighbor(cell, dir);
+            if (next < 0)
+               continue;
+
+            if (!occupied[next])
+            {
+               int dest = grid.walk(occupied, cell, dir);
+               if (dest >= 0 && seen[dest] != generation)
+               {
+                  seen[dest] = generation;
+                  queue[queued++] = dest;
+               }
+               continue;
+            }
+
+            // Mirrors push_block() and tile_stepper() for the block.
+            unsigned block = occupied[next] - 1;
+            int pos = next;
+            int ahead = grid.neighbor(pos, dir);
+            if (grid.blocked(occupied, ahead))
+               continue;
+
+            bool goal_block = block < num_goal;
+            unsigned block_goals = goals;
+            bool won = false;
+            occupied[pos] = 0;
+
+            for (;;)
+            {
+               if (goal_block)
+                  block_goals -= (grid.flags(pos) & GameRules::CellGoal) != 0;
+               pos = ahead;
+               if (goal_block)
+                  block_goals += (grid.flags(pos) & GameRules::CellGoal) != 0;
+
+               // The win animation takes over as soon as every goal is satisfied.
+               if (block_goals == num_goal)
+               {
+                  won = true;
+                  break;
+               }
+
+               ahead = grid.neighbor(pos, dir);
+               if (grid.blocked(occupied, ahead) || !(grid.flags(pos) & GameRules::CellSlipperyBlock))
+                  break;
+            }
+
+            occupied[next] = block + 1;
+
+            // Only one block moved, so a single insertion step keeps its kind sorted.
+            uint16_t child[GameState::max_blocks];
+            copy(blocks, blocks + num_blocks, child);
+            unsigned first = goal_block ? 0 : num_goal;
+            unsigned last  = goal_block ? num_goal : num_blocks;
+            unsigned slot  = block;
+            for (; slot > first && child[slot - 1] > pos; slot--)
+               child[slot] = child[slot - 1];
+            for (; slot + 1 < last && child[slot + 1] < pos; slot++)
+               child[slot] = child[slot + 1];
+            child[slot] = pos;
+
+            unsigned kind = goal_block ? 1 : 2;
+            uint64_t child_hash = parent_hash ^
+               zobrist[player] ^ zobrist[cell] ^
+               zobrist[kind * num_cells + next] ^ zobrist[kind * num_cells + pos];
+
+            bool inserted;
+            uint32_t child_index = table->insert(child_hash, pack(cell, child), index, cell, dir, inserted);
+            if (!inserted)
+               continue;
+
+            if (won)
+            {
+               uint32_t expected = no_entry;
+               solved_index.compare_exchange_strong(expected, child_index);
+            }
+            else
+               worker.next.push_back(child_index);
+         }
+      }
+
+      for (unsigned i = 0; i < num_blocks; i++)
+         occupied[blocks[i]] = 0;
+
+      worker.expanded++;
+   }
+
+   Solver::Result Solver::solve(unsigned threads, size_t memory)
+   {
+      typedef chrono::steady_clock Clock;
+      Clock::time_point start = Clock::now();
+
+      Result res;
+      threads = max(threads, 1u);
+      table.reset(new VisitedTable(memory));
+      solved_index = no_entry;
+
+      bool inserted;
+      uint32_t root = table->insert(initial_hash, initial_key, no_entry, 0, 0, inserted);
+
+      unsigned player;
+      uint16_t blocks[GameState::max_blocks];
+      unpack(initial_key, player, blocks);
+
+      unsigned goals = 0;
+      for (unsigned i = 0; i < num_goal; i++)
+         goals += (grid->flags(blocks[i]) & GameRules::CellGoal) != 0;
+      if (goals == num_goal)
+         solved_index = root;
+
+      vector<Worker> workers(threads, Worker(num_cells));
+      vector<uint32_t> frontier(1, root);
+      unsigned depth = 0;
+
+      while (!frontier.empty() && solved_index == no_entry)
+      {
+         // Threads grab chunks of the current layer until it runs dry,
+         // which keeps them balanced no matter how many pushes a state has.
+         const size_t chunk = 64;
+         atomic<size_t> cursor(0);
+         exception_ptr error;
+         mutex error_lock;
+
+         auto work = [&](Worker& worker) {
+            try
+            {
+               size_t begin;
+               while ((begin = cursor.fetch_add(chunk)) < frontier.size())
+               {
+                  size_t end = min(begin + chunk, frontier.size());
+                  for (size_t i = begin; i < end; i++)
+                     expand(frontier[i], worker);
+               }
+            }
+            catch (...)
+            {
+               lock_guard<mutex> lock(error_lock);
+               error = current_exception();
+               cursor = frontier.size();
+            }
+         };
+
+         vector<thread> pool;
+         for (unsigned i = 1; i < threads; i++)
+            pool.push_back(thread(work, ref(workers[i])));
+         work(workers[0]);
+         for (auto& thread : pool)
+            thread.join();
+
+         if (error)
+            rethrow_exception(error);
+
+         depth++;
+         frontier.clear();
+         for (auto& worker : workers)
+         {
+            frontier.insert(frontier.end(), worker.next.begin(), worker.next.end());
+            worker.next.clear();
+         }
+      }
+
+      if (solved_index != no_entry)
+      {
+         res.solved = true;
+         for (uint32_t index = solved_index; index != root; index = table->entry(index).parent)
+         {
+            const Entry& entry = table->entry(index);
+            Push push = { entry.cell, static_cast<Input>(entry.dir) };
+            res.solution.push_back(push);
+         }
+         reverse(res.solution.begin(), res.solution.end());
+         res.pushes = res.solution.size();
+      }
+
+      for (auto& worker : workers)
+         res.expanded += worker.expanded;
+
+      res.states          = table->size();
+      res.bytes_per_state = sizeof(Entry);
+      res.bytes_total     = table->capacity() * sizeof(Entry);
+      res.seconds         = chrono::duration<double>(Clock::now() - start).count();
+
+      table.reset();
+      return res;
+   }
+
+   // Tile by tile directions from the player to target, by breadth-first search over walk().
+   bool Solver::walk_path(const Grid& grid, const GameRules& rules, const GameState& state,
+         int target, vector<unsigned>& path)
+   {
+      int width = rules.tiles_width();
+      unsigned cells = width * rules.tiles_height();
+      vector<uint16_t> occupied(cells);
+      for (unsigned i = 0; i < rules.blocks(); i++)
+         occupied[(state.blocks[i].y / rules.tile_h()) * width + state.blocks[i].x / rules.tile_w()] = i + 1;
+
+      int start = (state.player.y / rules.tile_h()) * width + state.player.x / rules.tile_w();
+      vector<int> from(cells, -1);
+      vector<uint8_t> via(cells);
+      vector<int> queue(1, start);
+      from[start] = start;
+
+      for (size_t head = 0; head < queue.size() && from[target] < 0; head++)
+      {
+         for (unsigned dir = 0; dir < 4; dir++)
+         {
+            int dest = grid.walk(occupied.data(), queue[head], dir);
+            if (dest >= 0 && from[dest] < 0)
+            {
+               from[dest] = queue[head];
+               via[dest]  = dir;
+               queue.push_back(dest);
+            }
+         }
+      }
+
+      if (from[target] < 0)
+         return false;
+
+      path.clear();
+      for (int cell = target; cell != start; cell = from[cell])
+         path.push_back(via[cell]);
+      reverse(path.begin(), path.end());
+      return true;
+   }
+
+   vector<unsigned> Solver::replay_input(const GameRules& rules, const GameState& initial,
+         const vector<Push>& solution)
+   {
+      Grid grid(rules);
+      vector<unsigned> input;
+      GameState state = initial;
+
+      auto run = [&](unsigned bits) {
+         input.push_back(bits);
+         step(rules, state, bits);
+      };
+
+      auto settle = [&]() {
+         while (state.stepper == GameState::StepperPlayer || state.stepper == GameState::StepperBlock)
+            run(0);
+      };
+
+      auto player_cell = [&]() {
+         return (state.player.y / rules.tile_h()) * rules.tiles_width() + state.player.x / rules.tile_w();
+      };
+
+      // Push is edge triggered and counts as held when a level starts.
+      run(0);
+
+      for (auto& push : solution)
+      {
+         vector<unsigned> path;
+         if (state.won_frame_cnt || !walk_path(grid, rules, state, push.cell, path))
+            return vector<unsigned>();
+
+         for (auto dir : path)
+         {
+            run(input_bit(static_cast<Input>(dir)));
+            settle();
+         }
+
+         if (player_cell() != static_cast<int>(push.cell))
+            return vector<unsigned>();
+
+         // The block is in the way, so this only turns the player around.
+         run(input_bit(push.dir));
+         if (state.stepper != GameState::StepperNone)
+            return vector<unsigned>();
+
+         run(0);
+         run(input_bit(Input::Push));
+         settle();
+      }
+
+      if (!state.won_frame_cnt || state.pushes != solution.size())
+         return vector<unsigned>();
+
+      while (!state.won())
+         run(0);
+
+      return input;
+   }
+}
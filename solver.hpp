@@ -0,0 +1,115 @@
+#ifndef SOLVER_HPP__
+#define SOLVER_HPP__
+
+#include "game_state.hpp"
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+namespace Icy
+{
+   // Finds the minimum number of pushes needed to solve a level.
+   // Works on whole tile moves rather than frames, but follows the same rules as step():
+   // walking and pushing stop at collisions, slippery floors keep the player or block sliding,
+   // and a level is won as soon as every goal block rests on a goal floor.
+   class Solver
+   {
+      public:
+         struct Push
+         {
+            unsigned cell; // Tile the player pushes from, y * width + x.
+            Input dir;
+         };
+
+         struct Result
+         {
+            Result() : solved(false), pushes(0), states(0), expanded(0), seconds(0.0), bytes_per_state(0), bytes_total(0) {}
+
+            bool solved;
+            unsigned pushes;
+            std::vector<Push> solution;
+
+            uint64_t states;   // Unique states stored.
+            uint64_t expanded; // States whose successors were generated.
+            double seconds;
+            std::size_t bytes_per_state;
+            std::size_t bytes_total;
+         };
+
+         Solver(const GameRules& rules, const GameState& initial);
+         ~Solver();
+
+         // Runs a parallel breadth-first search, one push per layer.
+         // memory is the budget for the visited table in bytes.
+         Result solve(unsigned threads, std::size_t memory);
+
+         // Turns a push solution into per-frame input, by walking and pushing through step() itself.
+         // Returns an empty vector if the replay didn't end up winning with the expected number of pushes.
+         static std::vector<unsigned> replay_input(const GameRules& rules, const GameState& initial,
+               const std::vector<Push>& solution);
+
+      private:
+         struct Key
+         {
+            uint64_t word[2];
+            bool operator==(const Key& key) const { return word[0] == key.word[0] && word[1] == key.word[1]; }
+         };
+
+         struct Entry
+         {
+            std::atomic<uint64_t> hash; // 0 means free.
+            Key key;
+            uint32_t parent;
+            uint16_t cell;
+            uint8_t dir;
+            std::atomic<uint8_t> ready;
+         };
+
+         // Open addressing hash table split into shards which are claimed with a single CAS.
+         class VisitedTable
+         {
+            public:
+               VisitedTable(std::size_t memory);
+
+               // Returns index of the entry and whether it was newly inserted.
+               uint32_t insert(uint64_t hash, const Key& key, uint32_t parent, unsigned cell, unsigned dir, bool& inserted);
+               const Entry& entry(uint32_t index) const { return entries[index]; }
+               uint64_t size() const;
+               std::size_t capacity() const { return shards * shard_size; }
+
+            private:
+               enum { shards = 64 };
+               std::size_t shard_size;
+               std::unique_ptr<Entry[], void (*)(void*)> entries;
+               std::unique_ptr<std::atomic<uint64_t>[]> counts;
+         };
+
+         struct Worker;
+         struct Grid;
+
+         const GameRules& rules;
+         int width, height;
+         unsigned num_cells;
+         unsigned bits;
+         unsigned num_goal, num_blocks;
+         std::unique_ptr<const Grid> grid;
+
+         std::vector<uint64_t> zobrist; // [class][cell], classes being player, goal block and other block.
+         Key initial_key;
+         uint64_t initial_hash;
+
+         std::unique_ptr<VisitedTable> table;
+         std::atomic<uint32_t> solved_index;
+
+         uint64_t hash(unsigned player, const uint16_t *blocks) const;
+         Key pack(unsigned player, const uint16_t *blocks) const;
+         void unpack(const Key& key, unsigned& player, uint16_t *blocks) const;
+         void expand(uint32_t index, Worker& worker);
+         static bool walk_path(const Grid& grid, const GameRules& rules, const GameState& state,
+               int target, std::vector<unsigned>& path);
+   };
+}
+
+#endif
@@ -1,4 +1,5 @@
 #include "surface.hpp"
+#include <algorithm>
 #include <stdexcept>
 #include <utility>
 #include <memory>
@@ -8,71 +9,96 @@ using namespace std;
 namespace Blit
 {
    Surface::Surface(Pixel pix, int width, int height)
-      : data(make_shared<Data>(pix, width, height)),
-      m_active_alt_index(0), m_rect(Pos(0, 0), width, height), m_ignore_camera(false)
+      : data(make_shared<Data>(pix, width, height)), shown(data.get()),
+      m_face(0), m_face_index(0), m_rect(Pos(0, 0), width, height), m_ignore_camera(false)
    {}
 
    Surface::Surface(shared_ptr<const Data> data)
-      : data(data), m_active_alt_index(0), m_rect(Pos(0, 0), data->w, data->h), m_ignore_camera(false)
+      : data(data), shown(data.get()), m_face(0), m_face_index(0), m_rect(Pos(0, 0), data->w, data->h), m_ignore_camera(false)
    {}
 
-   static bool same_size_func(const vector<Surface::Alt>& alts, Pos size)
-   {
-      for( vector<Surface::Alt>::const_iterator alt = alts.begin(); alt!=alts.end(); alt++ )
-         if(size != Pos(alt->data->w, alt->data->h))
-            return false;
-      return true;
-   }
-
    Surface::Surface(const vector<Alt>& alts, const string& start_id) : m_ignore_camera(false)
    {
       if (alts.empty())
          throw logic_error("Alts is empty.");
 
-      Pos size(alts.front().data->w, alts.front().data->h);
-      m_rect = Rect(Pos(0, 0), size.x, size.y);
-
-      bool same_size = same_size_func(alts,size);
-
-      if (!same_size)
-         throw logic_error("Not all alts are of same size.");
+      auto table = make_shared<Frames>();
+      vector<vector<Frame>> faces;
+      for (auto& alt : alts)
+      {
+         Rect frame = alt.frame ? alt.frame : Rect(Pos(0, 0), alt.data->w, alt.data->h);
+         if (frame.pos.x < 0 || frame.pos.y < 0 ||
+               frame.pos.x + frame.w > alt.data->w || frame.pos.y + frame.h > alt.data->h)
+            throw logic_error(Utils::join("Frame of alt \"", alt.tag, "\" is out of bounds."));
+
+         if (!faces.empty() && (frame.w != m_rect.w || frame.h != m_rect.h))
+            throw logic_error("Not all alts are of same size.");
+         m_rect = Rect(Pos(0, 0), frame.w, frame.h);
+
+         unsigned face = find(table->faces.begin(), table->faces.end(), alt.tag) - table->faces.begin();
+         if (face == table->faces.size())
+         {
+            table->faces.push_back(alt.tag);
+            faces.push_back(vector<Frame>());
+         }
+         faces[face].push_back(Frame{alt.data, frame.pos});
+      }
+
+      for (auto& face : faces)
+      {
+         table->first.push_back(table->frames.size());
+         table->frames.insert(table->frames.end(), face.begin(), face.end());
+      }
+      table->first.push_back(table->frames.size());
+
+      frames = move(table);
+      active_alt(start_id);
+   }
 
-      for( vector<Alt>::const_iterator alt = alts.begin(); alt!=alts.end(); alt++ )
-         this->alts.insert(std::pair<std::string, std::shared_ptr<const Data>>(alt->tag, alt->data));
+   int Surface::face_id(const string& id) const
+   {
+      if (!frames)
+         return -1;
 
-      active_alt(start_id);
+      auto itr = find(frames->faces.begin(), frames->faces.end(), id);
+      return itr == frames->faces.end() ? -1 : itr - frames->faces.begin();
    }
 
-   void Surface::active_alt(const string& id, unsigned index)
+   void Surface::active_face(unsigned face, unsigned index)
    {
-      std::pair
-         <std::multimap<std::string, std::shared_ptr<const Data>>::const_iterator,
-         std::multimap<std::string, std::shared_ptr<const Data>>::const_iterator>
-            itr = alts.equal_range(id);
+      if (!frames || face >= frames->faces.size())
+         throw logic_error(Utils::join("Face ", int(face), " does not exist."));
 
-      iterator_traits<std::multimap<std::string,std::shared_ptr<const Data>>::const_iterator>::
-         difference_type dist = distance(itr.first, itr.second);
+      unsigned frame = frames->first[face] + index;
+      if (frame >= frames->first[face + 1])
+         throw logic_error(Utils::join("Subindex is out of bounds. Requested Alt: \"", frames->faces[face], "\" Index: ", index));
 
-      if (dist <= static_cast<int>(index))
-         throw logic_error(Utils::join("Subindex is out of bounds. Requested Alt: \"", id, "\" Index: ", index));
+      m_face       = face;
+      m_face_index = index;
+      shown        = frames->frames[frame].data.get();
+      m_origin     = frames->frames[frame].origin;
+   }
 
-      advance(itr.first, index);
-      std::shared_ptr<const Data> ptr = itr.first->second;
-      if (!ptr)
-         throw logic_error(Utils::join("Alt ID ", id, " does not exist."));
+   pair<string, unsigned> Surface::active_alt() const
+   {
+      return make_pair(frames ? frames->faces[m_face] : string(), m_face_index);
+   }
 
-      m_active_alt = id;
-      m_active_alt_index = index;
-      data = ptr;
+   void Surface::active_alt(const string& id, unsigned index)
+   {
+      int face = face_id(id);
+      if (face < 0)
+         throw logic_error(Utils::join("Alt ID ", id, " does not exist."));
+      active_face(face, index);
    }
 
    void Surface::active_alt_index(unsigned index)
    {
-      active_alt(m_active_alt, index);
+      active_face(m_face, index);
    }
 
    Surface::Surface()
-      : m_rect(Pos(0, 0), 0, 0), m_ignore_camera(false)
+      : shown(nullptr), m_face(0), m_face_index(0), m_rect(Pos(0, 0), 0, 0), m_ignore_camera(false)
    {}
 
    Surface Surface::sub(Rect rect) const
@@ -89,10 +115,10 @@ namespace Blit
       pos -= m_rect.pos;
       int x = pos.x, y = pos.y;
 
-      if (x >= data->w || y >= data->h)
+      if (x >= m_rect.w || y >= m_rect.h)
          return 0;
 
-      return data->pixels[y * data->w + x];
+      return shown->pixels[(m_origin.y + y) * shown->w + m_origin.x + x];
    }
 
    const Pixel* Surface::pixel_raw(Pos pos) const
@@ -100,33 +126,32 @@ namespace Blit
       pos -= m_rect.pos;
       int x = pos.x, y = pos.y;
 
-      if (x >= data->w || y >= data->h || x < 0 || y < 0)
+      if (x >= m_rect.w || y >= m_rect.h || x < 0 || y < 0)
          throw logic_error(Utils::join(
                   "Pixel was fetched out-of-bounds. ",
                   "Asked for: (", x, ", ", y, "). ",
-                  "Real dimension: (", data->w, ", ", data->h, ")."
+                  "Real dimension: (", m_rect.w, ", ", m_rect.h, ")."
                   ));
 
-      return &data->pixels[y * data->w + x];
-   }
-
-   static Pixel* pixel_ptr = NULL;
-   static Pixel transform_func(Pixel old)
-   {
-      return old & static_cast<Pixel>(Pixel::alpha_mask) ? *pixel_ptr : Pixel();
+      return &shown->pixels[(m_origin.y + y) * shown->w + m_origin.x + x];
    }
 
    void Surface::refill_color(Pixel pixel)
    {
       vector<Pixel> pix;
-      pix.reserve(data->w * data->h);
-
-      const std::vector<Pixel>& orig = data->pixels;
-
-      pixel_ptr = &pixel;
-      transform(orig.begin(), orig.end(), back_inserter(pix), transform_func);
-
-      data = make_shared<Surface::Data>(move(pix), data->w, data->h);
+      pix.reserve(m_rect.w * m_rect.h);
+
+      for (int y = 0; y < m_rect.h; y++)
+      {
+         const Pixel *line = &shown->pixels[(m_origin.y + y) * shown->w + m_origin.x];
+         transform(line, line + m_rect.w, back_inserter(pix), [pixel](Pixel old) {
+               return old & static_cast<Pixel>(Pixel::alpha_mask) ? pixel : Pixel();
+            });
+      }
+
+      data     = make_shared<Surface::Data>(move(pix), m_rect.w, m_rect.h);
+      shown    = data.get();
+      m_origin = Pos(0, 0);
    }
 
    void Surface::ignore_camera(bool ignore)
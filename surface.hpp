@@ -27,6 +27,7 @@ namespace Blit
          {
             std::shared_ptr<const Data> data;
             std::string tag; 
+            Rect frame; // The part of data shown, all of it if empty, so frames can share a sheet.
          };
 
          Surface();
@@ -45,22 +46,42 @@ namespace Blit
 
          Pixel pixel(Pos pos) const;
          const Pixel* pixel_raw(Pos pos) const;
+         int pitch() const { return shown->w; } // Pixels from one row to the next.
 
-         std::pair<std::string, unsigned> active_alt() const { return std::pair<std::string, unsigned>(m_active_alt, m_active_alt_index); }
+         // Faces are looked up by name once, then switched to by the number face_id() gives them,
+         // which indexes a table of frames shared by every copy of the surface.
+         int face_id(const std::string& id) const; // Negative if there is no such face.
+         void active_face(unsigned face, unsigned index = 0);
+         unsigned active_face() const { return m_face; }
+         unsigned faces() const { return frames ? frames->faces.size() : 0; }
+         unsigned face_frames(unsigned face) const { return frames->first[face + 1] - frames->first[face]; }
+
+         std::pair<std::string, unsigned> active_alt() const;
          void active_alt(const std::string& id, unsigned index = 0);
          void active_alt_index(unsigned index);
 
-         std::map<std::string, std::string>& attr() { return attribs; }
-         const std::map<std::string, std::string>& attr() const { return attribs; }
-
       private:
-         std::shared_ptr<const Data> data;
+         struct Frame
+         {
+            std::shared_ptr<const Data> data;
+            Pos origin;
+         };
+
+         struct Frames
+         {
+            std::vector<std::string> faces; // Name of every face.
+            std::vector<unsigned> first;    // Frame every face starts at, and one past the last.
+            std::vector<Frame> frames;      // Grouped by face, in the order given.
+         };
+
+         std::shared_ptr<const Data> data; // Unless the surface has frames, which hold their own.
+         const Data *shown;
+         Pos m_origin; // Of the shown frame, within shown.
 
-         std::multimap<std::string, std::shared_ptr<const Data>> alts;
-         std::string m_active_alt;
-         unsigned m_active_alt_index;
+         std::shared_ptr<const Frames> frames;
+         unsigned m_face;
+         unsigned m_face_index;
 
-         std::map<std::string, std::string> attribs;
          Rect m_rect;
          bool m_ignore_camera;
    };
@@ -105,15 +126,39 @@ namespace Blit
          std::function<Pos (Pos)> func;
    };
 
+   // Decoded images are shared by every SurfaceCache in the process, and can be loaded from any thread.
+   // They are looked up by canonical path. The most recently used images are kept alive up to a byte
+   // budget. Past that, an image lives as long as some Surface uses it, and is still found until then.
+   // Threads asking for an image another thread is decoding wait for that instead of decoding it again.
+   // Sprites are kept parsed the same way, so loading one again only copies a Surface.
    class SurfaceCache
    {
       public:
          Surface from_image(const std::string& path);
          Surface from_sprite(const std::string& path);
 
+         struct Stats
+         {
+            uint64_t hits;
+            uint64_t misses;
+            uint64_t evictions;
+            std::size_t images; // Still alive, whether the cache holds them or not.
+            std::size_t sprites;
+            std::size_t bytes;  // Held by the cache.
+            std::size_t budget;
+         };
+
+         static Stats stats();
+         static void set_budget(std::size_t bytes);
+         // Whether sprites with an image per face get them copied into one sheet. On by default.
+         static void pack_sprites(bool pack);
+
       private:
-         std::map<std::string, std::shared_ptr<const Surface::Data>> cache;
-         std::shared_ptr<const Surface::Data> load_image(const std::string& path);
+         struct Sprite;
+
+         static std::shared_ptr<const Sprite> load_sprite(const std::string& path, std::size_t& bytes);
+         static std::shared_ptr<const Surface::Data> image(const std::string& path);
+         static std::shared_ptr<const Surface::Data> load_image(const std::string& path);
    };
 
    class RenderTarget
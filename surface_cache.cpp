@@ -1,74 +1,380 @@
 #include "surface.hpp"
+#include "asset_pack.hpp"
+#include "disk_cache.hpp"
 #include "pugixml/pugixml.hpp"
 #include "rpng_front.h"
 #include <stdexcept>
 #include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <future>
 #include <new>
+#include <list>
+#include <mutex>
+#include <unordered_map>
 
 using namespace pugi;
 
 namespace Blit
 {
+   namespace
+   {
+      static_assert(sizeof(Pixel) == sizeof(uint32_t) && Pixel::alpha_mask == 0xff000000u && Pixel::rgb_mask == 0x00ffffffu,
+            "Images are decoded straight into Pixels, which must be laid out as ARGB8888.");
+
+      // Sizes the surface for the decoder and hands it the pixels to write to.
+      uint32_t *alloc_pixels(void *userdata, unsigned width, unsigned height)
+      {
+         Surface::Data& data = *static_cast<Surface::Data*>(userdata);
+         data.pixels.resize(std::size_t(width) * height);
+         data.w = width;
+         data.h = height;
+         return reinterpret_cast<uint32_t*>(data.pixels.data());
+      }
+
+      // An image, or a sprite made from them.
+      struct Entry
+      {
+         std::weak_ptr<const void> item;
+         std::shared_ptr<const void> held; // Set while in the LRU list.
+         std::shared_future<std::shared_ptr<const void>> loading; // Valid while being loaded.
+         std::size_t bytes;
+         std::list<std::string>::iterator lru;
+         bool sprite;
+      };
+
+      struct Store
+      {
+         Store() : bytes(0), budget(32 << 20), hits(0), misses(0), evictions(0) {}
+
+         std::mutex lock;
+         std::unordered_map<std::string, Entry> entries;
+         std::unordered_map<std::string, std::string> keys; // Paths as asked for, to the canonical ones.
+         std::list<std::string> lru; // Most recently used first.
+         std::size_t bytes;
+         std::size_t budget;
+         uint64_t hits, misses, evictions;
+
+         const std::string& key(const std::string& path)
+         {
+            auto itr = keys.find(path);
+            if (itr == keys.end())
+               itr = keys.insert(std::make_pair(path, Utils::canonical_path(path))).first;
+            return itr->second;
+         }
+
+         void keep(const std::string& path, Entry& entry, std::shared_ptr<const void> item)
+         {
+            if (entry.held)
+            {
+               lru.splice(lru.begin(), lru, entry.lru);
+               return;
+            }
+
+            bytes += entry.bytes;
+            entry.held = move(item);
+            lru.push_front(path);
+            entry.lru = lru.begin();
+         }
+
+         void evict()
+         {
+            while (bytes > budget && !lru.empty())
+            {
+               Entry& entry = entries[lru.back()];
+               entry.held.reset();
+               bytes -= entry.bytes;
+               lru.pop_back();
+               evictions++;
+            }
+         }
+      };
+
+      Store& store()
+      {
+         static Store store;
+         return store;
+      }
+
+      // Looks up path, loading it with load if it isn't alive. load returns the item and the
+      // bytes it takes up.
+      std::shared_ptr<const void> lookup(const std::string& path, bool sprite,
+            const std::function<std::pair<std::shared_ptr<const void>, std::size_t> ()>& load)
+      {
+         Store& cache = store();
+         std::string key;
+         std::shared_future<std::shared_ptr<const void>> loading;
+         std::unique_ptr<std::promise<std::shared_ptr<const void>>> loaded; // Only made on a miss, as it allocates.
+
+         {
+            std::lock_guard<std::mutex> hold(cache.lock);
+            const std::string& canonical = cache.key(path);
+            Entry& entry = cache.entries[canonical];
+            std::shared_ptr<const void> item = entry.item.lock();
+            if (item)
+            {
+               cache.hits++;
+               cache.keep(canonical, entry, item);
+               cache.evict();
+               return item;
+            }
+
+            // Another thread is loading it already.
+            if (entry.loading.valid())
+            {
+               cache.hits++;
+               loading = entry.loading;
+            }
+            else
+            {
+               cache.misses++;
+               loaded.reset(new std::promise<std::shared_ptr<const void>>());
+               entry.loading = loaded->get_future().share();
+               key = canonical;
+            }
+         }
+
+         if (loading.valid())
+            return loading.get();
+
+         // Loaded without the lock, so other threads aren't held up.
+         std::pair<std::shared_ptr<const void>, std::size_t> item;
+         try
+         {
+            item = load();
+         }
+         catch (...)
+         {
+            {
+               std::lock_guard<std::mutex> hold(cache.lock);
+               cache.entries[key].loading = std::shared_future<std::shared_ptr<const void>>();
+            }
+            loaded->set_exception(std::current_exception());
+            throw;
+         }
+
+         {
+            std::lock_guard<std::mutex> hold(cache.lock);
+            Entry& entry  = cache.entries[key];
+            entry.loading = std::shared_future<std::shared_ptr<const void>>();
+            entry.item    = item.first;
+            entry.bytes   = item.second;
+            entry.sprite  = sprite;
+
+            cache.keep(key, entry, item.first);
+            cache.evict();
+         }
+
+         loaded->set_value(item.first);
+         return item.first;
+      }
+
+      std::atomic<bool> pack_faces(true);
+
+      std::size_t image_bytes(const Surface::Data& data)
+      {
+         return sizeof(Surface::Data) + data.pixels.size() * sizeof(Pixel);
+      }
+   }
+
+   // A parsed sprite, and the files it was made from.
+   struct SurfaceCache::Sprite
+   {
+      Surface surface;
+      std::vector<std::string> files;
+   };
+
    Surface SurfaceCache::from_image(const std::string& path)
    {
-      std::shared_ptr<const Blit::Surface::Data> ptr = cache[path];
-      if (ptr)
-         return Surface(ptr);
-      
-      cache[path] = load_image(path);
-      return cache[path];
+      DiskCache::depend(path);
+      return Surface(image(path));
+   }
+
+   std::shared_ptr<const Surface::Data> SurfaceCache::image(const std::string& path)
+   {
+      return std::static_pointer_cast<const Surface::Data>(lookup(path, false, [&path] {
+               std::shared_ptr<const Surface::Data> data = load_image(path);
+               return std::make_pair(std::shared_ptr<const void>(data), image_bytes(*data));
+            }));
+   }
+
+   SurfaceCache::Stats SurfaceCache::stats()
+   {
+      Store& cache = store();
+      std::lock_guard<std::mutex> hold(cache.lock);
+
+      Stats stats;
+      stats.hits      = cache.hits;
+      stats.misses    = cache.misses;
+      stats.evictions = cache.evictions;
+      stats.bytes     = cache.bytes;
+      stats.budget    = cache.budget;
+      stats.images    = 0;
+      stats.sprites   = 0;
+      for (auto& entry : cache.entries)
+      {
+         if (entry.second.item.expired())
+            continue;
+         if (entry.second.sprite)
+            stats.sprites++;
+         else
+            stats.images++;
+      }
+      return stats;
+   }
+
+   void SurfaceCache::set_budget(std::size_t bytes)
+   {
+      Store& cache = store();
+      std::lock_guard<std::mutex> hold(cache.lock);
+      cache.budget = bytes;
+      cache.evict();
+   }
+
+   // Copies the faces into one sheet, a row of them after another, and points them at it.
+   static std::shared_ptr<const Surface::Data> pack_sheet(std::vector<Surface::Alt>& alts)
+   {
+      int w = alts.front().data->w;
+      int h = alts.front().data->h;
+      for (auto& alt : alts)
+         if (alt.data->w != w || alt.data->h != h)
+            throw std::logic_error("Not all alts are of same size.");
+
+      int columns = 1;
+      while (columns * columns < static_cast<int>(alts.size()))
+         columns++;
+      int rows = (alts.size() + columns - 1) / columns;
+
+      auto sheet = std::make_shared<Surface::Data>(std::vector<Pixel>(std::size_t(columns * w) * rows * h), columns * w, rows * h);
+      for (unsigned i = 0; i < alts.size(); i++)
+      {
+         Pos pos((i % columns) * w, (i / columns) * h);
+         for (int y = 0; y < h; y++)
+            std::copy_n(&alts[i].data->pixels[y * w], w, &sheet->pixels[(pos.y + y) * sheet->w + pos.x]);
+
+         alts[i].data  = sheet;
+         alts[i].frame = Rect(pos, w, h);
+      }
+
+      return sheet;
    }
 
    Surface SurfaceCache::from_sprite(const std::string& path)
+   {
+      auto sprite = std::static_pointer_cast<const Sprite>(lookup(path, true, [&path] {
+               std::size_t bytes = 0;
+               std::shared_ptr<const Sprite> sprite = load_sprite(path, bytes);
+               return std::make_pair(std::shared_ptr<const void>(sprite), bytes);
+            }));
+
+      for (auto& file : sprite->files)
+         DiskCache::depend(file);
+      return sprite->surface;
+   }
+
+   // A sprite is either a sheet, one image with the rectangle of every face in it:
+   //    <sprite start_id="up" source="dino.png">
+   //       <face id="up" x="0" y="0" w="16" h="16"/>
+   // or an image per face:
+   //    <sprite start_id="up">
+   //       <face id="up" source="dino_up.png"/>
+   // The latter are packed into a sheet as they load, unless pack_sprites(false).
+   std::shared_ptr<const SurfaceCache::Sprite> SurfaceCache::load_sprite(const std::string& path, std::size_t& bytes)
    {
       xml_document doc;
-      if (!doc.load_file(path.c_str()))
+      if (!AssetPack::load_xml(doc, path))
          throw std::runtime_error(Utils::join("Failed to load XML sprite: ", path, "."));
 
-      std::basic_string<char> basedir = Utils::basedir(path);
+      auto sprite = std::make_shared<Sprite>();
+      sprite->files.push_back(path);
+      bytes = sizeof(Sprite);
+
+      std::string basedir = Utils::basedir(path);
       std::vector<Surface::Alt> alts;
 
-      pugi::xml_node sprite = doc.child("sprite");
-      for (pugi::xml_node face = sprite.child("face"); face; face = face.next_sibling())
+      xml_node root = doc.child("sprite");
+      if (*root.attribute("source").value())
       {
-         const char *id = face.attribute("id").value();
-         std::basic_string<char> path   = Utils::join(basedir, "/", face.attribute("source").value());
+         std::string sheet_path = Utils::join(basedir, "/", root.attribute("source").value());
+         std::shared_ptr<const Surface::Data> sheet = image(sheet_path);
+         sprite->files.push_back(sheet_path);
 
-         std::shared_ptr<const Blit::Surface::Data> ptr = cache[path];
-         if (!ptr)
+         for (xml_node face = root.child("face"); face; face = face.next_sibling("face"))
          {
-            cache[path] = load_image(path);
-            ptr = cache[path];
+            Rect frame(Pos(face.attribute("x").as_int(), face.attribute("y").as_int()),
+                  face.attribute("w").as_int(), face.attribute("h").as_int());
+            if (!frame)
+               throw std::runtime_error(Utils::join("Face without a size in sprite sheet: ", path, "."));
+            alts.push_back(Surface::Alt{sheet, face.attribute("id").value(), frame});
+         }
+      }
+      else
+      {
+         for (xml_node face = root.child("face"); face; face = face.next_sibling("face"))
+         {
+            std::string face_path = Utils::join(basedir, "/", face.attribute("source").value());
+            sprite->files.push_back(face_path);
+            alts.push_back(Surface::Alt{pack_faces ? load_image(face_path) : image(face_path),
+                  face.attribute("id").value(), Rect()});
          }
 
-         alts.push_back(Surface::Alt{ptr, id});
+         if (pack_faces && !alts.empty())
+         {
+            std::shared_ptr<const Surface::Data> sheet = pack_sheet(alts);
+            bytes += image_bytes(*sheet);
+         }
       }
 
-      return Surface(alts, sprite.attribute("start_id").value());
+      if (alts.empty())
+         throw std::runtime_error(Utils::join("Sprite has no faces: ", path, "."));
+
+      sprite->surface = Surface(alts, root.attribute("start_id").value());
+      return sprite;
+   }
+
+   void SurfaceCache::pack_sprites(bool pack)
+   {
+      pack_faces = pack;
    }
 
    std::shared_ptr<const Surface::Data> SurfaceCache::load_image(const std::string& path)
    {
-      uint32_t *image = NULL;
-      unsigned width  = 0;
-      unsigned height = 0;
-      bool loaded     = rpng_load_image_argb(path.c_str(), &image, &width, &height);
+      MappedFile file;
+      AssetPack::Format format;
+      if (!AssetPack::open(path, file, &format))
+         throw std::runtime_error(Utils::join("Failed to open image: ", path));
 
-      if (!loaded)
-         throw std::runtime_error(Utils::join("RPNG failed to load image: ", path));
+      if (format.kind == AssetPack::Pixels)
+      {
+         std::size_t pixels = std::size_t(format.width) * format.height;
+         if (file.size() != pixels * sizeof(Pixel))
+            throw std::logic_error(Utils::join("Packed image has the wrong size: ", path));
+
+         std::vector<Pixel> pix(pixels);
+         memcpy(pix.data(), file.data(), file.size());
+         return std::make_shared<Surface::Data>(std::move(pix), format.width, format.height);
+      }
 
-      std::vector<Pixel> pix(width * height);
-      for (unsigned i = 0; i < width * height; i++)
+      // Decoded images on disk are named by the hash of the PNG.
+      DiskCache *disk = DiskCache::get();
+      uint64_t key = disk ? disk->hash_file(path) : 0;
+      if (key)
       {
-         pix[i] = Pixel::ARGB(
-               uint8_t(image[i] >> 24),
-               uint8_t(image[i] >> 16),
-               uint8_t(image[i] >>  8),
-               uint8_t(image[i] >>  0));
+         key = DiskCache::hash_bytes("image", 5, key);
+         std::shared_ptr<const Surface::Data> data = disk->load(key);
+         if (data)
+            return data;
       }
 
-      free(image);
-      return std::make_shared<Surface::Data>(std::move(pix), width, height);
+      std::shared_ptr<Surface::Data> data = std::make_shared<Surface::Data>(std::vector<Pixel>(), 0, 0);
+      if (!rpng_load_image_argb_into(file.data(), file.size(), alloc_pixels, data.get()))
+         throw std::runtime_error(Utils::join("RPNG failed to load image: ", path));
+
+      if (key)
+         disk->store(key, *data);
+      return data;
    }
 }
 
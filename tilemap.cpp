@@ -1,41 +1,100 @@
 #include "tilemap.hpp"
 #include "utils.hpp"
+#include "disk_cache.hpp"
+#include "asset_pack.hpp"
 
 #include <iostream>
 #include <stdexcept>
+#include <algorithm>
+#include <iterator>
 #include <map>
 #include <utility>
 #include <string>
+#include <fstream>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
 #include "pugixml/pugixml.hpp"
+#include <compat/zlib.h>
 
 using namespace pugi;
 
 namespace Blit
 {
-   Tilemap::Tilemap(const std::string& path) : dir(Utils::basedir(path))
+   Tilemap::Tilemap(const std::string& path, bool allow_compiled) : blocks_layer(-1), dir(Utils::basedir(path))
    {
-      xml_document doc;
-      if (!doc.load_file(path.c_str()))
-         throw std::runtime_error(Utils::join("Failed to load XML map: ", path, "."));
+      DiskCache::depend(path);
 
-      xml_node map   = doc.child("map");
-      width      = map.attribute("width").as_int();
-      height     = map.attribute("height").as_int();
-      tilewidth  = map.attribute("tilewidth").as_int();
-      tileheight = map.attribute("tileheight").as_int();
+      Source source;
+      if (!allow_compiled || !read_compiled(compiled_path(path), path, source))
+         source = read_tmx(path);
 
-      if (!width || !height || !tilewidth || !tileheight)
-         throw std::logic_error("Tilemap is malformed.");
+      width      = source.width;
+      height     = source.height;
+      tilewidth  = source.tilewidth;
+      tileheight = source.tileheight;
+
+      collisions.resize(width * height);
+
+      for (auto& set : source.tilesets)
+         add_tileset(set);
+
+      for (auto& layer : source.layers)
+         add_layer(layer);
+   }
+
+   std::string Tilemap::compiled_path(const std::string& tmx_path)
+   {
+      std::size_t ext = tmx_path.size() - std::min<std::size_t>(tmx_path.size(), 4);
+      if (Utils::tolower(tmx_path.substr(ext)) == ".tmx")
+         return Utils::join(tmx_path.substr(0, ext), ".lvl");
+      return Utils::join(tmx_path, ".lvl");
+   }
+
+   unsigned Tilemap::intern(const std::string& str)
+   {
+      auto itr = string_ids.find(str);
+      if (itr != string_ids.end())
+         return itr->second;
+
+      unsigned id = strings.size();
+      strings.push_back(str);
+      string_ids[str] = id;
+      return id;
+   }
+
+   void Tilemap::add_properties(Tile& tile, const std::map<std::string, std::string>& attrs)
+   {
+      static const struct { const char *name; unsigned flag; } known[] = {
+         { "collision",       FlagCollision },
+         { "goal",            FlagGoal },
+         { "slippery_player", FlagSlipperyPlayer },
+         { "slippery_block",  FlagSlipperyBlock },
+      };
 
-      std::map<unsigned, Surface> tiles;
-      for (auto set = map.child("tileset"); set; set = set.next_sibling("tileset"))
-         add_tileset(tiles, set);
+      tile.flags = 0;
+      tile.props.clear();
 
-      for (auto layer = map.child("layer"); layer; layer = layer.next_sibling("layer"))
-         add_layer(tiles, layer, tilewidth, tileheight);
+      for (auto& attr : attrs)
+      {
+         bool is_known = false;
+         for (auto& k : known)
+         {
+            if (attr.first == k.name)
+            {
+               if (attr.second == "true")
+                  tile.flags |= k.flag;
+               is_known = true;
+               break;
+            }
+         }
+
+         if (!is_known)
+            tile.props.push_back({intern(attr.first), intern(attr.second)});
+      }
    }
 
-   std::map<std::string, std::string> Tilemap::get_attributes(xml_node parent, const std::string& child) const
+   std::map<std::string, std::string> Tilemap::get_attributes(xml_node parent, const std::string& child)
    {
       std::map<std::string, std::string> attrs;
 
@@ -49,114 +108,603 @@ namespace Blit
       return attrs;
    }
 
-   void Tilemap::add_tileset(std::map<unsigned, Surface>& tiles, xml_node node)
+   // Tiled writes layer data as a <tile gid="..."/> element per cell, as comma separated gids,
+   // or as base64 of 32-bit little endian gids, which can be compressed with zlib or gzip.
+   // Layers may have fewer tiles than cells, the rest are empty.
+   namespace
+   {
+      void store_gid(std::vector<uint16_t>& gids, std::size_t index, unsigned long gid)
+      {
+         if (index >= gids.size())
+            throw std::logic_error("Layer has more tiles than its geometry allows.");
+
+         if (gid > 0xffff)
+            throw std::logic_error(Utils::join("Tile gid ", gid, " is out of range."));
+
+         gids[index] = gid;
+      }
+
+      void read_csv(const char *text, std::vector<uint16_t>& gids)
+      {
+         std::size_t index = 0;
+         for (;;)
+         {
+            while (*text == ',' || std::isspace(static_cast<unsigned char>(*text)))
+               text++;
+            if (!*text)
+               break;
+
+            char *end = NULL;
+            unsigned long gid = std::strtoul(text, &end, 10);
+            if (end == text)
+               throw std::logic_error("Layer has malformed CSV data.");
+
+            store_gid(gids, index++, gid);
+            text = end;
+         }
+      }
+
+      std::vector<uint8_t> decode_base64(const char *text)
+      {
+         enum { invalid = -1, space = -2 };
+         static const std::vector<int8_t> values = [] {
+            static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+            std::vector<int8_t> values(256, invalid);
+            for (unsigned i = 0; i < 64; i++)
+               values[static_cast<unsigned char>(alphabet[i])] = i;
+            for (auto c : " \t\r\n")
+               values[static_cast<unsigned char>(c)] = space;
+            return values;
+         }();
+
+         std::size_t length = std::strlen(text);
+         std::vector<uint8_t> out(length / 4 * 3 + 3);
+         uint8_t *ptr = out.data();
+         const uint8_t *in  = reinterpret_cast<const uint8_t*>(text);
+         const uint8_t *end = in + length;
+
+         uint32_t bits = 0;
+         unsigned count = 0;
+         while (in < end && *in != '=')
+         {
+            // Whole groups of four at a time, as long as there's no whitespace in them.
+            if (!count && end - in >= 4)
+            {
+               int a = values[in[0]], b = values[in[1]], c = values[in[2]], d = values[in[3]];
+               if ((a | b | c | d) >= 0)
+               {
+                  uint32_t group = (a << 18) | (b << 12) | (c << 6) | d;
+                  *ptr++ = group >> 16;
+                  *ptr++ = group >> 8;
+                  *ptr++ = group;
+                  in += 4;
+                  continue;
+               }
+            }
+
+            int value = values[*in++];
+            if (value == space)
+               continue;
+            if (value == invalid)
+               throw std::logic_error("Layer has malformed base64 data.");
+
+            bits = (bits << 6) | value;
+            count += 6;
+            if (count >= 8)
+            {
+               count -= 8;
+               *ptr++ = bits >> count;
+               bits &= (1u << count) - 1;
+            }
+         }
+
+         out.resize(ptr - out.data());
+         return out;
+      }
+
+      // Inflates zlib or gzip data, which must not be larger than max_size.
+      std::vector<uint8_t> inflate_data(const std::vector<uint8_t>& in, std::size_t max_size)
+      {
+         std::vector<uint8_t> out(max_size);
+
+         z_stream stream;
+         std::memset(&stream, 0, sizeof(stream));
+         if (inflateInit2(&stream, 15 + 32) != Z_OK) // Detects the zlib or gzip header.
+            throw std::runtime_error("Failed to initialize zlib.");
+
+         stream.next_in   = const_cast<Bytef*>(in.data());
+         stream.avail_in  = in.size();
+         stream.next_out  = out.data();
+         stream.avail_out = out.size();
+
+         int ret = inflate(&stream, Z_FINISH);
+         out.resize(out.size() - stream.avail_out);
+         inflateEnd(&stream);
+
+         if (ret == Z_BUF_ERROR && out.size() == max_size)
+            throw std::logic_error("Layer has more tiles than its geometry allows.");
+         if (ret != Z_STREAM_END)
+            throw std::logic_error("Layer has malformed compressed data.");
+
+         return out;
+      }
+   }
+
+   void Tilemap::read_layer_data(xml_node data, std::vector<uint16_t>& gids)
+   {
+      std::string encoding    = data.attribute("encoding").value();
+      std::string compression = data.attribute("compression").value();
+
+      if (encoding.empty())
+      {
+         Utils::xml_node_walker walk{data, "tile", "gid"};
+         std::size_t index = 0;
+         for (auto& gid_str : walk)
+            store_gid(gids, index++, Utils::stoi(gid_str));
+      }
+      else if (encoding == "csv")
+         read_csv(data.child_value(), gids);
+      else if (encoding == "base64")
+      {
+         std::vector<uint8_t> bytes = decode_base64(data.child_value());
+
+         if (compression == "zlib" || compression == "gzip")
+            bytes = inflate_data(bytes, gids.size() * 4);
+         else if (!compression.empty())
+            throw std::logic_error(Utils::join("Unsupported layer compression: ", compression, "."));
+
+         if (bytes.size() % 4)
+            throw std::logic_error("Layer data is not a whole number of gids.");
+
+         for (std::size_t i = 0; i < bytes.size() / 4; i++)
+            store_gid(gids, i, Utils::read_le32(&bytes[4 * i]));
+      }
+      else
+         throw std::logic_error(Utils::join("Unsupported layer encoding: ", encoding, "."));
+   }
+
+   Tilemap::Source Tilemap::read_tmx(const std::string& path)
+   {
+      xml_document doc;
+      if (!AssetPack::load_xml(doc, path))
+         throw std::runtime_error(Utils::join("Failed to load XML map: ", path, "."));
+
+      Source source;
+      xml_node map      = doc.child("map");
+      source.width      = map.attribute("width").as_int();
+      source.height     = map.attribute("height").as_int();
+      source.tilewidth  = map.attribute("tilewidth").as_int();
+      source.tileheight = map.attribute("tileheight").as_int();
+
+      if (!source.width || !source.height || !source.tilewidth || !source.tileheight)
+         throw std::logic_error("Tilemap is malformed.");
+
+      for (auto node = map.child("tileset"); node; node = node.next_sibling("tileset"))
+      {
+         Source::Tileset set;
+         set.first_gid  = node.attribute("firstgid").as_int();
+         set.tilewidth  = node.attribute("tilewidth").as_int();
+         set.tileheight = node.attribute("tileheight").as_int();
+
+         pugi::xml_node image = node.child("image");
+         set.image  = image.attribute("source").value();
+         set.width  = image.attribute("width").as_int();
+         set.height = image.attribute("height").as_int();
+         set.attr   = get_attributes(node.child("properties"), "property");
+
+         for (auto tile = node.child("tile"); tile; tile = tile.next_sibling("tile"))
+            set.tiles.push_back({tile.attribute("id").as_uint(), get_attributes(tile.child("properties"), "property")});
+
+         source.tilesets.push_back(std::move(set));
+      }
+
+      for (auto node = map.child("layer"); node; node = node.next_sibling("layer"))
+      {
+         int width  = node.attribute("width").as_int();
+         int height = node.attribute("height").as_int();
+
+         if (!width || !height)
+            throw std::logic_error("Layer is empty.");
+
+         if (width != source.width || height != source.height)
+            throw std::logic_error("Layer geometry does not correspond with map.");
+
+         Source::Layer layer;
+         layer.name = node.attribute("name").value();
+         layer.attr = get_attributes(node.child("properties"), "property");
+         layer.gids.resize(width * height);
+
+         read_layer_data(node.child("data"), layer.gids);
+
+         source.layers.push_back(std::move(layer));
+      }
+
+      return source;
+   }
+
+   // Compiled levels are little endian throughout:
+   //    magic, version, TMX hash (low and high word), width, height, tile width, tile height,
+   //    string count and strings (length, bytes),
+   //    tileset count and tilesets (first gid, tile width, tile height, width, height, image,
+   //       properties, tile count and tiles (id, properties)),
+   //    layer count and layers (name, properties, 16-bit gid per cell).
+   // Strings are referred to by index, properties are a count followed by (name, value) pairs.
+   namespace
+   {
+      enum { level_magic = 0x4c564c44, level_version = 1 }; // "DLVL"
+      enum { max_gid = 0xffff }; // Layers store gids in 16 bits.
+
+      class LevelWriter
+      {
+         public:
+            void u32(uint32_t value)
+            {
+               for (unsigned i = 0; i < 4; i++)
+                  body.push_back(value >> (8 * i));
+            }
+
+            void u16(uint16_t value)
+            {
+               body.push_back(value & 0xff);
+               body.push_back(value >> 8);
+            }
+
+            void str(const std::string& value)
+            {
+               auto itr = ids.find(value);
+               if (itr == ids.end())
+               {
+                  itr = ids.insert({value, strings.size()}).first;
+                  strings.push_back(value);
+               }
+               u32(itr->second);
+            }
+
+            void props(const std::map<std::string, std::string>& attrs)
+            {
+               u32(attrs.size());
+               for (auto& attr : attrs)
+               {
+                  str(attr.first);
+                  str(attr.second);
+               }
+            }
+
+            // Header, then the string table, then everything written so far.
+            std::vector<uint8_t> finish(const std::vector<uint32_t>& header)
+            {
+               std::vector<uint8_t> out;
+               std::swap(out, body);
+
+               for (auto value : header)
+                  u32(value);
+               u32(strings.size());
+               for (auto& value : strings)
+               {
+                  u32(value.size());
+                  body.insert(body.end(), value.begin(), value.end());
+               }
+
+               body.insert(body.end(), out.begin(), out.end());
+               return std::move(body);
+            }
+
+         private:
+            std::vector<uint8_t> body;
+            std::vector<std::string> strings;
+            std::map<std::string, uint32_t> ids;
+      };
+
+      // Reads past the end return 0 and clear ok.
+      class LevelReader
+      {
+         public:
+            LevelReader(const uint8_t *data, std::size_t size) : ptr(data), end(data + size), ok(true) {}
+
+            uint32_t u32()
+            {
+               if (end - ptr < 4)
+                  return fail();
+               uint32_t value = Utils::read_le32(ptr);
+               ptr += 4;
+               return value;
+            }
+
+            uint16_t u16()
+            {
+               if (end - ptr < 2)
+                  return fail();
+               uint16_t value = Utils::read_le16(ptr);
+               ptr += 2;
+               return value;
+            }
+
+            const std::string& str()
+            {
+               static const std::string empty;
+               uint32_t id = u32();
+               if (id >= strings.size())
+               {
+                  fail();
+                  return empty;
+               }
+               return strings[id];
+            }
+
+            void strings_table()
+            {
+               uint32_t count = u32();
+               for (uint32_t i = 0; ok && i < count; i++)
+               {
+                  uint32_t size = u32();
+                  if (static_cast<std::size_t>(end - ptr) < size)
+                  {
+                     fail();
+                     return;
+                  }
+                  strings.push_back(std::string(reinterpret_cast<const char*>(ptr), size));
+                  ptr += size;
+               }
+            }
+
+            std::map<std::string, std::string> props()
+            {
+               std::map<std::string, std::string> attrs;
+               uint32_t count = u32();
+               for (uint32_t i = 0; ok && i < count; i++)
+               {
+                  const std::string& name = str();
+                  attrs.insert({name, str()});
+               }
+               return attrs;
+            }
+
+            std::size_t remaining() const { return end - ptr; }
+            bool good() const { return ok; }
+
+         private:
+            const uint8_t *ptr, *end;
+            std::vector<std::string> strings;
+            bool ok;
+
+            uint32_t fail()
+            {
+               ok  = false;
+               ptr = end;
+               return 0;
+            }
+      };
+   }
+
+   void Tilemap::compile(const std::string& tmx_path, const std::string& out_path)
+   {
+      MappedFile tmx;
+      if (!tmx.open(tmx_path))
+         throw std::runtime_error(Utils::join("Failed to open map: ", tmx_path, "."));
+      uint64_t hash = DiskCache::hash_bytes(tmx.data(), tmx.size());
+
+      Source source = read_tmx(tmx_path);
+      LevelWriter out;
+
+      out.u32(source.tilesets.size());
+      for (auto& set : source.tilesets)
+      {
+         out.u32(set.first_gid);
+         out.u32(set.tilewidth);
+         out.u32(set.tileheight);
+         out.u32(set.width);
+         out.u32(set.height);
+         out.str(set.image);
+         out.props(set.attr);
+
+         out.u32(set.tiles.size());
+         for (auto& tile : set.tiles)
+         {
+            out.u32(tile.first);
+            out.props(tile.second);
+         }
+      }
+
+      out.u32(source.layers.size());
+      for (auto& layer : source.layers)
+      {
+         out.str(layer.name);
+         out.props(layer.attr);
+         for (auto gid : layer.gids)
+            out.u16(gid);
+      }
+
+      std::vector<uint8_t> data = out.finish({
+            level_magic, level_version,
+            static_cast<uint32_t>(hash), static_cast<uint32_t>(hash >> 32),
+            static_cast<uint32_t>(source.width), static_cast<uint32_t>(source.height),
+            static_cast<uint32_t>(source.tilewidth), static_cast<uint32_t>(source.tileheight),
+            });
+
+      std::ofstream file(out_path, std::ios::out | std::ios::binary | std::ios::trunc);
+      if (!file.is_open() || !file.write(reinterpret_cast<const char*>(data.data()), data.size()))
+         throw std::runtime_error(Utils::join("Failed to write compiled level: ", out_path, "."));
+   }
+
+   // Returns false if there is no compiled level, or it's not for the TMX next to it.
+   bool Tilemap::read_compiled(const std::string& path, const std::string& tmx_path, Source& source)
+   {
+      MappedFile file;
+      if (!AssetPack::open(path, file))
+         return false;
+
+      LevelReader in(file.data(), file.size());
+      if (in.u32() != level_magic || in.u32() != level_version)
+         return false;
+
+      uint64_t hash = in.u32();
+      hash |= uint64_t(in.u32()) << 32;
+
+      MappedFile tmx;
+      if (AssetPack::open(tmx_path, tmx) && DiskCache::hash_bytes(tmx.data(), tmx.size()) != hash)
+         return false;
+
+      source.width      = in.u32();
+      source.height     = in.u32();
+      source.tilewidth  = in.u32();
+      source.tileheight = in.u32();
+      in.strings_table();
+
+      if (source.width <= 0 || source.height <= 0 || source.tilewidth <= 0 || source.tileheight <= 0)
+         return false;
+
+      uint32_t tilesets = in.u32();
+      for (uint32_t i = 0; in.good() && i < tilesets; i++)
+      {
+         Source::Tileset set;
+         set.first_gid  = in.u32();
+         set.tilewidth  = in.u32();
+         set.tileheight = in.u32();
+         set.width      = in.u32();
+         set.height     = in.u32();
+         set.image      = in.str();
+         set.attr       = in.props();
+
+         if (set.first_gid <= 0 || set.first_gid > max_gid)
+            return false;
+
+         uint32_t tiles = in.u32();
+         for (uint32_t t = 0; in.good() && t < tiles; t++)
+         {
+            unsigned id = in.u32();
+            if (id > unsigned(max_gid - set.first_gid))
+               return false;
+            set.tiles.push_back({id, in.props()});
+         }
+
+         source.tilesets.push_back(std::move(set));
+      }
+
+      // Every layer stores a gid per cell, so the file bounds the size of the map.
+      uint64_t cells = uint64_t(source.width) * source.height;
+      uint32_t layers = in.u32();
+      if (!layers || in.remaining() / layers < cells * sizeof(uint16_t))
+         return false;
+      for (uint32_t i = 0; in.good() && i < layers; i++)
+      {
+         Source::Layer layer;
+         layer.name = in.str();
+         layer.attr = in.props();
+
+         if (in.remaining() < cells * sizeof(uint16_t))
+            return false;
+
+         layer.gids.resize(cells);
+         for (auto& gid : layer.gids)
+            gid = in.u16();
+
+         source.layers.push_back(std::move(layer));
+      }
+
+      return in.good() && !in.remaining();
+   }
+
+   void Tilemap::add_tileset(const Source::Tileset& set)
    {
-      int first_gid  = node.attribute("firstgid").as_int();
+      int first_gid  = set.first_gid;
       int id_cnt     = 0;
-      int tilewidth  = node.attribute("tilewidth").as_int();
-      int tileheight = node.attribute("tileheight").as_int();
-
-      pugi::xml_node image     = node.child("image");
-      const char *source    = image.attribute("source").value();
-      int width      = image.attribute("width").as_int();
-      int height     = image.attribute("height").as_int();
-
-#if 0
-      std::cerr << "Adding tileset:" <<
-         " Name: " << node.attribute("name").value() <<
-         " Gid: " << first_gid <<
-         " Tilewidth: " << tilewidth <<
-         " Tileheight: " << tileheight <<
-         " Source: " << source <<
-         " Width: " << width <<
-         " Height: " << height << std::endl;
-#endif
-
-      if (!width || !height || !tilewidth || !tileheight)
+      int tilewidth  = set.tilewidth;
+      int tileheight = set.tileheight;
+      int width      = set.width;
+      int height     = set.height;
+
+      if (width <= 0 || height <= 0 || tilewidth <= 0 || tileheight <= 0 || first_gid <= 0 || first_gid > max_gid)
          throw std::logic_error("Tilemap is malformed.");
 
       SurfaceCache cache;
-      Blit::Surface surf = cache.from_image(Utils::join(dir, "/", source));
+      Blit::Surface surf = cache.from_image(Utils::join(dir, "/", set.image));
 
       if (surf.rect().w != width || surf.rect().h != height)
          throw std::logic_error("Tilemap geometry does not correspond with image values.");
 
-      std::map<std::basic_string<char>, std::basic_string<char> > global_attr = get_attributes(node.child("properties"), "property");
+      const std::map<std::string, std::string>& global_attr = set.attr;
 
-#if 0
-      std::cerr << "Dumping attrs:" << std::endl;
-      for (auto& attr : global_attr)
-         std::cerr << "Found global attr (" << attr.first << " => " << attr.second << ")." << std::endl;
-      std::cerr << "Dumped attrs." << std::endl;
-#endif
+      unsigned last_gid = first_gid + (width / tilewidth) * (height / tileheight);
+      if (last_gid > max_gid + 1u)
+         throw std::logic_error("Tileset has gids out of range.");
+      if (last_gid > m_tiles.size())
+         m_tiles.resize(last_gid);
 
       for (int y = 0; y < height; y += tileheight)
       {
          for (int x = 0; x < width; x += tilewidth, id_cnt++)
          {
-            int id = first_gid + id_cnt;
-            tiles[id] = surf.sub({{x, y}, tilewidth, tileheight});
-            std::copy(global_attr.begin(), global_attr.end(), std::inserter(tiles[id].attr(), tiles[id].attr().begin())); 
+            Tile& tile = m_tiles[first_gid + id_cnt];
+            tile.surf = surf.sub({{x, y}, tilewidth, tileheight});
+            add_properties(tile, global_attr);
          }
       }
 
-      // Load all attributes for a tile into the surface.
-      for (auto tile = node.child("tile"); tile; tile = tile.next_sibling("tile"))
+      // Load all attributes for a tile into its tileset entry.
+      for (auto& tile : set.tiles)
       {
-         int id = first_gid + tile.attribute("id").as_int();
+         if (tile.first > unsigned(max_gid - first_gid))
+            throw std::logic_error("Tile has a gid out of range.");
 
-         std::map<std::basic_string<char>, std::basic_string<char> > attrs = get_attributes(tile.child("properties"), "property");
+         unsigned id = first_gid + tile.first;
+         if (id >= m_tiles.size())
+            m_tiles.resize(id + 1);
+
+         std::map<std::string, std::string> attrs = tile.second;
          std::copy(global_attr.begin(), global_attr.end(), std::inserter(attrs, attrs.begin()));
 
          auto itr = attrs.find("sprite");
 
          if (itr != attrs.end())
-            tiles[id] = cache.from_sprite(Utils::join(dir, "/", itr->second));
+         {
+            m_tiles[id].surf = cache.from_sprite(Utils::join(dir, "/", itr->second));
+            attrs.erase(itr);
+         }
 
-         tiles[id].attr() = std::move(attrs);
+         add_properties(m_tiles[id], attrs);
       }
    }
 
-   void Tilemap::add_layer(std::map<unsigned, Surface>& tiles, xml_node node,
-         int tilewidth, int tileheight)
+   void Tilemap::add_layer(const Source::Layer& source)
    {
       Layer layer;
-      int width  = node.attribute("width").as_int();
-      int height = node.attribute("height").as_int();
-
-      if (!width || !height)
-         throw std::logic_error("Layer is empty.");
-
-#if 0
-      std::cerr << "Adding layer:" <<
-         " Name: " << node.attribute("name").value() <<
-         " Width: " << width <<
-         " Height: " << height << std::endl;
-#endif
-
-      Utils::xml_node_walker walk{node.child("data"), "tile", "gid"};
-      int index = 0;
-      for (auto& gid_str : walk)
+      layer.name    = source.name;
+      layer.attr    = source.attr;
+      layer.dynamic = Utils::tolower(layer.name) == "blocks";
+      layer.gids.resize(width * height);
+
+      for (int index = 0; index < width * height; index++)
       {
+         unsigned gid = source.gids[index];
+         if (!gid)
+            continue;
+
+         if (gid >= m_tiles.size())
+            m_tiles.resize(gid + 1);
+
          Pos pos = Pos(index % width, index / width);
+         const Tile& tile = m_tiles[gid];
 
-         unsigned gid = Utils::stoi(gid_str);
-         if (gid)
+         if (layer.dynamic)
          {
-            Blit::Surface surf = tiles[gid];
+            // Only dynamic objects get a full instance of their own.
+            Blit::Surface surf = tile.surf;
             surf.rect().pos = pos * Pos(tilewidth, tileheight);
-
-            layer.cluster.vec().push_back({surf, Pos()});
-
-            if (Utils::find_or_default(surf.attr(), "collision", "") == "true")
-               collisions.insert(pos);
+            layer.cluster.vec().push_back({surf, Pos(), gid});
          }
+         else
+            layer.gids[index] = gid;
 
-         index++;
+         if (tile.flags & FlagCollision)
+            collisions[index] = true;
+      }
+
+      if (layer.dynamic)
+      {
+         layer.gids.clear();
+         blocks_layer = m_layers.size();
       }
 
-      layer.attr = get_attributes(node.child("properties"), "property");
-      layer.name = node.attribute("name").value();
       m_layers.push_back(std::move(layer));
    }
 
@@ -167,28 +715,122 @@ namespace Blit
       Renderable::pos(position);
    }
 
+   void Tilemap::render_layer(const Layer& layer, RenderTarget& target) const
+   {
+      if (layer.dynamic)
+      {
+         layer.cluster.render(target);
+         return;
+      }
+
+      unsigned index = 0;
+      for (int y = 0; y < height; y++)
+      {
+         for (int x = 0; x < width; x++, index++)
+         {
+            unsigned gid = layer.gids[index];
+            if (gid)
+               target.blit_offset(m_tiles[gid].surf, Rect(), position + Pos(x * tilewidth, y * tileheight));
+         }
+      }
+   }
+
    void Tilemap::render(RenderTarget& target) const
    {
       for (auto& layer : m_layers)
-         layer.cluster.render(target);
+         render_layer(layer, target);
    }
 
    void Tilemap::render_until_layer(unsigned index, RenderTarget& target) const
    {
       for (unsigned i = 0; i <= index; i++)
-         m_layers.at(i).cluster.render(target);
+         render_layer(m_layers.at(i), target);
    }
 
    void Tilemap::render_after_layer(unsigned index, RenderTarget& target) const
    {
       for (unsigned i = index + 1; i < m_layers.size(); i++)
-         m_layers.at(i).cluster.render(target);
+         render_layer(m_layers.at(i), target);
    }
 
    bool Tilemap::collision(Pos tile) const
    {
-      return collisions.count(tile) ||
-         find_tile("blocks", {tile.x * tilewidth, tile.y * tileheight});
+      return static_collision(tile) ||
+         (blocks_layer >= 0 && find_tile(blocks_layer, {tile.x * tilewidth, tile.y * tileheight}));
+   }
+
+   bool Tilemap::static_collision(Pos tile) const
+   {
+      return tile.x >= 0 && tile.y >= 0 && tile.x < width && tile.y < height &&
+         collisions[tile.y * width + tile.x];
+   }
+
+   unsigned Tilemap::gid(unsigned layer_index, Pos tile) const
+   {
+      const Layer& layer = m_layers.at(layer_index);
+      if (tile.x < 0 || tile.y < 0 || tile.x >= width || tile.y >= height)
+         return 0;
+
+      if (!layer.dynamic)
+         return layer.gids[tile.y * width + tile.x];
+
+      Pos offset = tile * Pos(tilewidth, tileheight);
+      for (auto& elem : layer.cluster.vec())
+         if ((elem.surf.rect().pos + elem.offset) == offset)
+            return elem.tag;
+
+      return 0;
+   }
+
+   unsigned Tilemap::tile_flags(unsigned layer, Pos tile) const
+   {
+      unsigned id = gid(layer, tile);
+      return id ? m_tiles[id].flags : 0;
+   }
+
+   std::vector<Pos> Tilemap::find_tiles(unsigned layer_index, unsigned flags) const
+   {
+      std::vector<Pos> tiles;
+      const Layer& layer = m_layers.at(layer_index);
+
+      if (!layer.dynamic)
+      {
+         for (unsigned i = 0; i < layer.gids.size(); i++)
+            if (layer.gids[i] && (m_tiles[layer.gids[i]].flags & flags) == flags)
+               tiles.push_back(Pos(i % width, i / width));
+         return tiles;
+      }
+
+      // Dynamic layers have no gids, their instances are tagged with them instead. As in gid(),
+      // only instances sitting on a tile count.
+      for (auto& elem : layer.cluster.vec())
+      {
+         Pos pos = elem.surf.rect().pos + elem.offset;
+         if (pos.x % tilewidth || pos.y % tileheight)
+            continue;
+
+         Pos tile = Pos(pos.x / tilewidth, pos.y / tileheight);
+         if (tile.x < 0 || tile.y < 0 || tile.x >= width || tile.y >= height)
+            continue;
+
+         if (elem.tag && elem.tag < m_tiles.size() && (m_tiles[elem.tag].flags & flags) == flags)
+            tiles.push_back(tile);
+      }
+
+      return tiles;
+   }
+
+   std::string Tilemap::tile_property(unsigned gid, const std::string& name, const std::string& def) const
+   {
+      auto id = string_ids.find(name);
+      if (id == string_ids.end() || gid >= m_tiles.size())
+         return def;
+
+      for (auto& prop : m_tiles[gid].props)
+         if (prop.first == id->second)
+            return strings[prop.second];
+
+      return def;
    }
 
    Surface* Tilemap::find_tile(unsigned layer_index, Pos offset)
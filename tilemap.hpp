@@ -5,25 +5,61 @@
 #include "pugixml/pugixml.hpp"
 
 #include <string>
-#include <set>
 #include <map>
+#include <vector>
+#include <utility>
+#include <stdint.h>
 
 namespace Blit
 {
    class Tilemap : public Renderable
    {
       public:
+         // Well-known boolean tile properties. These are resolved once per tileset entry
+         // so that game logic never has to compare property strings.
+         enum TileFlag
+         {
+            FlagCollision      = 1 << 0,
+            FlagGoal           = 1 << 1,
+            FlagSlipperyPlayer = 1 << 2,
+            FlagSlipperyBlock  = 1 << 3
+         };
+
+         // One entry per gid. Every cell referring to a gid shares this.
+         struct Tile
+         {
+            Tile() : flags(0) {}
+
+            Surface surf;
+            unsigned flags;
+            std::vector<std::pair<unsigned, unsigned>> props; // Interned (name, value) ids for everything else.
+         };
+
          struct Layer
          {
+            Layer() : dynamic(false) {}
+
+            // Static layers only store a gid per cell (0 is empty).
+            // Dynamic layers (e.g. pushable blocks) hold full instances in cluster instead,
+            // where Elem::tag is the gid of the instance.
+            std::vector<uint16_t> gids;
             SurfaceCluster cluster;
             std::map<std::string, std::string> attr;
             std::string name;
+            bool dynamic;
          };
 
          Tilemap()
          {
          }
-         Tilemap(const std::string& path);
+
+         // Loads the compiled level next to a TMX map instead of the map itself, if it's there
+         // and was compiled from the same TMX, unless allow_compiled is false.
+         Tilemap(const std::string& path, bool allow_compiled = true);
+
+         // Compiles a TMX map to the binary level format, which loads without any XML parsing.
+         static void compile(const std::string& tmx_path, const std::string& out_path);
+         static std::string compiled_path(const std::string& tmx_path);
 
          std::vector<Layer>& layers() { return m_layers; }
          const std::vector<Layer>& layers() const { return m_layers; }
@@ -40,6 +76,12 @@ namespace Blit
          int pix_width() const { return width * tilewidth; }
          int pix_height() const { return height * tileheight; }
 
+         const Tile& tile(unsigned gid) const { return m_tiles.at(gid); }
+         unsigned gid(unsigned layer, Pos tile) const;
+         unsigned tile_flags(unsigned layer, Pos tile) const;
+         std::vector<Pos> find_tiles(unsigned layer, unsigned flags) const;
+         std::string tile_property(unsigned gid, const std::string& name, const std::string& def = "") const;
+
          const Surface* find_tile(unsigned layer, Pos pos) const;
          const Surface* find_tile(const std::string& name, Pos pos) const;
          Surface* find_tile(unsigned layer, Pos pos);
@@ -49,22 +91,55 @@ namespace Blit
          Layer* find_layer(const std::string& name);
 
          bool collision(Pos tile) const;
+         bool static_collision(Pos tile) const;
 
       private:
          std::vector<Layer> m_layers;
-         std::set<Pos> collisions;
+         std::vector<Tile> m_tiles;
+         std::vector<bool> collisions;
+         int blocks_layer;
+
+         std::vector<std::string> strings;
+         std::map<std::string, unsigned> string_ids;
+         unsigned intern(const std::string& str);
 
          int width, height, tilewidth, tileheight;
          std::string dir;
 
-         void add_tileset(std::map<unsigned, Surface>& tiles,
-               pugi::xml_node node);
-         void add_layer(std::map<unsigned, Surface>& tiles,
-               pugi::xml_node node, int tilewidth, int tileheight);
+         // What a map describes, read from either TMX or a compiled level.
+         struct Source
+         {
+            struct Tileset
+            {
+               int first_gid, tilewidth, tileheight, width, height;
+               std::string image;
+               std::map<std::string, std::string> attr;
+               std::vector<std::pair<unsigned, std::map<std::string, std::string>>> tiles; // Local id, properties.
+            };
 
-         std::map<std::string, std::string> get_attributes(pugi::xml_node, const std::string& child) const;
+            struct Layer
+            {
+               std::string name;
+               std::map<std::string, std::string> attr;
+               std::vector<uint16_t> gids;
+            };
+
+            int width, height, tilewidth, tileheight;
+            std::vector<Tileset> tilesets;
+            std::vector<Layer> layers;
+         };
+
+         static Source read_tmx(const std::string& path);
+         static void read_layer_data(pugi::xml_node data, std::vector<uint16_t>& gids);
+         static bool read_compiled(const std::string& path, const std::string& tmx_path, Source& source);
+
+         void add_tileset(const Source::Tileset& set);
+         void add_layer(const Source::Layer& layer);
+         void add_properties(Tile& tile, const std::map<std::string, std::string>& attrs);
+         void render_layer(const Layer& layer, RenderTarget& target) const;
+
+         static std::map<std::string, std::string> get_attributes(pugi::xml_node, const std::string& child);
    };
 }
 
 #endif
-
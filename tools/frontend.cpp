@@ -0,0 +1,27 @@
+// Stand-in for the globals libretro.cpp provides to the core.
+
+#include "frontend.hpp"
+#include "../game.hpp"
+
+using namespace Icy;
+using namespace std;
+
+static Audio::Mixer mixer;
+static SFXManager sfx;
+static BGManager bg_music;
+static string game_path_dir;
+
+retro_log_printf_t log_cb;
+
+namespace Icy
+{
+   Audio::Mixer& get_mixer() { return mixer; }
+   const string& get_basedir() { return game_path_dir; }
+   SFXManager& get_sfx() { return sfx; }
+   BGManager& get_bg() { return bg_music; }
+}
+
+void set_basedir(const string& dir)
+{
+   game_path_dir = dir;
+}
@@ -0,0 +1,9 @@
+#ifndef TOOLS_FRONTEND_HPP__
+#define TOOLS_FRONTEND_HPP__
+
+#include <string>
+
+// What libretro.cpp provides to the core, for tools which run it without a frontend.
+void set_basedir(const std::string& dir);
+
+#endif
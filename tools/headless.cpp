@@ -0,0 +1,376 @@
+// Headless batch runner for Dinothawr.
+// Loads a .game file without a libretro frontend, then plays every level with
+// scripted or pseudo-random input and reports throughput and allocation figures.
+// Other modes play through the whole game to check save states and rewind, or record
+// and replay input, or time parts of the game. Those live in headless_*.cpp.
+
+#include "headless.hpp"
+#include "../asset_pack.hpp"
+#include "../disk_cache.hpp"
+#include "../utils.hpp"
+#include "frontend.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <atomic>
+
+using namespace Icy;
+using namespace std;
+
+struct LevelResult
+{
+   LevelResult() : load_time(0.0), run_time(0.0), ticks(0), frames(0), wins(0), load_allocs(0), run_allocs(0) {}
+
+   string path;
+   string error;
+   double load_time;
+   double run_time;
+   uint64_t ticks;
+   uint64_t frames;
+   unsigned wins;
+   uint64_t load_allocs;
+   uint64_t run_allocs;
+};
+
+static LevelResult run_level(const string& path, const vector<ScriptEntry>& script, const Options& opts)
+{
+   LevelResult res;
+   res.path = path;
+
+   try
+   {
+      uint64_t allocs = thread_allocations();
+      Clock::time_point start = Clock::now();
+
+      Game game(path);
+      const GameState initial = game.get_state();
+      uint64_t checksum = 0;
+      game.video_cb([&checksum](const void *data, unsigned, unsigned height, size_t pitch) {
+            checksum += reinterpret_cast<const uint32_t*>(data)[(height / 2) * (pitch / 4)];
+         });
+
+      res.load_time   = seconds_since(start);
+      res.load_allocs = thread_allocations() - allocs;
+
+      allocs = thread_allocations();
+      start  = Clock::now();
+
+      ScriptCursor cursor(script);
+      for (unsigned frame = 0; frame < opts.frames; frame++)
+      {
+         game.simulate(cursor.next());
+         res.ticks++;
+
+         if (opts.render)
+         {
+            game.render();
+            res.frames++;
+         }
+
+         if (game.won())
+         {
+            res.wins++;
+            game.set_state(initial);
+         }
+      }
+
+      res.run_time   = seconds_since(start);
+      res.run_allocs = thread_allocations() - allocs;
+   }
+   catch (const exception& e)
+   {
+      res.error = e.what();
+   }
+
+   return res;
+}
+
+// Shows when and on which thread each job loading the game ran, then where the time went.
+static void print_timeline(const vector<Blit::JobPool::Span>& spans)
+{
+   const unsigned columns = 60;
+   double end = 0.0;
+   unsigned threads = 0;
+   for (auto& span : spans)
+   {
+      end     = max(end, span.end);
+      threads = max(threads, span.thread + 1);
+   }
+
+   printf("Load timeline, %u jobs on %u threads (0 is the main thread), %.1f ms until the last one finished:\n",
+         static_cast<unsigned>(spans.size()), threads, end);
+   printf("%-24s %6s %8s %8s  |%s|\n", "Job", "Thread", "Start ms", "Time ms", string(columns, ' ').c_str());
+
+   for (auto& span : spans)
+   {
+      unsigned first = unsigned(span.start / end * columns);
+      unsigned last  = max(first + 1, unsigned(span.end / end * columns + 0.5));
+      last = min(last, columns);
+
+      string bar(columns, ' ');
+      bar.replace(first, last - first, last - first, '#');
+      printf("%-24s %6u %8.2f %8.2f  |%s|\n", span.name.c_str(), span.thread, span.start, span.end - span.start, bar.c_str());
+   }
+
+   // Totals by kind of job, the first word of their names, and by thread.
+   vector<pair<string, double>> kinds;
+   vector<double> busy(threads);
+   for (auto& span : spans)
+   {
+      string kind = span.name.substr(0, span.name.find(' '));
+      auto itr = find_if(begin(kinds), std::end(kinds), [&kind](const pair<string, double>& k) { return k.first == kind; });
+      if (itr == kinds.end())
+      {
+         kinds.push_back({kind, 0.0});
+         itr = kinds.end() - 1;
+      }
+      itr->second += span.end - span.start;
+      busy[span.thread] += span.end - span.start;
+   }
+
+   printf("Time by job:");
+   for (auto& kind : kinds)
+      printf(" %s %.2f ms,", kind.first.c_str(), kind.second);
+   printf("\nBusy by thread:");
+   for (unsigned i = 0; i < threads; i++)
+      printf(" %u: %.0f%%%s", i, 100.0 * busy[i] / end, i + 1 < threads ? "," : "\n");
+}
+
+static void print_image_cache()
+{
+   Blit::SurfaceCache::Stats stats = Blit::SurfaceCache::stats();
+   printf("Image cache: %llu hits, %llu misses, %llu evictions, %u images and %u sprites alive, %.2f of %.2f MB held.\n",
+         static_cast<unsigned long long>(stats.hits), static_cast<unsigned long long>(stats.misses),
+         static_cast<unsigned long long>(stats.evictions), static_cast<unsigned>(stats.images),
+         static_cast<unsigned>(stats.sprites),
+         stats.bytes / (1024.0 * 1024.0), stats.budget / (1024.0 * 1024.0));
+}
+
+static void usage(const char *argv0)
+{
+   fprintf(stderr, "Usage: %s [options] <path/to/dinothawr.game | dinothawr.pack>\n", argv0);
+   fprintf(stderr, "  --frames N    Frames to simulate per level (default: 36000).\n");
+   fprintf(stderr, "  --script FILE Input script, \"<frames> <button>[+<button>]\" per line.\n");
+   fprintf(stderr, "                Seeded random input is used if no script is given.\n");
+   fprintf(stderr, "  --seed N      Seed for random input (default: 1).\n");
+   fprintf(stderr, "  --render      Render every simulated frame.\n");
+   fprintf(stderr, "  --threads N   Number of levels to run concurrently (default: all cores).\n");
+   fprintf(stderr, "  --level NAME  Only run levels whose path contains NAME.\n");
+   fprintf(stderr, "  --savestates  Play through the whole game instead, checking that save states\n");
+   fprintf(stderr, "                restore deterministically, and time them.\n");
+   fprintf(stderr, "  --rewind MB   Play through the whole game recording rewind history into MB of memory,\n");
+   fprintf(stderr, "                then rewind it, checking every state and the recording overhead.\n");
+   fprintf(stderr, "  --record FILE Play through the whole game, recording input and state checksums to FILE.\n");
+   fprintf(stderr, "  --replay FILE Replay a recording without rendering, stopping at the first divergent frame.\n");
+   fprintf(stderr, "  --cache DIR   Keep decoded images and level previews in DIR between runs.\n");
+   fprintf(stderr, "  --startup     Time startup without the cache, with an empty one and a filled one.\n");
+   fprintf(stderr, "  --image-budget MB  Memory the image cache keeps for images nothing uses.\n");
+   fprintf(stderr, "  --latency N   Measure frames from input to visible change with run-ahead 0 to N.\n");
+   fprintf(stderr, "  --timeline    Show when and on which thread each job loading the game ran.\n");
+   fprintf(stderr, "  --sprites N   Time loading every sprite from files, then N times over from the cache.\n");
+   fprintf(stderr, "  --music       Compare peak memory and latency of streaming background music against\n");
+   fprintf(stderr, "                decoding whole tracks.\n");
+   fprintf(stderr, "  --sfx N       Trigger N sound effects a second against an audio thread for 5 seconds,\n");
+   fprintf(stderr, "                timing the audio callback and checking every stream is freed.\n");
+   fprintf(stderr, "  --mix         Check the mixer against per-voice mixing and time both with up to 256 voices.\n");
+   fprintf(stderr, "  --transitions DIR  Play through the whole game with the solutions in DIR and time\n");
+   fprintf(stderr, "                level changes with and without prefetching the next level.\n");
+}
+
+// Index of the option called name in table, or -1.
+template <typename Table>
+static int find_option(const Table& table, const string& name)
+{
+   for (auto itr = begin(table); itr != end(table); ++itr)
+      if (name == itr->name)
+         return itr - begin(table);
+   return -1;
+}
+
+static bool parse_options(int argc, char *argv[], Options& opts)
+{
+   const struct { const char *name; bool *value; } flags[] = {
+      { "--render", &opts.render }, { "--savestates", &opts.savestates }, { "--startup", &opts.startup },
+      { "--timeline", &opts.timeline }, { "--music", &opts.music }, { "--mix", &opts.mix },
+   };
+   const struct { const char *name; unsigned *value; } numbers[] = {
+      { "--frames", &opts.frames }, { "--seed", &opts.seed }, { "--rewind", &opts.rewind },
+      { "--sfx", &opts.sfx }, { "--sprites", &opts.sprites }, { "--threads", &opts.threads },
+   };
+   const struct { const char *name; int *value; } signed_numbers[] = {
+      { "--image-budget", &opts.image_budget }, { "--latency", &opts.latency },
+   };
+   const struct { const char *name; string *value; } strings[] = {
+      { "--script", &opts.script }, { "--record", &opts.record }, { "--replay", &opts.replay },
+      { "--cache", &opts.cache }, { "--transitions", &opts.transitions }, { "--level", &opts.filter },
+   };
+
+   for (int i = 1; i < argc; i++)
+   {
+      string arg = argv[i];
+      bool has_value = i + 1 < argc;
+      int index;
+
+      if ((index = find_option(flags, arg)) >= 0)
+         *flags[index].value = true;
+      else if (has_value && (index = find_option(numbers, arg)) >= 0)
+         *numbers[index].value = strtoul(argv[++i], NULL, 0);
+      else if (has_value && (index = find_option(signed_numbers, arg)) >= 0)
+         *signed_numbers[index].value = strtol(argv[++i], NULL, 0);
+      else if (has_value && (index = find_option(strings, arg)) >= 0)
+         *strings[index].value = argv[++i];
+      else if (arg[0] != '-' && opts.game.empty())
+         opts.game = arg;
+      else
+         return false;
+   }
+
+   if (!opts.threads)
+      opts.threads = 1;
+
+   return !opts.game.empty();
+}
+
+int main(int argc, char *argv[])
+{
+   Options opts;
+   if (!parse_options(argc, argv, opts))
+   {
+      usage(argv[0]);
+      return 1;
+   }
+
+   try
+   {
+      opts.game = Blit::AssetPack::mount_content(opts.game);
+      set_basedir(Blit::Utils::basedir(opts.game));
+
+      if (opts.image_budget >= 0)
+         Blit::SurfaceCache::set_budget(size_t(opts.image_budget) << 20);
+
+      if (opts.startup)
+         return check_startup(opts) ? 0 : 1;
+      if (!opts.cache.empty())
+         Blit::DiskCache::set(make_shared<Blit::DiskCache>(opts.cache));
+      if (!opts.transitions.empty())
+         return check_transitions(opts, opts.transitions) ? 0 : 1;
+      if (opts.sprites)
+         return time_sprites(opts) ? 0 : 1;
+      if (opts.music)
+         return check_music(opts) ? 0 : 1;
+      if (opts.sfx)
+         return stress_mixer(opts) ? 0 : 1;
+      if (opts.mix)
+         return time_mixing(opts) ? 0 : 1;
+
+      uint64_t allocs = thread_allocations();
+      Clock::time_point start = Clock::now();
+      Session session(opts.game, true);
+      GameManager& manager = session.manager;
+      double manager_time = seconds_since(start);
+      uint64_t manager_allocs = thread_allocations() - allocs;
+
+      // Menus look different until every preview is in, which would upset the video hashes.
+      start = Clock::now();
+      manager.wait_for_previews();
+      double preview_time = seconds_since(start);
+
+      // The checks compare runs frame by frame, which they can't if a level transition takes longer
+      // when the next level loads slowly. Recording goes about it the way the core does.
+      if (opts.record.empty())
+         manager.level_handoff(GameManager::Handoff::Wait);
+
+      printf("Loaded %s in %.1f ms (%llu allocations), level previews ready %.1f ms later.\n", opts.game.c_str(),
+            manager_time * 1000.0, static_cast<unsigned long long>(manager_allocs), preview_time * 1000.0);
+
+      if (Blit::DiskCache *cache = Blit::DiskCache::get())
+      {
+         Blit::DiskCache::Stats stats = cache->stats();
+         printf("Disk cache %s: %u hits, %u misses, %u stale, %u stored.\n", cache->directory().c_str(),
+               stats.hits, stats.misses, stats.stale, stats.stores);
+      }
+
+      if (opts.timeline)
+      {
+         print_timeline(manager.load_timeline());
+         return 0;
+      }
+      if (opts.savestates)
+         return check_savestates(session, opts) ? 0 : 1;
+      if (opts.rewind)
+         return check_rewind(session, opts) ? 0 : 1;
+      if (!opts.record.empty())
+         return record_session(session, opts) ? 0 : 1;
+      if (!opts.replay.empty())
+         return replay_session(session, opts) ? 0 : 1;
+      if (opts.latency >= 0)
+         return check_latency(session, opts) ? 0 : 1;
+
+      vector<string> paths;
+      for (auto& path : manager.level_paths())
+         if (path.find(opts.filter) != string::npos)
+            paths.push_back(path);
+
+      vector<ScriptEntry> script = options_script(opts);
+
+      vector<LevelResult> results(paths.size());
+      atomic<unsigned> next_level(0);
+      vector<thread> workers;
+
+      start = Clock::now();
+      for (unsigned i = 0; i < min<unsigned>(opts.threads, paths.size()); i++)
+      {
+         workers.push_back(thread([&]() {
+                  unsigned index;
+                  while ((index = next_level.fetch_add(1)) < paths.size())
+                     results[index] = run_level(paths[index], script, opts);
+               }));
+      }
+
+      for (auto& worker : workers)
+         worker.join();
+      double wall_time = seconds_since(start);
+
+      printf("%-32s %9s %10s %12s %10s %5s %11s %11s\n",
+            "Level", "Load ms", "Ticks", "Ticks/s", "Frames/s", "Wins", "Load allocs", "Run allocs");
+
+      unsigned failed = 0;
+      uint64_t total_ticks = 0;
+      uint64_t total_frames = 0;
+      for (auto& res : results)
+      {
+         if (!res.error.empty())
+         {
+            printf("%-32s FAILED: %s\n", res.path.c_str(), res.error.c_str());
+            failed++;
+            continue;
+         }
+
+         printf("%-32s %9.2f %10llu %12.0f %10.0f %5u %11llu %11llu\n",
+               res.path.c_str(), res.load_time * 1000.0,
+               static_cast<unsigned long long>(res.ticks),
+               res.ticks / res.run_time,
+               res.frames / res.run_time,
+               res.wins,
+               static_cast<unsigned long long>(res.load_allocs),
+               static_cast<unsigned long long>(res.run_allocs));
+
+         total_ticks  += res.ticks;
+         total_frames += res.frames;
+      }
+
+      printf("Ran %u levels on %u threads in %.2f s: %.0f ticks/s, %.0f frames/s, %llu allocations in total.\n",
+            static_cast<unsigned>(paths.size()), opts.threads, wall_time,
+            total_ticks / wall_time, total_frames / wall_time,
+            static_cast<unsigned long long>(total_allocations()));
+      print_image_cache();
+
+      return failed ? 1 : 0;
+   }
+   catch (const exception& e)
+   {
+      fprintf(stderr, "Fatal: %s\n", e.what());
+      return 1;
+   }
+}
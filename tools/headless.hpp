@@ -0,0 +1,179 @@
+#ifndef TOOLS_HEADLESS_HPP__
+#define TOOLS_HEADLESS_HPP__
+
+// What the headless runner's modes share: options, input scripts, timing and allocation figures,
+// and a game set up the way a frontend would. Each mode lives in its own headless_*.cpp.
+
+#include "../game.hpp"
+
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct Options
+{
+   Options() : frames(60 * 60 * 10), seed(1), render(false), savestates(false), rewind(0), latency(-1), startup(false), image_budget(-1),
+      threads(std::thread::hardware_concurrency()), timeline(false), sprites(0), music(false), sfx(0), mix(false) {}
+
+   std::string game;
+   std::string script;
+   std::string filter;
+   unsigned frames;
+   unsigned seed;
+   bool render;
+   bool savestates;
+   unsigned rewind; // MiB
+   int latency; // Highest run-ahead to measure, or negative.
+   std::string record;
+   std::string replay;
+   std::string cache;
+   bool startup;
+   int image_budget; // MiB, or negative for the default.
+   unsigned threads;
+   std::string transitions; // Directory with a solution script per level.
+   bool timeline;
+   unsigned sprites; // Times to load every sprite over.
+   bool music;
+   unsigned sfx; // Sound effects to trigger per second.
+   bool mix;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+inline double seconds_since(Clock::time_point start)
+{
+   return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Seconds it takes to call func iterations times.
+template <typename Func>
+double time_calls(unsigned iterations, Func func)
+{
+   Clock::time_point start = Clock::now();
+   for (unsigned i = 0; i < iterations; i++)
+      func();
+   return seconds_since(start);
+}
+
+// Calls func over and over for at least seconds, returns how often and how long that took exactly.
+template <typename Func>
+unsigned calls_within(double seconds, Func func, double& elapsed)
+{
+   unsigned calls = 0;
+   Clock::time_point start = Clock::now();
+   for (; seconds_since(start) < seconds; calls++)
+      func();
+   elapsed = seconds_since(start);
+   return calls;
+}
+
+// Count, sum and worst of a series of timings, in whatever unit they're added in.
+struct TimeStats
+{
+   TimeStats() : count(0), total(0.0), max(0.0) {}
+
+   void add(double time)
+   {
+      count++;
+      total += time;
+      max = std::max(max, time);
+   }
+
+   double average() const { return count ? total / count : 0.0; }
+
+   unsigned count;
+   double total, max;
+};
+
+// Allocations made so far by the calling thread, and by every thread.
+uint64_t thread_allocations();
+uint64_t total_allocations();
+
+// Highest resident memory of the process so far, in MB.
+double peak_memory();
+
+// FNV-1a over 32-bit words, sizes are always a multiple of 4 here.
+uint64_t hash_bytes(const void *data, std::size_t size, uint64_t hash = 0xcbf29ce484222325ull);
+
+struct ScriptEntry
+{
+   unsigned frames;
+   unsigned input;
+};
+
+// Script format: one "<frames> <button>[+<button>...]" pair per line, '#' starts a comment.
+// Buttons are up, down, left, right, push or none. The script loops when exhausted.
+std::vector<ScriptEntry> load_script(const std::string& path);
+
+// Holds a random button for a random amount of frames, similar to a player mashing buttons.
+// Picks from the first buttons Input values, or nothing.
+std::vector<ScriptEntry> random_script(unsigned seed, unsigned frames, unsigned buttons = 5);
+
+// The script given with --script, or random input for opts.frames from opts.seed.
+std::vector<ScriptEntry> options_script(const Options& opts, unsigned buttons = 5);
+
+// Steps through a script one frame at a time, looping when it runs out.
+class ScriptCursor
+{
+   public:
+      ScriptCursor(const std::vector<ScriptEntry>& script) : script(script), entry(script.begin()), held(0) {}
+
+      unsigned next()
+      {
+         if (held >= entry->frames)
+         {
+            held = 0;
+            if (++entry == script.end())
+               entry = script.begin();
+         }
+         held++;
+
+         return entry->input;
+      }
+
+   private:
+      const std::vector<ScriptEntry>& script;
+      std::vector<ScriptEntry>::const_iterator entry;
+      unsigned held;
+};
+
+// The whole game, fed input from a mask the mode sets before each frame. Rendered frames are
+// hashed into video_hash if asked to, so modes can compare what was shown.
+struct Session
+{
+   Session(const std::string& game, bool hash_video);
+
+   unsigned input;
+   uint64_t video_hash;
+   Icy::GameManager manager;
+};
+
+// Modes, each returning whether its checks passed.
+
+// headless_states.cpp
+bool check_savestates(Session& session, const Options& opts);
+bool check_rewind(Session& session, const Options& opts);
+bool record_session(Session& session, const Options& opts);
+bool replay_session(Session& session, const Options& opts);
+
+// headless_latency.cpp
+bool check_latency(Session& session, const Options& opts);
+
+// headless_transitions.cpp
+bool check_transitions(const Options& opts, const std::string& dir);
+
+// headless_startup.cpp
+bool check_startup(const Options& opts);
+
+// headless_sprites.cpp
+bool time_sprites(const Options& opts);
+
+// headless_audio.cpp
+bool check_music(const Options& opts);
+bool stress_mixer(const Options& opts);
+bool time_mixing(const Options& opts);
+
+#endif
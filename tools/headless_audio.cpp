@@ -0,0 +1,283 @@
+// Modes checking music streaming, the mixer under load and the cost of mixing.
+
+#include "headless.hpp"
+#include "../asset_pack.hpp"
+#include "../utils.hpp"
+
+#include <audio/audio_mix.h>
+#include <audio/conversion/float_to_s16.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <atomic>
+
+using namespace Icy;
+using namespace std;
+
+static void load_game_xml(pugi::xml_document& doc, const Options& opts)
+{
+   if (!Blit::AssetPack::load_xml(doc, opts.game))
+      throw runtime_error(Blit::Utils::join("Failed to load game: ", opts.game, "."));
+}
+
+struct TrackTime
+{
+   string path;
+   double seconds;
+   double first_audio; // ms
+   size_t buffer_bytes;
+   double decode; // ms
+   size_t decoded_bytes;
+};
+
+// Plays every background track through a stream as fast as it decodes, then decodes each whole the
+// way the game used to, and reports how far each way pushed up peak memory.
+bool check_music(const Options& opts)
+{
+   pugi::xml_document doc;
+   load_game_xml(doc, opts);
+
+   vector<TrackTime> tracks;
+   for (auto& source : Blit::Utils::xml_node_walker(doc.child("game").child("music"), "bg", "source"))
+   {
+      TrackTime track = TrackTime();
+      track.path = Blit::Utils::join(Blit::Utils::basedir(opts.game), "/", source);
+      tracks.push_back(track);
+   }
+
+   double baseline = peak_memory();
+   for (auto& track : tracks)
+   {
+      float buffer[735 * Audio::Mixer::channels];
+      size_t frames = 0;
+
+      Clock::time_point start = Clock::now();
+      Audio::VorbisStream stream(track.path);
+      while (stream.valid())
+      {
+         size_t rendered = stream.render(buffer, 735);
+         if (rendered && !frames)
+            track.first_audio = seconds_since(start) * 1000.0;
+         if (!rendered)
+            this_thread::yield();
+         frames += rendered;
+      }
+
+      track.seconds      = frames / 44100.0;
+      track.buffer_bytes = stream.buffer_bytes();
+   }
+   double streamed = peak_memory();
+
+   for (auto& track : tracks)
+   {
+      vector<float> pcm;
+      track.decode        = time_calls(1, [&] { pcm = Audio::VorbisFile(track.path).decode(); }) * 1000.0;
+      track.decoded_bytes = pcm.capacity() * sizeof(float);
+   }
+   double decoded = peak_memory();
+
+   printf("Track                            Length s  First audio ms  Buffer KB  Decode ms  Decoded MB\n");
+   for (auto& track : tracks)
+      printf("%-32s %8.1f %15.2f %10.1f %10.1f %11.2f\n", track.path.c_str(), track.seconds, track.first_audio,
+            track.buffer_bytes / 1024.0, track.decode, track.decoded_bytes / (1024.0 * 1024.0));
+
+   printf("Peak memory: %.2f MB before any music, %.2f MB after streaming every track, "
+         "%.2f MB after decoding each whole.\n", baseline, streamed, decoded);
+   return true;
+}
+
+// Audio callback timings, in us.
+struct CallbackTime : TimeStats
+{
+   CallbackTime() : late(0) {}
+
+   unsigned late; // Took longer than the audio they rendered lasts.
+
+   void add(double us, double period)
+   {
+      TimeStats::add(us);
+      if (us > period)
+         late++;
+   }
+};
+
+// Triggers the game's sound effects rate times a second along with the background music, while
+// another thread renders audio like a frontend's audio callback, then checks every stream got freed.
+bool stress_mixer(const Options& opts)
+{
+   pugi::xml_document doc;
+   load_game_xml(doc, opts);
+
+   vector<string> effects;
+   vector<BGManager::Track> tracks;
+   string dir = Blit::Utils::basedir(opts.game);
+   for (auto sound = doc.child("game").child("sfx").child("sound"); sound; sound = sound.next_sibling("sound"))
+   {
+      get_sfx().add_stream(sound.attribute("name").value(),
+            Blit::Utils::join(dir, "/", sound.attribute("source").value()));
+      effects.push_back(sound.attribute("name").value());
+   }
+   for (auto& source : Blit::Utils::xml_node_walker(doc.child("game").child("music"), "bg", "source"))
+      tracks.push_back({Blit::Utils::join(dir, "/", source), 1.0f});
+   get_bg().init(tracks);
+
+   if (effects.empty())
+      throw runtime_error("The game has no sound effects.");
+
+   const unsigned frames  = 512;
+   const double period    = frames * 1e6 / 44100.0;
+   const double seconds   = 5.0;
+   Audio::Mixer& mixer    = get_mixer();
+   mixer.enable(true);
+
+   atomic<bool> stop(false);
+   CallbackTime render;
+   thread audio([&] {
+      int16_t buffer[frames * Audio::Mixer::channels];
+      Clock::time_point next = Clock::now();
+      while (!stop)
+      {
+         render.add(time_calls(1, [&] { mixer.render(buffer, frames); }) * 1e6, period);
+
+         next += chrono::microseconds(static_cast<int64_t>(period));
+         this_thread::sleep_until(next);
+      }
+   });
+
+   CallbackTime play;
+   unsigned triggered = 0;
+   Clock::time_point start = Clock::now();
+   for (double elapsed = 0.0; elapsed < seconds; elapsed = seconds_since(start))
+   {
+      get_bg().step(mixer);
+      for (; triggered < elapsed * opts.sfx; triggered++)
+      {
+         const string& name = effects[triggered % effects.size()];
+         play.add(time_calls(1, [&] { get_sfx().play_sfx(name, 0.5f); }) * 1e6, period);
+      }
+      this_thread::sleep_for(chrono::milliseconds(1));
+   }
+
+   Audio::Mixer::Stats playing = mixer.stats();
+   mixer.clear();
+   this_thread::sleep_for(chrono::microseconds(static_cast<int64_t>(3 * period)));
+   stop = true;
+   audio.join();
+   mixer.collect();
+   Audio::Mixer::Stats after = mixer.stats();
+
+   printf("Triggered %u sound effects in %.1f s (%u a second), %u dropped, at most %u streams at once.\n",
+         triggered, seconds, opts.sfx, after.dropped, after.peak_voices);
+   printf("%-14s %7s %8s %8s %6s\n", "", "Calls", "Avg us", "Max us", "Late");
+   printf("%-14s %7u %8.2f %8.2f %6u\n", "Audio render", render.count, render.average(), render.max, render.late);
+   printf("%-14s %7u %8.2f %8.2f %6u\n", "play_sfx", play.count, play.average(), play.max, play.late);
+   printf("Streams held: %u while playing, %u after clearing.\n",
+         static_cast<unsigned>(playing.streams), static_cast<unsigned>(after.streams));
+
+   return !after.streams;
+}
+
+// Loops the game's sound effects, each voice a different one at a different volume.
+static void add_voices(Audio::Mixer *mixer, vector<shared_ptr<Audio::Stream>>& voices,
+      const vector<shared_ptr<const Audio::PCM>>& effects, unsigned count)
+{
+   for (unsigned i = 0; i < count; i++)
+   {
+      auto voice = make_shared<Audio::PCMStream>(effects[i % effects.size()]);
+      voice->loop(true);
+      voice->volume(0.25f + 0.5f * (i % 7) / 6.0f);
+      voices.push_back(voice);
+      if (mixer)
+         mixer->add_stream(voice);
+   }
+}
+
+// How the mixer used to do it: a pass over the output per voice, then another to convert.
+static void reference_mix(vector<shared_ptr<Audio::Stream>>& voices, float master, int16_t *out, size_t frames)
+{
+   static float buffer[512 * Audio::Mixer::channels];
+   static float mixed[512 * Audio::Mixer::channels];
+   fill(begin(mixed), end(mixed), 0.0f);
+   for (auto& voice : voices)
+   {
+      size_t rendered = voice->render(buffer, frames);
+      audio_mix_volume(mixed, buffer, master * voice->volume(), rendered * Audio::Mixer::channels);
+   }
+   convert_float_to_s16(out, mixed, frames * Audio::Mixer::channels);
+}
+
+// Mixes looping sound effects 512 frames at a time, like the core's audio callback, and reports how
+// many voices a millisecond of mixing gets through. Checks the output against the old way first.
+bool time_mixing(const Options& opts)
+{
+   pugi::xml_document doc;
+   load_game_xml(doc, opts);
+
+   vector<shared_ptr<const Audio::PCM>> effects;
+   size_t stored = 0, expanded = 0;
+   for (auto sound = doc.child("game").child("sfx").child("sound"); sound; sound = sound.next_sibling("sound"))
+   {
+      auto pcm = make_shared<Audio::PCM>(Audio::WAVFile::load_wave(
+                  Blit::Utils::join(Blit::Utils::basedir(opts.game), "/", sound.attribute("source").value())));
+      stored   += pcm->samples.size() * sizeof(int16_t);
+      expanded += pcm->frames() * Audio::Mixer::channels * sizeof(float);
+      effects.push_back(pcm);
+   }
+   if (effects.empty())
+      throw runtime_error("The game has no sound effects.");
+
+   printf("%u sound effects take %.1f KB as stored, %.1f KB as stereo float.\n", static_cast<unsigned>(effects.size()),
+         stored / 1024.0, expanded / 1024.0);
+
+   const unsigned frames = 512;
+   const float master    = 0.8f;
+   int16_t out[frames * Audio::Mixer::channels], expected[frames * Audio::Mixer::channels];
+
+   {
+      Audio::Mixer mixer;
+      mixer.master_volume(master);
+      vector<shared_ptr<Audio::Stream>> voices, reference;
+      add_voices(&mixer, voices, effects, 64);
+      add_voices(nullptr, reference, effects, 64);
+
+      int worst = 0;
+      for (unsigned i = 0; i < 1000; i++)
+      {
+         mixer.render(out, frames);
+         reference_mix(reference, master, expected, frames);
+         for (unsigned j = 0; j < frames * Audio::Mixer::channels; j++)
+            worst = max(worst, abs(out[j] - expected[j]));
+      }
+
+      if (worst > 1)
+      {
+         fprintf(stderr, "Mixed output is off by up to %d from the reference.\n", worst);
+         return false;
+      }
+   }
+
+   printf("%-7s %12s %12s %12s %12s %10s\n", "Voices", "Callback us", "Voices/ms", "Before us", "Before/ms", "Allocs");
+   for (unsigned count : {1u, 8u, 32u, 128u, 256u})
+   {
+      Audio::Mixer mixer;
+      mixer.master_volume(master);
+      vector<shared_ptr<Audio::Stream>> voices, reference;
+      add_voices(&mixer, voices, effects, count);
+      add_voices(nullptr, reference, effects, count);
+      mixer.render(out, frames);
+
+      double mixed, before;
+      uint64_t allocs = thread_allocations();
+      unsigned calls = calls_within(0.5, [&] { mixer.render(out, frames); }, mixed);
+      allocs = thread_allocations() - allocs;
+      unsigned before_calls = calls_within(0.5, [&] { reference_mix(reference, master, expected, frames); }, before);
+      mixed  *= 1000.0;
+      before *= 1000.0;
+
+      printf("%-7u %12.2f %12.0f %12.2f %12.0f %10.2f\n", count, mixed * 1000.0 / calls, count * calls / mixed,
+            before * 1000.0 / before_calls, count * before_calls / before, double(allocs) / calls);
+   }
+
+   return true;
+}
@@ -0,0 +1,154 @@
+// Helpers every mode of the headless runner shares.
+
+#include "headless.hpp"
+#include "../utils.hpp"
+
+#include <stdlib.h>
+#include <sys/resource.h>
+
+#include <atomic>
+#include <fstream>
+#include <new>
+#include <sstream>
+
+using namespace Icy;
+using namespace std;
+
+// Allocation accounting. Every thread counts its own allocations so that
+// per-level figures are not polluted by other workers.
+static atomic<uint64_t> total_allocs;
+static thread_local uint64_t thread_allocs;
+
+void* operator new(size_t size)
+{
+   thread_allocs++;
+   total_allocs.fetch_add(1, memory_order_relaxed);
+   void *ptr = malloc(size ? size : 1);
+   if (!ptr)
+      throw bad_alloc();
+   return ptr;
+}
+
+void operator delete(void *ptr) noexcept
+{
+   free(ptr);
+}
+
+void* operator new[](size_t size)
+{
+   return operator new(size);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+   free(ptr);
+}
+
+uint64_t thread_allocations()
+{
+   return thread_allocs;
+}
+
+uint64_t total_allocations()
+{
+   return total_allocs.load();
+}
+
+double peak_memory()
+{
+   struct rusage usage;
+   getrusage(RUSAGE_SELF, &usage);
+   return usage.ru_maxrss / 1024.0;
+}
+
+uint64_t hash_bytes(const void *data, size_t size, uint64_t hash)
+{
+   const uint32_t *words = static_cast<const uint32_t*>(data);
+   for (size_t i = 0; i < size / 4; i++)
+      hash = (hash ^ words[i]) * 0x100000001b3ull;
+   return hash;
+}
+
+static unsigned parse_buttons(const string& buttons)
+{
+   unsigned input = 0;
+   for (auto& button : Blit::Utils::split(buttons, '+'))
+   {
+      if (button == "up")
+         input |= input_bit(Input::Up);
+      else if (button == "down")
+         input |= input_bit(Input::Down);
+      else if (button == "left")
+         input |= input_bit(Input::Left);
+      else if (button == "right")
+         input |= input_bit(Input::Right);
+      else if (button == "push")
+         input |= input_bit(Input::Push);
+      else if (button != "none")
+         throw runtime_error(Blit::Utils::join("Unknown button in script: ", button));
+   }
+
+   return input;
+}
+
+vector<ScriptEntry> load_script(const string& path)
+{
+   ifstream file(path);
+   if (!file)
+      throw runtime_error(Blit::Utils::join("Failed to open script: ", path));
+
+   vector<ScriptEntry> script;
+   string line;
+   while (getline(file, line))
+   {
+      line = line.substr(0, line.find('#'));
+
+      istringstream stream(line);
+      unsigned frames;
+      string buttons;
+      if (!(stream >> frames >> buttons))
+         continue;
+
+      script.push_back({frames, parse_buttons(buttons)});
+   }
+
+   if (script.empty())
+      throw runtime_error(Blit::Utils::join("Script is empty: ", path));
+
+   return script;
+}
+
+vector<ScriptEntry> random_script(unsigned seed, unsigned frames, unsigned buttons)
+{
+   vector<ScriptEntry> script;
+   uint32_t state = seed;
+   unsigned total = 0;
+
+   while (total < frames)
+   {
+      state = state * 1103515245u + 12345u;
+      unsigned button = (state >> 16) % (buttons + 1);
+      state = state * 1103515245u + 12345u;
+      unsigned hold = 1 + (state >> 16) % 20;
+
+      script.push_back({hold, button < buttons ? 1u << button : 0u});
+      total += hold;
+   }
+
+   return script;
+}
+
+vector<ScriptEntry> options_script(const Options& opts, unsigned buttons)
+{
+   return opts.script.empty() ? random_script(opts.seed, opts.frames, buttons) : load_script(opts.script);
+}
+
+Session::Session(const string& game, bool hash_video)
+   : input(0), video_hash(0),
+   manager(game,
+         [this](Input button) { return input & input_bit(button); },
+         [this, hash_video](const void *data, unsigned, unsigned height, size_t pitch) {
+            if (hash_video)
+               video_hash = hash_bytes(data, height * pitch);
+         })
+{}
@@ -0,0 +1,131 @@
+// Mode measuring input latency with and without running ahead.
+
+#include "headless.hpp"
+
+#include <stdio.h>
+
+using namespace Icy;
+using namespace std;
+
+// Whether the player stands still on a tile in a level that isn't won, with push let go, so any
+// button takes effect right away. Samples taken mid-slide or during a win only measure how long
+// those last.
+static bool player_idle(const GameManager& manager)
+{
+   const Game *game = manager.current_game();
+   if (!game)
+      return false;
+
+   const GameState& state = game->get_state();
+   const GameRules& rules = game->rules();
+   return !state.won() && state.stepper == GameState::StepperNone && !state.is_sliding && !state.push_held &&
+      state.player.x % rules.tile_w() == 0 && state.player.y % rules.tile_h() == 0;
+}
+
+// Presents one frame the way libretro.cpp does.
+static void present_frame(GameManager& manager, unsigned run_ahead)
+{
+   manager.iterate(!run_ahead);
+   manager.run_ahead(run_ahead);
+}
+
+// Trials where nothing changed don't count, and if none did there is no average at all.
+static void print_average(unsigned total, unsigned trials)
+{
+   if (trials)
+      printf(" %7.2f", double(total) / trials);
+   else
+      printf(" %7s", "-");
+}
+
+// Counts the frames from pressing a button until the presented picture changes, for every
+// amount of run-ahead up to opts.latency. Starts from levels in a random play through.
+bool check_latency(Session& session, const Options& opts)
+{
+   static const Input buttons[] = { Input::Up, Input::Down, Input::Left, Input::Right, Input::Push };
+   static const char *names[] = { "Up", "Down", "Left", "Right", "Push" };
+   const unsigned num_buttons = sizeof(buttons) / sizeof(buttons[0]);
+   const unsigned max_frames = 30;
+   const unsigned interval = 300;
+
+   GameManager& manager = session.manager;
+   vector<ScriptEntry> script = options_script(opts);
+   ScriptCursor cursor(script);
+
+   size_t size = manager.serialize_size();
+   vector<vector<uint8_t>> samples;
+   vector<uint8_t> state(size);
+
+   // Menus are driven by the random input as well, so start in the first level.
+   unsigned next_sample = 0;
+   for (unsigned frame = 0; frame < opts.frames; frame++)
+   {
+      session.input = frame < 60 ? 0 : (frame < 120 ? input_bit(Input::Push) : cursor.next());
+      if (frame == 90)
+         session.input = 0;
+      manager.iterate(false);
+
+      if (frame >= next_sample && player_idle(manager))
+      {
+         next_sample = frame + interval;
+         manager.serialize(state.data(), size);
+         samples.push_back(state);
+      }
+   }
+
+   printf("Latency in frames from press to visible change, %u samples:\n", static_cast<unsigned>(samples.size()));
+   printf("%-10s", "Run-ahead");
+   for (auto name : names)
+      printf(" %7s", name);
+   printf(" %7s %9s\n", "Average", "No change");
+
+   for (int run_ahead = 0; run_ahead <= opts.latency; run_ahead++)
+   {
+      unsigned total = 0, changed = 0, unchanged = 0;
+      printf("%-10d", run_ahead);
+
+      for (unsigned b = 0; b < num_buttons; b++)
+      {
+         unsigned button_total = 0, button_changed = 0;
+
+         for (auto& sample : samples)
+         {
+            uint64_t idle[max_frames];
+            manager.unserialize(sample.data(), size);
+            for (unsigned f = 0; f < max_frames; f++)
+            {
+               session.input = 0;
+               present_frame(manager, run_ahead);
+               idle[f] = session.video_hash;
+            }
+
+            manager.unserialize(sample.data(), size);
+            unsigned f;
+            for (f = 0; f < max_frames; f++)
+            {
+               session.input = input_bit(buttons[b]);
+               present_frame(manager, run_ahead);
+               if (session.video_hash != idle[f])
+                  break;
+            }
+
+            if (f < max_frames)
+            {
+               button_total += f;
+               button_changed++;
+            }
+            else
+               unchanged++;
+         }
+
+         print_average(button_total, button_changed);
+         total   += button_total;
+         changed += button_changed;
+      }
+
+      print_average(total, changed);
+      printf(" %9u\n", unchanged);
+   }
+
+   return !samples.empty();
+}
@@ -0,0 +1,120 @@
+// Mode timing sprite loading and face switching.
+
+#include "headless.hpp"
+#include "../utils.hpp"
+
+#include <stdio.h>
+#include <dirent.h>
+
+using namespace Icy;
+using namespace std;
+
+static void list_sprites(const string& dir, vector<string>& paths)
+{
+   DIR *handle = opendir(dir.c_str());
+   if (!handle)
+      return;
+
+   while (dirent *entry = readdir(handle))
+   {
+      string name = entry->d_name;
+      if (name == "." || name == "..")
+         continue;
+
+      string path = Blit::Utils::join(dir, "/", name);
+      if (entry->d_type == DT_DIR)
+         list_sprites(path, paths);
+      else if (name.size() > 7 && name.compare(name.size() - 7, 7, ".sprite") == 0)
+         paths.push_back(path);
+   }
+
+   closedir(handle);
+}
+
+// Times loading every sprite next to the game from files, and then from the cache, with the faces of
+// sprites that have an image each packed into one sheet and without.
+bool time_sprites(const Options& opts)
+{
+   vector<string> found, paths;
+   list_sprites(Blit::Utils::basedir(opts.game), found);
+   for (auto& path : found)
+   {
+      try
+      {
+         Blit::SurfaceCache().from_sprite(path);
+         paths.push_back(path);
+      }
+      catch (const exception& e)
+      {
+         fprintf(stderr, "Skipping %s: %s\n", path.c_str(), e.what());
+      }
+   }
+
+   if (paths.empty())
+      throw runtime_error("Found no sprites next to the game.");
+
+   printf("Sprites %4u  First load ms  Cached us/call  Allocs/call\n", static_cast<unsigned>(paths.size()));
+   for (bool pack : { true, false })
+   {
+      size_t budget = Blit::SurfaceCache::stats().budget;
+      Blit::SurfaceCache::set_budget(0);
+      Blit::SurfaceCache::set_budget(budget);
+      Blit::SurfaceCache::pack_sprites(pack);
+
+      Blit::SurfaceCache cache;
+      double first = time_calls(1, [&] {
+            for (auto& path : paths)
+               cache.from_sprite(path);
+         });
+
+      uint64_t allocs = thread_allocations();
+      double cached = time_calls(opts.sprites, [&] {
+            for (auto& path : paths)
+               cache.from_sprite(path);
+         });
+      double calls = double(opts.sprites) * paths.size();
+
+      printf("%-12s %14.3f %15.3f %12.1f\n", pack ? "Packed" : "Loose", first * 1000.0,
+            cached * 1000000.0 / calls, (thread_allocations() - allocs) / calls);
+   }
+
+   Blit::SurfaceCache::pack_sprites(true);
+
+   // Steps through every frame of every sprite, looking faces up by name and by id.
+   struct Step
+   {
+      unsigned sprite;
+      string name;
+      unsigned face, index;
+   };
+
+   vector<Blit::Surface> sprites;
+   vector<Step> steps;
+   for (auto& path : paths)
+   {
+      Blit::Surface sprite = Blit::SurfaceCache().from_sprite(path);
+      for (unsigned face = 0; face < sprite.faces(); face++)
+      {
+         for (unsigned i = 0; i < sprite.face_frames(face); i++)
+         {
+            sprite.active_face(face, i);
+            steps.push_back(Step{static_cast<unsigned>(sprites.size()), sprite.active_alt().first, face, i});
+         }
+      }
+      sprites.push_back(sprite);
+   }
+
+   const unsigned rounds = 10000;
+   double by_name = time_calls(rounds, [&] {
+         for (auto& step : steps)
+            sprites[step.sprite].active_alt(step.name, step.index);
+      });
+   double by_id = time_calls(rounds, [&] {
+         for (auto& step : steps)
+            sprites[step.sprite].active_face(step.face, step.index);
+      });
+
+   printf("Switching between %u frames: %.1f ns by name, %.1f ns by id.\n", static_cast<unsigned>(steps.size()),
+         by_name * 1e9 / (double(rounds) * steps.size()), by_id * 1e9 / (double(rounds) * steps.size()));
+   return true;
+}
@@ -0,0 +1,83 @@
+// Mode timing startup with and without the disk cache.
+
+#include "headless.hpp"
+#include "../disk_cache.hpp"
+#include "../utils.hpp"
+
+#include <stdio.h>
+#include <dirent.h>
+
+using namespace Icy;
+using namespace std;
+
+// Removes what a disk cache wrote to dir, leaving anything else alone.
+static void clear_cache(const string& dir)
+{
+   DIR *handle = opendir(dir.c_str());
+   if (!handle)
+      return;
+
+   while (dirent *entry = readdir(handle))
+   {
+      string name = entry->d_name;
+      if (name.size() > 5 && name.compare(name.size() - 5, 5, ".surf") == 0)
+         remove(Blit::Utils::join(dir, "/", name).c_str());
+   }
+
+   closedir(handle);
+}
+
+struct StartupTime
+{
+   double load;
+   double previews;
+};
+
+static StartupTime time_startup(const Options& opts)
+{
+   // Start without any decoded images in memory, like a fresh process.
+   size_t budget = Blit::SurfaceCache::stats().budget;
+   Blit::SurfaceCache::set_budget(0);
+   Blit::SurfaceCache::set_budget(budget);
+
+   Clock::time_point start = Clock::now();
+   Session session(opts.game, false);
+
+   StartupTime time;
+   time.load = seconds_since(start);
+   session.manager.wait_for_previews();
+   time.previews = seconds_since(start);
+   return time;
+}
+
+// Times loading the game until every level preview is in, without the disk cache,
+// with an empty one, and with the one the previous run filled in.
+bool check_startup(const Options& opts)
+{
+   if (opts.cache.empty())
+      throw runtime_error("--startup needs a --cache directory.");
+
+   // Once to get the files into the page cache.
+   Blit::DiskCache::set(nullptr);
+   time_startup(opts);
+   StartupTime none = time_startup(opts);
+
+   clear_cache(opts.cache);
+   Blit::DiskCache::set(make_shared<Blit::DiskCache>(opts.cache));
+   StartupTime cold = time_startup(opts);
+   Blit::DiskCache::Stats cold_stats = Blit::DiskCache::get()->stats();
+
+   Blit::DiskCache::set(make_shared<Blit::DiskCache>(opts.cache));
+   StartupTime warm = time_startup(opts);
+   Blit::DiskCache::Stats warm_stats = Blit::DiskCache::get()->stats();
+   Blit::DiskCache::set(nullptr);
+
+   printf("%-12s %9s %12s %6s %7s %6s %7s\n", "Startup", "Load ms", "Previews ms", "Hits", "Misses", "Stale", "Stores");
+   printf("%-12s %9.1f %12.1f\n", "No cache", none.load * 1000.0, none.previews * 1000.0);
+   printf("%-12s %9.1f %12.1f %6u %7u %6u %7u\n", "Cold cache", cold.load * 1000.0, cold.previews * 1000.0,
+         cold_stats.hits, cold_stats.misses, cold_stats.stale, cold_stats.stores);
+   printf("%-12s %9.1f %12.1f %6u %7u %6u %7u\n", "Warm cache", warm.load * 1000.0, warm.previews * 1000.0,
+         warm_stats.hits, warm_stats.misses, warm_stats.stale, warm_stats.stores);
+
+   return warm_stats.hits && !warm_stats.misses && !warm_stats.stale;
+}
@@ -0,0 +1,203 @@
+// Modes checking that save states, rewind and recordings bring the game back exactly.
+
+#include "headless.hpp"
+#include "../replay.hpp"
+#include "../rewind.hpp"
+#include "../utils.hpp"
+
+#include <stdio.h>
+
+using namespace Icy;
+using namespace std;
+
+// Plays the whole game, title and menus included, and every so often takes a save state,
+// runs ahead, restores it and replays the same input. Every replayed frame has to produce
+// the same save state and video as the first time around. Also times serialization.
+bool check_savestates(Session& session, const Options& opts)
+{
+   GameManager& manager = session.manager;
+   vector<ScriptEntry> script = options_script(opts, static_cast<unsigned>(Input::Reset) + 1);
+
+   const unsigned interval = 600;
+   const unsigned replay_frames = 120;
+
+   size_t size = manager.serialize_size();
+   vector<uint8_t> snapshot(size), state(size);
+   vector<unsigned> inputs;
+   vector<uint64_t> hashes;
+
+   ScriptCursor cursor(script);
+   unsigned checks = 0, mismatches = 0;
+
+   for (unsigned frame = 0; frame < opts.frames; frame++)
+   {
+      if (frame % interval == 0)
+      {
+         if (!manager.serialize(snapshot.data(), size))
+            throw runtime_error("Failed to serialize.");
+         inputs.clear();
+         hashes.clear();
+      }
+
+      session.input = cursor.next();
+      manager.iterate();
+
+      if (inputs.size() < replay_frames)
+      {
+         manager.serialize(state.data(), size);
+         inputs.push_back(session.input);
+         hashes.push_back(hash_bytes(state.data(), size, session.video_hash));
+      }
+
+      if (inputs.size() == replay_frames && frame % interval == replay_frames - 1)
+      {
+         vector<uint8_t> resume(size);
+         manager.serialize(resume.data(), size);
+
+         if (!manager.unserialize(snapshot.data(), size))
+            throw runtime_error("Failed to unserialize.");
+
+         for (unsigned i = 0; i < inputs.size(); i++)
+         {
+            session.input = inputs[i];
+            manager.iterate();
+            manager.serialize(state.data(), size);
+            if (hash_bytes(state.data(), size, session.video_hash) != hashes[i])
+            {
+               fprintf(stderr, "Replay diverged %u frames after save state taken at frame %u.\n",
+                     i, frame + 1 - replay_frames);
+               mismatches++;
+               break;
+            }
+         }
+
+         manager.unserialize(resume.data(), size);
+         checks++;
+      }
+   }
+
+   // Restoring a state of the level being played is the common case, time that.
+   const unsigned iterations = 100000;
+   manager.serialize(snapshot.data(), size);
+
+   double serialize_time   = time_calls(iterations, [&] { manager.serialize(state.data(), size); });
+   double unserialize_time = time_calls(iterations, [&] { manager.unserialize(snapshot.data(), size); });
+
+   printf("Save state: %u bytes, serialize %.3f us, unserialize %.3f us.\n",
+         static_cast<unsigned>(size),
+         serialize_time * 1e6 / iterations, unserialize_time * 1e6 / iterations);
+   printf("Replayed %u save states of %u frames each, %u diverged.\n", checks, replay_frames, mismatches);
+
+   return !mismatches;
+}
+
+// Records every frame of a play through into a rewind buffer, then rewinds as far back as it goes,
+// checking every state on the way. Recording has to stay within its per-frame budget.
+bool check_rewind(Session& session, const Options& opts)
+{
+   const double frame_budget = 20e-6;
+
+   GameManager& manager = session.manager;
+   vector<ScriptEntry> script = options_script(opts, static_cast<unsigned>(Input::Reset) + 1);
+   ScriptCursor cursor(script);
+
+   size_t size = manager.serialize_size();
+   RewindBuffer buffer(size, size_t(opts.rewind) << 20);
+   vector<uint8_t> state(size);
+   vector<uint64_t> hashes;
+   TimeStats recording;
+
+   for (unsigned frame = 0; frame < opts.frames; frame++)
+   {
+      session.input = cursor.next();
+      manager.iterate(opts.render);
+
+      Clock::time_point start = Clock::now();
+      manager.serialize(state.data(), size);
+      buffer.push(state.data());
+      recording.add(seconds_since(start));
+
+      hashes.push_back(hash_bytes(state.data(), size));
+   }
+
+   size_t frames = buffer.frames();
+   printf("Rewind: %u frames recorded, %u kept in %.2f of %.2f MB, %.1f bytes per frame.\n",
+         opts.frames, static_cast<unsigned>(frames),
+         buffer.memory_used() / (1024.0 * 1024.0), buffer.memory_budget() / (1024.0 * 1024.0),
+         frames ? double(buffer.memory_used()) / frames : 0.0);
+
+   unsigned mismatches = 0;
+   Clock::time_point start = Clock::now();
+   for (size_t i = 0; i < frames; i++)
+   {
+      if (!buffer.pop(state.data()) || hash_bytes(state.data(), size) != hashes[hashes.size() - 2 - i])
+         mismatches++;
+      else if (!manager.unserialize(state.data(), size))
+         mismatches++;
+   }
+   double rewind_time = seconds_since(start);
+
+   printf("Recording took %.3f us per frame on average, %.3f us at worst, budget is %.3f us.\n",
+         recording.average() * 1e6, recording.max * 1e6, frame_budget * 1e6);
+   printf("Stepped back %u frames in %.3f us each, %u mismatched.\n",
+         static_cast<unsigned>(frames), frames ? rewind_time * 1e6 / frames : 0.0, mismatches);
+
+   return !mismatches && recording.average() <= frame_budget;
+}
+
+// Plays the whole game and writes the input and state checksum of every frame to a recording.
+bool record_session(Session& session, const Options& opts)
+{
+   vector<ScriptEntry> script = options_script(opts, static_cast<unsigned>(Input::Reset) + 1);
+   ScriptCursor cursor(script);
+
+   Recording recording;
+   recording.start(session.manager);
+
+   Clock::time_point start = Clock::now();
+   for (unsigned frame = 0; frame < opts.frames; frame++)
+   {
+      session.input = cursor.next();
+      session.manager.iterate(opts.render);
+      recording.record(session.input, session.manager);
+   }
+   double time = seconds_since(start);
+
+   recording.save(opts.record);
+   printf("Recorded %u frames to %s in %.2f s.\n", opts.frames, opts.record.c_str(), time);
+   return true;
+}
+
+// Feeds a recording back as fast as possible, stopping at the first frame whose state differs.
+bool replay_session(Session& session, const Options& opts)
+{
+   GameManager& manager = session.manager;
+   Recording recording(opts.replay);
+   if (!recording.restore(manager))
+      throw runtime_error(Blit::Utils::join("Recording doesn't match this game: ", opts.replay));
+
+   size_t frames = recording.frames();
+   size_t frame;
+
+   Clock::time_point start = Clock::now();
+   for (frame = 0; frame < frames; frame++)
+   {
+      session.input = recording.input(frame);
+      manager.level_handoff(recording.held(frame) ? GameManager::Handoff::Hold : GameManager::Handoff::Wait);
+      manager.iterate(opts.render);
+      if (recording.checksum(manager) != recording.checksum(frame))
+         break;
+   }
+   double time = seconds_since(start);
+
+   printf("Replayed %u of %u frames in %.3f s, %.0f frames/s.\n",
+         static_cast<unsigned>(frame), static_cast<unsigned>(frames), time, frame / time);
+
+   if (frame < frames)
+   {
+      printf("Diverged at frame %u.\n", static_cast<unsigned>(frame));
+      return false;
+   }
+
+   return true;
+}
@@ -0,0 +1,89 @@
+// Mode timing level transitions, with and without prefetching the next level.
+
+#include "headless.hpp"
+#include "../utils.hpp"
+
+#include <stdio.h>
+#include <limits.h>
+
+using namespace Icy;
+using namespace std;
+
+// Plays through the whole game with the solution scripts in dir, one per level named after it
+// (level_1-1.txt for level_1-1.tmx), and times the frames that move on to the next level.
+static bool time_transitions(const Options& opts, const string& dir, bool prefetch)
+{
+   Session session(opts.game, false);
+   GameManager& manager = session.manager;
+   manager.prefetch_levels(prefetch);
+   manager.wait_for_previews();
+
+   // Title, then the menu, which only reacts to a press after a release.
+   const unsigned start[] = { input_bit(Input::Push), 0, input_bit(Input::Push) };
+   for (auto frame : start)
+   {
+      session.input = frame;
+      manager.iterate(true);
+   }
+
+   TimeStats transitions, others;
+   vector<string> paths = manager.level_paths();
+   for (auto& path : paths)
+   {
+      string name = path.substr(path.find_last_of('/') + 1);
+      vector<ScriptEntry> script = load_script(Blit::Utils::join(dir, "/", name.substr(0, name.find_last_of('.')), ".txt"));
+
+      if (manager.game_state() != GameManager::State::Game)
+      {
+         fprintf(stderr, "Not in a level when %s should start.\n", path.c_str());
+         return false;
+      }
+
+      // The won level stays up past the end of the script until the next one is in, which takes
+      // more frames the faster they run.
+      script.push_back({UINT_MAX, 0});
+
+      unsigned level = manager.current_level();
+      for (auto& entry : script)
+      {
+         for (unsigned f = 0; f < entry.frames; f++)
+         {
+            if (&entry == &script.back() && !manager.handoff_held())
+               break;
+
+            session.input = entry.input;
+            Clock::time_point start = Clock::now();
+            manager.iterate(true);
+            double time = seconds_since(start);
+
+            if (manager.current_level() != level || manager.game_state() != GameManager::State::Game)
+            {
+               transitions.add(time);
+               goto next_level;
+            }
+            others.add(time);
+         }
+      }
+
+      fprintf(stderr, "Script did not solve %s.\n", path.c_str());
+      return false;
+next_level:;
+   }
+
+   LevelLoader::Stats stats = manager.prefetch_stats();
+   printf("%-12s %12u %10.3f %10.3f %10.4f %10.3f %6u %7u %7u %6u\n", prefetch ? "Prefetch" : "No prefetch",
+         transitions.count, transitions.average() * 1000.0, transitions.max * 1000.0,
+         others.average() * 1000.0, others.max * 1000.0,
+         stats.ready, stats.waited, stats.missed, manager.held_frames());
+   return true;
+}
+
+// Compares level transitions loading the next level on the spot with prefetching it.
+bool check_transitions(const Options& opts, const string& dir)
+{
+   printf("%-12s %12s %10s %10s %10s %10s %6s %7s %7s %6s\n", "Transitions", "Level ends",
+         "Avg ms", "Max ms", "Other avg", "Other max", "Ready", "Waited", "Missed", "Held");
+   bool ok = time_transitions(opts, dir, false);
+   ok = time_transitions(opts, dir, true) && ok;
+   return ok;
+}
@@ -0,0 +1,368 @@
+// Level compiler for Dinothawr.
+// Compiles every level of a .game file (or the given .tmx files) to the binary level format
+// next to the map, checks that the compiled level loads to the same Tilemap as the TMX,
+// and compares load times of both. Can also benchmark the layer encodings Tiled writes
+// on large maps made by tiling a level.
+
+#include "../game.hpp"
+#include "../mapped_file.hpp"
+#include "../tilemap.hpp"
+#include "../utils.hpp"
+#include "frontend.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <compat/zlib.h>
+
+using namespace Blit;
+using namespace std;
+
+struct Options
+{
+   Options() : check(false), remove(false), loads(20), encodings(0) {}
+
+   vector<string> paths;
+   bool check;
+   bool remove;
+   unsigned loads;
+   unsigned encodings; // Size of the maps to benchmark layer encodings on, 0 to compile instead.
+};
+
+static void usage(const char *argv0)
+{
+   fprintf(stderr, "Usage: %s [options] <path/to/dinothawr.game | level.tmx...>\n", argv0);
+   fprintf(stderr, "  --check     Don't compile, only check existing compiled levels.\n");
+   fprintf(stderr, "  --remove    Remove compiled levels, so the core loads TMX again.\n");
+   fprintf(stderr, "  --loads N   Loads per level when timing (default: 20).\n");
+   fprintf(stderr, "  --encodings N  Instead, time loading an N x N tiling of the first level\n");
+   fprintf(stderr, "              in every layer encoding Tiled writes.\n");
+}
+
+static bool parse_options(int argc, char *argv[], Options& opts)
+{
+   for (int i = 1; i < argc; i++)
+   {
+      string arg = argv[i];
+      if (arg == "--check")
+         opts.check = true;
+      else if (arg == "--remove")
+         opts.remove = true;
+      else if (arg == "--loads" && i + 1 < argc)
+         opts.loads = max(1, atoi(argv[++i]));
+      else if (arg == "--encodings" && i + 1 < argc)
+         opts.encodings = max(1, atoi(argv[++i]));
+      else if (arg.compare(0, 2, "--") == 0)
+         return false;
+      else
+         opts.paths.push_back(arg);
+   }
+
+   return !opts.paths.empty();
+}
+
+// Returns an empty string if both maps describe the same level, otherwise what differs.
+static string compare(const Tilemap& a, const Tilemap& b)
+{
+   if (a.tiles_width() != b.tiles_width() || a.tiles_height() != b.tiles_height() ||
+         a.tile_width() != b.tile_width() || a.tile_height() != b.tile_height())
+      return "geometry";
+
+   if (a.layers().size() != b.layers().size())
+      return "layer count";
+
+   for (unsigned i = 0; i < a.layers().size(); i++)
+   {
+      const Tilemap::Layer& la = a.layers()[i];
+      const Tilemap::Layer& lb = b.layers()[i];
+
+      if (la.name != lb.name || la.attr != lb.attr || la.dynamic != lb.dynamic)
+         return Utils::join("layer ", la.name, " properties");
+      if (la.gids != lb.gids)
+         return Utils::join("layer ", la.name, " tiles");
+
+      auto& ea = la.cluster.vec();
+      auto& eb = lb.cluster.vec();
+      if (ea.size() != eb.size())
+         return Utils::join("layer ", la.name, " instances");
+
+      for (unsigned e = 0; e < ea.size(); e++)
+      {
+         if (ea[e].tag != eb[e].tag || ea[e].surf.rect().pos != eb[e].surf.rect().pos)
+            return Utils::join("layer ", la.name, " instances");
+      }
+
+      for (int y = 0; y < a.tiles_height(); y++)
+      {
+         for (int x = 0; x < a.tiles_width(); x++)
+         {
+            unsigned gid = a.gid(i, {x, y});
+            if (!gid)
+               continue;
+
+            const Tilemap::Tile& ta = a.tile(gid);
+            const Tilemap::Tile& tb = b.tile(gid);
+            if (ta.flags != tb.flags || ta.props != tb.props ||
+                  ta.surf.rect().w != tb.surf.rect().w || ta.surf.rect().h != tb.surf.rect().h)
+               return Utils::join("tile ", gid);
+         }
+      }
+   }
+
+   for (int y = 0; y < a.tiles_height(); y++)
+      for (int x = 0; x < a.tiles_width(); x++)
+         if (a.static_collision({x, y}) != b.static_collision({x, y}))
+            return "collisions";
+
+   return "";
+}
+
+static double time_loads(const string& path, bool compiled, unsigned loads)
+{
+   auto start = chrono::steady_clock::now();
+   for (unsigned i = 0; i < loads; i++)
+      Tilemap map(path, compiled);
+   return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / loads;
+}
+
+static string encode_base64(const vector<uint8_t>& data)
+{
+   static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+   string out;
+   out.reserve((data.size() + 2) / 3 * 4);
+
+   for (size_t i = 0; i < data.size(); i += 3)
+   {
+      uint32_t bits = data[i] << 16;
+      if (i + 1 < data.size())
+         bits |= data[i + 1] << 8;
+      if (i + 2 < data.size())
+         bits |= data[i + 2];
+
+      out += alphabet[(bits >> 18) & 63];
+      out += alphabet[(bits >> 12) & 63];
+      out += i + 1 < data.size() ? alphabet[(bits >> 6) & 63] : '=';
+      out += i + 2 < data.size() ? alphabet[bits & 63] : '=';
+   }
+
+   return out;
+}
+
+static vector<uint8_t> deflate_data(const vector<uint8_t>& data, bool gzip)
+{
+   z_stream stream;
+   memset(&stream, 0, sizeof(stream));
+   if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, gzip ? 15 + 16 : 15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+      throw runtime_error("Failed to initialize zlib.");
+
+   vector<uint8_t> out(deflateBound(&stream, data.size()) + 32);
+   stream.next_in   = const_cast<Bytef*>(data.data());
+   stream.avail_in  = data.size();
+   stream.next_out  = out.data();
+   stream.avail_out = out.size();
+
+   int ret = deflate(&stream, Z_FINISH);
+   out.resize(out.size() - stream.avail_out);
+   deflateEnd(&stream);
+
+   if (ret != Z_STREAM_END)
+      throw runtime_error("Failed to compress layer.");
+   return out;
+}
+
+// Writes gids into a layer's <data> in one of the encodings Tiled uses.
+static void write_layer_data(pugi::xml_node data, const vector<unsigned>& gids, const string& encoding)
+{
+   if (encoding == "xml")
+   {
+      for (auto gid : gids)
+         data.append_child("tile").append_attribute("gid") = gid;
+   }
+   else if (encoding == "csv")
+   {
+      string csv;
+      for (size_t i = 0; i < gids.size(); i++)
+         csv += Utils::join(i ? "," : "", gids[i]);
+
+      data.append_attribute("encoding") = "csv";
+      data.append_child(pugi::node_pcdata).set_value(csv.c_str());
+   }
+   else
+   {
+      vector<uint8_t> bytes;
+      for (auto gid : gids)
+         for (unsigned i = 0; i < 4; i++)
+            bytes.push_back(gid >> (8 * i));
+
+      data.append_attribute("encoding") = "base64";
+      if (encoding != "base64")
+      {
+         bool gzip = encoding == "base64+gzip";
+         bytes = deflate_data(bytes, gzip);
+         data.append_attribute("compression") = gzip ? "gzip" : "zlib";
+      }
+      data.append_child(pugi::node_pcdata).set_value(encode_base64(bytes).c_str());
+   }
+}
+
+// Tiles the layers of level over a size x size map, saves it next to the level in every encoding,
+// and times loading each.
+static bool bench_encodings(const string& level, unsigned size, unsigned loads)
+{
+   static const char *encodings[] = { "xml", "csv", "base64", "base64+zlib", "base64+gzip" };
+
+   Tilemap original(level, false);
+   pugi::xml_document doc;
+   if (!doc.load_file(level.c_str()))
+      throw runtime_error(Utils::join("Failed to load XML map: ", level, "."));
+
+   pugi::xml_node map = doc.child("map");
+   map.attribute("width")  = size;
+   map.attribute("height") = size;
+
+   // Blocks are kept to the area of the original level, as every one of them is an instance.
+   int width  = original.tiles_width();
+   int height = original.tiles_height();
+   vector<vector<unsigned>> layers;
+   for (auto& layer : original.layers())
+   {
+      vector<unsigned> gids(size * size);
+      for (unsigned y = 0; y < size; y++)
+         for (unsigned x = 0; x < size; x++)
+            if (!layer.dynamic || (int(x) < width && int(y) < height))
+               gids[y * size + x] = original.gid(&layer - &original.layers()[0], Pos(x % width, y % height));
+      layers.push_back(move(gids));
+   }
+
+   printf("%ux%u map tiled from %s, %u layers:\n", size, size, level.c_str(), static_cast<unsigned>(layers.size()));
+   printf("%-14s %12s %10s %8s %8s\n", "Encoding", "Bytes", "Load ms", "Speedup", "Check");
+
+   string dir = Utils::basedir(level);
+   unique_ptr<Tilemap> reference;
+   double xml_time = 0.0;
+   bool ok = true;
+
+   for (auto encoding : encodings)
+   {
+      unsigned index = 0;
+      for (auto layer = map.child("layer"); layer; layer = layer.next_sibling("layer"), index++)
+      {
+         layer.attribute("width")  = size;
+         layer.attribute("height") = size;
+         layer.remove_child("data");
+         write_layer_data(layer.append_child("data"), layers[index], encoding);
+      }
+
+      string path = Utils::join(dir, "/levelc_bench.tmx");
+      if (!doc.save_file(path.c_str(), "", pugi::format_raw))
+         throw runtime_error(Utils::join("Failed to write: ", path, "."));
+
+      MappedFile file;
+      file.open(path);
+      size_t bytes = file.size();
+      file.close();
+
+      double time = time_loads(path, false, loads);
+      if (!xml_time)
+         xml_time = time;
+
+      unique_ptr<Tilemap> map_loaded(new Tilemap(path, false));
+      string diff = reference ? compare(*reference, *map_loaded) : "";
+      if (!reference)
+         reference = move(map_loaded);
+      ok = ok && diff.empty();
+
+      printf("%-14s %12u %10.2f %7.1fx %8s\n", encoding, static_cast<unsigned>(bytes), time, xml_time / time,
+            diff.empty() ? "ok" : diff.c_str());
+      remove(path.c_str());
+   }
+
+   return ok;
+}
+
+int main(int argc, char *argv[])
+{
+   Options opts;
+   if (!parse_options(argc, argv, opts))
+   {
+      usage(argv[0]);
+      return 1;
+   }
+
+   try
+   {
+      vector<string> paths;
+      const string& first = opts.paths[0];
+      if (opts.paths.size() == 1 && first.size() > 5 && first.compare(first.size() - 5, 5, ".game") == 0)
+      {
+         set_basedir(Utils::basedir(opts.paths[0]));
+         Icy::GameManager manager(opts.paths[0],
+               [](Icy::Input) { return false; },
+               [](const void*, unsigned, unsigned, size_t) {});
+         paths = manager.level_paths();
+      }
+      else
+         paths = opts.paths;
+
+      if (opts.encodings)
+         return bench_encodings(paths[0], opts.encodings, opts.loads) ? 0 : 1;
+
+      if (opts.remove)
+      {
+         for (auto& path : paths)
+            ::remove(Tilemap::compiled_path(path).c_str());
+         printf("Removed %u compiled levels.\n", static_cast<unsigned>(paths.size()));
+         return 0;
+      }
+
+      printf("%-32s %9s %10s %10s %8s %8s\n", "Level", "Bytes", "TMX ms", "Comp. ms", "Speedup", "Check");
+
+      unsigned failed = 0;
+      double total_tmx = 0.0, total_compiled = 0.0;
+
+      for (auto& path : paths)
+      {
+         string out = Tilemap::compiled_path(path);
+         try
+         {
+            if (!opts.check)
+               Tilemap::compile(path, out);
+
+            MappedFile file;
+            if (!file.open(out))
+               throw runtime_error(Utils::join("No compiled level: ", out, "."));
+
+            string diff = compare(Tilemap(path, false), Tilemap(path, true));
+
+            double tmx      = time_loads(path, false, opts.loads);
+            double compiled = time_loads(path, true, opts.loads);
+            total_tmx      += tmx;
+            total_compiled += compiled;
+
+            printf("%-32s %9u %10.3f %10.3f %7.1fx %8s\n", path.c_str(), static_cast<unsigned>(file.size()),
+                  tmx, compiled, tmx / compiled, diff.empty() ? "ok" : diff.c_str());
+
+            if (!diff.empty())
+               failed++;
+         }
+         catch (const exception& e)
+         {
+            printf("%-32s FAILED: %s\n", path.c_str(), e.what());
+            failed++;
+         }
+      }
+
+      printf("\n%u levels, %u failed. Loading all levels: %.1f ms from TMX, %.1f ms compiled.\n",
+            static_cast<unsigned>(paths.size()), failed, total_tmx, total_compiled);
+      return failed ? 1 : 0;
+   }
+   catch (const exception& e)
+   {
+      fprintf(stderr, "Fatal error: %s\n", e.what());
+      return 1;
+   }
+}
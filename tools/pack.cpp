@@ -0,0 +1,289 @@
+// Asset packer for Dinothawr.
+// Packs the .game file and every asset next to it into a single file the core can load instead,
+// optionally with images and sound effects pre-decoded, then times loading the game from the
+// loose files against loading it from the pack. Can also benchmark the PNG decoders on the assets.
+
+#include "../asset_pack.hpp"
+#include "../game.hpp"
+#include "../rpng_front.h"
+#include "../utils.hpp"
+#include "frontend.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+using namespace Blit;
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+struct Options
+{
+   Options() : decode(false), png_rounds(0) {}
+
+   string game;
+   string out;
+   bool decode;
+   unsigned png_rounds;
+};
+
+static const char *packed_extensions[] = { "game", "font", "tmx", "lvl", "sprite", "png", "wav", "ogg" };
+
+static string extension(const string& name)
+{
+   size_t dot = name.find_last_of('.');
+   return dot == string::npos ? "" : Utils::tolower(name.substr(dot + 1));
+}
+
+// Lists the files to pack under dir, relative to it.
+static void list_files(const string& dir, const string& prefix, vector<string>& names)
+{
+   DIR *handle = opendir(dir.c_str());
+   if (!handle)
+      throw runtime_error(Utils::join("Failed to open directory: ", dir, "."));
+
+   while (struct dirent *entry = readdir(handle))
+   {
+      string name = entry->d_name;
+      if (name == "." || name == "..")
+         continue;
+
+      string path = Utils::join(dir, "/", name);
+      struct stat st;
+      if (stat(path.c_str(), &st) < 0)
+         continue;
+
+      if (S_ISDIR(st.st_mode))
+         list_files(path, Utils::join(prefix, name, "/"), names);
+      else
+      {
+         string ext = extension(name);
+         for (auto packed : packed_extensions)
+            if (ext == packed)
+               names.push_back(prefix + name);
+      }
+   }
+
+   closedir(handle);
+}
+
+static AssetPack::File read_file(const string& root, const string& name, bool decode)
+{
+   string path = Utils::join(root, "/", name);
+   string ext  = extension(name);
+
+   AssetPack::File file;
+   file.name = name;
+
+   if (decode && ext == "png")
+   {
+      Surface surf = SurfaceCache().from_image(path);
+      const uint8_t *pixels = reinterpret_cast<const uint8_t*>(surf.pixel_raw({0, 0}));
+
+      file.format.kind   = AssetPack::Pixels;
+      file.format.width  = surf.rect().w;
+      file.format.height = surf.rect().h;
+      file.data.assign(pixels, pixels + file.format.width * file.format.height * sizeof(Pixel));
+   }
+   else if (decode && ext == "wav")
+   {
+      Audio::PCM pcm = Audio::WAVFile::load_wave(path);
+      const uint8_t *samples = reinterpret_cast<const uint8_t*>(pcm.samples.data());
+
+      file.format.kind   = AssetPack::PCM;
+      file.format.width  = pcm.frames();
+      file.format.height = pcm.channels;
+      file.data.assign(samples, samples + pcm.samples.size() * sizeof(int16_t));
+   }
+   else
+   {
+      MappedFile mapped;
+      if (!mapped.open(path))
+         throw runtime_error(Utils::join("Failed to open: ", path, "."));
+      file.data.assign(mapped.data(), mapped.data() + mapped.size());
+   }
+
+   return file;
+}
+
+// Loads the game until every level preview is in, with no decoded images left in memory.
+static double time_load(const string& game)
+{
+   size_t budget = SurfaceCache::stats().budget;
+   SurfaceCache::set_budget(0);
+   SurfaceCache::set_budget(budget);
+
+   Clock::time_point start = Clock::now();
+   Icy::GameManager manager(game,
+         [](Icy::Input) { return false; },
+         [](const void*, unsigned, unsigned, size_t) {});
+   manager.wait_for_previews();
+   return chrono::duration<double, milli>(Clock::now() - start).count();
+}
+
+typedef bool (*PNGDecoder)(const uint8_t*, size_t, uint32_t**, unsigned*, unsigned*);
+
+// Decodes every image rounds times over, returning MB of pixels per second.
+static double time_decoder(PNGDecoder decode, const vector<MappedFile>& files, unsigned rounds)
+{
+   size_t bytes = 0;
+   Clock::time_point start = Clock::now();
+   for (unsigned i = 0; i < rounds; i++)
+   {
+      for (auto& file : files)
+      {
+         uint32_t *data = nullptr;
+         unsigned width = 0, height = 0;
+         if (!decode(file.data(), file.size(), &data, &width, &height))
+            throw runtime_error("Failed to decode image.");
+         bytes += width * height * sizeof(uint32_t);
+         free(data);
+      }
+   }
+
+   return bytes / (1024.0 * 1024.0) / chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Checks the fast PNG decoder against rpng on every image under root, then times both.
+static bool bench_png(const string& root, unsigned rounds)
+{
+   vector<string> names;
+   list_files(root, "", names);
+
+   vector<MappedFile> files;
+   size_t png_bytes = 0, pixel_bytes = 0;
+   unsigned mismatched = 0;
+   for (auto& name : names)
+   {
+      if (extension(name) != "png")
+         continue;
+
+      string path = Utils::join(root, "/", name);
+      files.emplace_back();
+      if (!files.back().open(path))
+         throw runtime_error(Utils::join("Failed to open: ", path, "."));
+      png_bytes += files.back().size();
+
+      uint32_t *expected = nullptr, *actual = nullptr;
+      unsigned width = 0, height = 0, fast_width = 0, fast_height = 0;
+      if (!rpng_load_image_argb_generic(files.back().data(), files.back().size(), &expected, &width, &height))
+         throw runtime_error(Utils::join("rpng failed to decode: ", path, "."));
+      bool decoded = rpng_load_image_argb_from_memory(files.back().data(), files.back().size(),
+            &actual, &fast_width, &fast_height);
+
+      if (!decoded || width != fast_width || height != fast_height ||
+            memcmp(expected, actual, width * height * sizeof(uint32_t)))
+      {
+         fprintf(stderr, "Decoders disagree on %s.\n", path.c_str());
+         mismatched++;
+      }
+
+      pixel_bytes += width * height * sizeof(uint32_t);
+      free(expected);
+      if (decoded)
+         free(actual);
+   }
+
+   if (mismatched)
+      return false;
+
+   double generic = time_decoder(rpng_load_image_argb_generic, files, rounds);
+   double fast    = time_decoder(rpng_load_image_argb_from_memory, files, rounds);
+
+   printf("Decoded %u PNGs (%.2f MB, %.2f MB of pixels) %u times over.\n", static_cast<unsigned>(files.size()),
+         png_bytes / (1024.0 * 1024.0), pixel_bytes / (1024.0 * 1024.0), rounds);
+   printf("rpng: %.1f MB/s, fast path: %.1f MB/s of pixels (%.2fx).\n", generic, fast, fast / generic);
+   return true;
+}
+
+static void usage(const char *argv0)
+{
+   fprintf(stderr, "Usage: %s [options] <path/to/dinothawr.game>\n", argv0);
+   fprintf(stderr, "  --out FILE  Pack to write (default: dinothawr.pack next to the .game file).\n");
+   fprintf(stderr, "  --decode    Store images as pixels and sound effects as PCM, so they load without decoding.\n");
+   fprintf(stderr, "  --png N     Don't pack, check the PNG decoders agree on every image and decode them all N times.\n");
+}
+
+static bool parse_options(int argc, char *argv[], Options& opts)
+{
+   for (int i = 1; i < argc; i++)
+   {
+      string arg = argv[i];
+      if (arg == "--decode")
+         opts.decode = true;
+      else if (arg == "--png" && i + 1 < argc)
+         opts.png_rounds = strtoul(argv[++i], NULL, 0);
+      else if (arg == "--out" && i + 1 < argc)
+         opts.out = argv[++i];
+      else if (arg[0] != '-' && opts.game.empty())
+         opts.game = arg;
+      else
+         return false;
+   }
+
+   return !opts.game.empty();
+}
+
+int main(int argc, char *argv[])
+{
+   Options opts;
+   if (!parse_options(argc, argv, opts))
+   {
+      usage(argv[0]);
+      return 1;
+   }
+
+   try
+   {
+      string root = Utils::basedir(opts.game);
+      string main = opts.game.substr(opts.game.find_last_of("/\\") + 1);
+      if (opts.out.empty())
+         opts.out = Utils::join(root, "/", main.substr(0, main.find_last_of('.')), ".pack");
+      set_basedir(root);
+
+      if (opts.png_rounds)
+         return bench_png(root, opts.png_rounds) ? 0 : 1;
+
+      vector<string> names;
+      list_files(root, "", names);
+
+      vector<AssetPack::File> files;
+      size_t loose_bytes = 0;
+      for (auto& name : names)
+      {
+         files.push_back(read_file(root, name, opts.decode));
+         loose_bytes += files.back().data.size();
+      }
+
+      AssetPack::write(opts.out, main, move(files));
+      AssetPack pack(opts.out);
+      printf("Packed %u files (%.2f MB) into %s (%.2f MB)%s.\n",
+            static_cast<unsigned>(pack.size()), loose_bytes / (1024.0 * 1024.0), opts.out.c_str(),
+            pack.bytes() / (1024.0 * 1024.0), opts.decode ? ", images and sound effects decoded" : "");
+
+      // Once each to get the files into the page cache.
+      time_load(opts.game);
+      double loose = time_load(opts.game);
+
+      string packed_game = AssetPack::mount_content(opts.out);
+      time_load(packed_game);
+      double packed = time_load(packed_game);
+      AssetPack::mount(nullptr, "");
+
+      printf("Loading the game until all previews are in: %.1f ms from loose files, %.1f ms from the pack.\n",
+            loose, packed);
+      return 0;
+   }
+   catch (const exception& e)
+   {
+      fprintf(stderr, "Fatal error: %s\n", e.what());
+      return 1;
+   }
+}
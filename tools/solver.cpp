@@ -0,0 +1,200 @@
+// Optimal push solver for Dinothawr levels.
+// Finds the minimum number of pushes for every level of a .game file (or the given .tmx files),
+// replays each solution frame by frame through the game rules to verify it, and reports
+// search throughput and memory per state.
+
+#include "../game.hpp"
+#include "../solver.hpp"
+#include "../utils.hpp"
+#include "frontend.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace Icy;
+using namespace std;
+
+struct Options
+{
+   // Level 10-3, the largest shipped one, visits 41M states of 32 bytes. The table is only
+   // touched as it fills, so smaller levels don't pay for the budget.
+   Options() : threads(thread::hardware_concurrency()), memory(2048) {}
+
+   vector<string> paths;
+   string filter;
+   string scripts;
+   unsigned threads;
+   unsigned memory; // MiB
+};
+
+static const char *button_names[] = { "up", "down", "left", "right", "push" };
+
+static string buttons(unsigned input)
+{
+   string str;
+   for (unsigned i = 0; i < 5; i++)
+   {
+      if (input & (1u << i))
+      {
+         if (!str.empty())
+            str += '+';
+         str += button_names[i];
+      }
+   }
+   return str.empty() ? "none" : str;
+}
+
+// Writes the replay in the script format the headless runner reads.
+static void write_script(const string& path, const string& level, const vector<unsigned>& input)
+{
+   ofstream file(path);
+   if (!file)
+      throw runtime_error(Blit::Utils::join("Failed to open script for writing: ", path));
+
+   file << "# Solution for " << level << "\n";
+   for (size_t i = 0; i < input.size();)
+   {
+      size_t end = i;
+      while (end < input.size() && input[end] == input[i])
+         end++;
+
+      file << end - i << " " << buttons(input[i]) << "\n";
+      i = end;
+   }
+}
+
+static string script_name(const string& level)
+{
+   string name = level.substr(level.find_last_of("/\\") + 1);
+   return name.substr(0, name.find_last_of('.')) + ".txt";
+}
+
+static void usage(const char *argv0)
+{
+   fprintf(stderr, "Usage: %s [options] <path/to/dinothawr.game | level.tmx...>\n", argv0);
+   fprintf(stderr, "  --threads N   Search threads (default: all cores).\n");
+   fprintf(stderr, "  --memory MB   Memory budget for visited states per level (default: 2048).\n");
+   fprintf(stderr, "  --level NAME  Only solve levels whose path contains NAME.\n");
+   fprintf(stderr, "  --scripts DIR Write solutions as headless runner input scripts to DIR.\n");
+}
+
+static bool parse_options(int argc, char *argv[], Options& opts)
+{
+   for (int i = 1; i < argc; i++)
+   {
+      string arg = argv[i];
+      bool has_value = i + 1 < argc;
+
+      if (arg == "--threads" && has_value)
+         opts.threads = strtoul(argv[++i], NULL, 0);
+      else if (arg == "--memory" && has_value)
+         opts.memory = strtoul(argv[++i], NULL, 0);
+      else if (arg == "--level" && has_value)
+         opts.filter = argv[++i];
+      else if (arg == "--scripts" && has_value)
+         opts.scripts = argv[++i];
+      else if (arg[0] != '-')
+         opts.paths.push_back(arg);
+      else
+         return false;
+   }
+
+   if (!opts.threads)
+      opts.threads = 1;
+
+   return !opts.paths.empty();
+}
+
+int main(int argc, char *argv[])
+{
+   Options opts;
+   if (!parse_options(argc, argv, opts))
+   {
+      usage(argv[0]);
+      return 1;
+   }
+
+   try
+   {
+      vector<string> paths;
+      const string& first = opts.paths[0];
+      if (opts.paths.size() == 1 && first.size() > 5 && first.compare(first.size() - 5, 5, ".game") == 0)
+      {
+         set_basedir(Blit::Utils::basedir(opts.paths[0]));
+         GameManager manager(opts.paths[0],
+               [](Input) { return false; },
+               [](const void*, unsigned, unsigned, size_t) {});
+         paths = manager.level_paths();
+      }
+      else
+         paths = opts.paths;
+
+      printf("%-32s %6s %12s %12s %12s %8s %9s %9s %8s\n",
+            "Level", "Pushes", "States", "Expanded", "Nodes/s", "B/state", "Table MB", "Seconds", "Replay");
+
+      unsigned failed = 0;
+      uint64_t total_expanded = 0;
+      double total_time = 0.0;
+
+      for (auto& path : paths)
+      {
+         if (path.find(opts.filter) == string::npos)
+            continue;
+
+         try
+         {
+            Game game(path);
+            Solver solver(game.rules(), game.get_state());
+            Solver::Result res = solver.solve(opts.threads, size_t(opts.memory) << 20);
+
+            if (!res.solved)
+            {
+               printf("%-32s UNSOLVABLE after %llu states\n", path.c_str(),
+                     static_cast<unsigned long long>(res.states));
+               failed++;
+               continue;
+            }
+
+            vector<unsigned> input = Solver::replay_input(game.rules(), game.get_state(), res.solution);
+            if (input.empty())
+               failed++;
+            else if (!opts.scripts.empty())
+               write_script(Blit::Utils::join(opts.scripts, "/", script_name(path)), path, input);
+
+            printf("%-32s %6u %12llu %12llu %12.0f %8u %9.1f %9.3f %8s\n",
+                  path.c_str(), res.pushes,
+                  static_cast<unsigned long long>(res.states),
+                  static_cast<unsigned long long>(res.expanded),
+                  res.expanded / res.seconds,
+                  static_cast<unsigned>(res.bytes_per_state),
+                  res.states * res.bytes_per_state / (1024.0 * 1024.0),
+                  res.seconds,
+                  input.empty() ? "FAILED" : "ok");
+
+            total_expanded += res.expanded;
+            total_time     += res.seconds;
+         }
+         catch (const exception& e)
+         {
+            printf("%-32s FAILED: %s\n", path.c_str(), e.what());
+            failed++;
+         }
+      }
+
+      printf("Expanded %llu states in %.2f s on %u threads: %.0f nodes/s.\n",
+            static_cast<unsigned long long>(total_expanded), total_time, opts.threads,
+            total_time > 0.0 ? total_expanded / total_time : 0.0);
+
+      return failed ? 1 : 0;
+   }
+   catch (const exception& e)
+   {
+      fprintf(stderr, "Fatal: %s\n", e.what());
+      return 1;
+   }
+}
@@ -79,6 +79,34 @@ namespace Blit
             return ".";
       }
 
+      // Resolves "." and ".." and repeated separators without touching the file system.
+      inline std::string canonical_path(const std::string& path)
+      {
+         bool absolute = !path.empty() && (path[0] == '/' || path[0] == '\\');
+         std::vector<std::string> parts;
+         std::string part;
+
+         for (std::size_t i = 0; i <= path.size(); i++)
+         {
+            if (i < path.size() && path[i] != '/' && path[i] != '\\')
+            {
+               part += path[i];
+               continue;
+            }
+
+            if (part == ".." && !parts.empty() && parts.back() != "..")
+               parts.pop_back();
+            else if (!part.empty() && part != "." && !(part == ".." && absolute))
+               parts.push_back(part);
+            part.clear();
+         }
+
+         std::string canonical = absolute ? "/" : "";
+         for (std::size_t i = 0; i < parts.size(); i++)
+            canonical += i ? "/" + parts[i] : parts[i];
+         return canonical.empty() ? "." : canonical;
+      }
+
       inline std::string tolower(const std::string& str)
       {
          std::string tmp;